@@ -131,6 +131,8 @@
 #define SSL_DEFAULT_VHOST_NAME  ("_default_:443")
 #define SSL_MAX_STR_LEN         (2048)
 #define SSL_MAX_PASSWORD_LEN    (256)
+/* Maximum plaintext size of a single SSL/TLS record */
+#define SSL_MAX_RECORD_SZ       (16384)
 
 #define SSL_CVERIFY_UNSET           (-1)
 #define SSL_CVERIFY_NONE            (0)
@@ -292,6 +294,9 @@ typedef struct {
     } reneg_state;
     apr_socket_t   *sock;
     apr_pollset_t  *pollset;
+    /* Transport layer used instead of the sock */
+    tcn_nlayer_t   *net;
+    void           *opaque;
 } tcn_ssl_conn_t;
 
 
@@ -124,6 +124,14 @@
 #define J2P(P, T)       ((T)LLT((jlong)P))
 /* On stack buffer size */
 #define TCN_BUFFER_SZ   8192
+/* Default ring buffer size of the in-memory socket pair */
+#define TCN_MEMNET_SIZE     65536
+/* Default capture ring size */
+#define TCN_CAPTURE_SIZE    (1024 * 1024)
+/* Maximum replayed connections waiting for the accept */
+#define TCN_REPLAY_MAX      256
+/* Number of attachment slots in each socket */
+#define TCN_SOCKET_SLOTS    8
 #define TCN_STDARGS     JNIEnv *e, jobject o
 #define TCN_IMPARGS     JNIEnv *e, jobject o, void *sock
 #define TCN_IMPCALL(X)  e, o, X->opaque
@@ -141,6 +149,7 @@
 #define TCN_SOCKET_SSL      2
 #define TCN_SOCKET_UNIX     3
 #define TCN_SOCKET_NTPIPE   4
+#define TCN_SOCKET_MEMORY   5
 
 #define TCN_SOCKET_GET_POOL 0
 #define TCN_SOCKET_GET_IMPL 1
@@ -159,10 +168,57 @@ typedef struct {
     apr_status_t (APR_THREAD_FUNC *send) (apr_socket_t *, const char *, apr_size_t *);
     apr_status_t (APR_THREAD_FUNC *sendv)(apr_socket_t *, const struct iovec *, apr_int32_t, apr_size_t *);
     apr_status_t (APR_THREAD_FUNC *recv) (apr_socket_t *, char *, apr_size_t *);
+    apr_status_t (APR_THREAD_FUNC *recvv)(apr_socket_t *, const struct iovec *, apr_int32_t, apr_size_t *);
 } tcn_nlayer_t;
 
 typedef struct tcn_socket_t tcn_socket_t;
 typedef struct tcn_pfde_t   tcn_pfde_t;
+typedef struct tcn_pacer_t  tcn_pacer_t;
+typedef struct tcn_nlink_t  tcn_nlink_t;
+
+/* Filter layer pushed on top of the socket layer.
+ * The link is passed as the apr_socket_t argument of its
+ * functions; each one forwards to the layer below using
+ * TCN_NLAYER_NEXT(link, fn)(link->next_opaque, ...).
+ * The cleanup of a link removed by Socket.layerPop runs with the
+ * next layer replaced by one that does nothing and fails the I/O.
+ */
+struct tcn_nlink_t {
+    tcn_nlayer_t net;           /* Functions of this layer */
+    tcn_nlayer_t *next;         /* Layer below */
+    void         *next_opaque;
+    tcn_nlink_t  *below;        /* Previously pushed link, NULL if none */
+    tcn_socket_t *sock;
+    void         *ctx;          /* Filter private data */
+};
+
+#define TCN_NLAYER_NEXT(L, FN)  (*(L)->next->FN)
+
+typedef struct {
+    apr_uint64_t bytes_in;      /* Bytes received */
+    apr_uint64_t bytes_out;     /* Bytes sent */
+    apr_uint64_t reads;         /* Number of receive calls */
+    apr_uint64_t writes;        /* Number of send calls */
+    apr_uint64_t read_again;    /* Receive calls that returned EAGAIN */
+    apr_uint64_t write_again;   /* Send calls that returned EAGAIN */
+    apr_time_t   first;         /* Time of the first I/O call */
+    apr_time_t   last;          /* Time of the last I/O call */
+    int          enabled;       /* Kept allocated while disabled */
+} tcn_sockstat_t;
+
+typedef struct {
+    char       *buf;
+    apr_size_t size;      /* Buffer capacity */
+    apr_size_t len;       /* Bytes buffered */
+    int        flags;     /* TCN_WBUF_* flags */
+    int        corked;    /* TCP_CORK is currently set */
+} tcn_wbuf_t;
+
+typedef struct {
+    int        fd[2];     /* Pipe used by the splice */
+    apr_size_t pending;   /* Bytes in the pipe not yet written */
+    apr_status_t error;   /* Error deferred to the next call */
+} tcn_splice_t;
 
 struct tcn_pfde_t {
     APR_RING_ENTRY(tcn_pfde_t) link;
@@ -180,8 +236,54 @@ struct tcn_socket_t {
     tcn_pfde_t   *pe;
     apr_time_t          last_active;
     apr_interval_time_t timeout;
+    apr_size_t          zc_min;   /* MSG_ZEROCOPY threshold, 0 if disabled */
+    /* Zero-copy sends issued and completed. Both wrap at 32 bits
+     * like the kernel notification ids. The sending thread bumps
+     * zc_sent, the thread that drains the error queue (normally the
+     * Poll thread, see tcn_zerocopy_drain) advances zc_done.
+     */
+    volatile apr_uint32_t zc_sent;
+    volatile apr_uint32_t zc_done;
+    volatile apr_uint32_t zc_lock;  /* Set while the error queue is drained */
+    apr_status_t        zc_error; /* Socket error found in the error queue */
+    tcn_splice_t        *splice;
+    tcn_sockstat_t      *stat;    /* I/O counters, NULL if disabled */
+    jlong               slot[TCN_SOCKET_SLOTS];
+    jobject             *refs;    /* Global ref slots, created on first use */
+    tcn_wbuf_t          *wbuf;    /* Write-combining buffer, NULL if disabled */
+    tcn_pacer_t         *pacer;   /* Send rate limiter, NULL if disabled */
+    int                 proxy;    /* PROXY protocol mode of the listener,
+                                   * or of the header still to be read
+                                   * on the accepted socket, negative
+                                   * error if the header was rejected
+                                   */
+    apr_time_t          proxy_deadline; /* Time the header must arrive by */
+    apr_sockaddr_t      *proxy_src; /* Client address from the PROXY header */
+    apr_sockaddr_t      *proxy_dst; /* Original destination address */
+    tcn_nlink_t         *link;    /* Top of the pushed layers, NULL if none */
 };
 
+/* Directions of the I/O for the tcn_nlayer_filters */
+#define TCN_NLAYER_IN       1
+#define TCN_NLAYER_OUT      2
+
+/* True if the socket output can be driven directly through the s->sock.
+ * The layers that only filter the input, like the capture, do not count.
+ */
+#define TCN_SOCKET_IS_APR(S)    \
+    ((S)->net->type == TCN_SOCKET_APR && \
+     !tcn_nlayer_filters((S), TCN_NLAYER_OUT))
+
+/* True if the s->sock is a plain stream socket, either TCP or Local,
+ * and no layer filters the I/O in the direction D, so that it is
+ * usable by the sendfile, splice and the poll based I/O paths
+ */
+#define TCN_SOCKET_IS_STREAM_IO(S, D) \
+    ((S)->sock != NULL && !tcn_nlayer_filters((S), (D)) &&  \
+     ((S)->net->type == TCN_SOCKET_APR || (S)->net->type == TCN_SOCKET_UNIX))
+
+#define TCN_SOCKET_IS_STREAM(S) TCN_SOCKET_IS_STREAM_IO((S), TCN_NLAYER_OUT)
+
 /* Private helper functions */
 void            tcn_Throw(JNIEnv *, const char *, ...);
 void            tcn_ThrowException(JNIEnv *, const char *);
@@ -196,6 +298,19 @@ char           *tcn_strdup(JNIEnv *, jstring);
 char           *tcn_pstrdup(JNIEnv *, jstring, apr_pool_t *);
 apr_status_t    tcn_load_finfo_class(JNIEnv *, jclass);
 apr_status_t    tcn_load_ainfo_class(JNIEnv *, jclass);
+apr_status_t    tcn_service_start(volatile apr_uint32_t *,
+                                  apr_status_t (*)(void));
+void            tcn_pool_pre_cleanup_register(apr_pool_t *, const void *,
+                                              apr_status_t (*)(void *));
+int             tcn_zerocopy_drain(tcn_socket_t *);
+apr_status_t    tcn_nlayer_push(tcn_socket_t *, const tcn_nlayer_t *, void *);
+void           *tcn_nlayer_pop(tcn_socket_t *);
+void           *tcn_nlayer_base(tcn_socket_t *);
+int             tcn_nlayer_filters(tcn_socket_t *, int);
+apr_status_t    tcn_socket_pair(tcn_socket_t **, tcn_socket_t **,
+                                apr_size_t, apr_pool_t *, apr_pool_t *);
+apr_status_t    tcn_socket_import(tcn_socket_t **, apr_os_sock_t,
+                                  apr_pool_t *);
 
 #define J2S(V)  c##V
 #define J2L(V)  p##V
@@ -314,4 +429,88 @@ typedef struct {
 
 #define TCN_NO_SOCKET_TIMEOUT -2
 
+/* Default TCP_DEFER_ACCEPT timeout in seconds used by
+ * Socket.acceptfilter on platforms without accept filters.
+ */
+#define TCN_DEFER_ACCEPT_TIMEOUT    30
+
+/* Default minimum send size for the MSG_ZEROCOPY sends.
+ * Smaller writes are cheaper to copy then to pin.
+ */
+#define TCN_ZEROCOPY_THRESHOLD      16384
+/* Returned by the Poll.poll instead of APR_POLLERR when
+ * the socket error queue only had zero-copy completions.
+ */
+#define TCN_POLLZCOPY               0x0100
+
+/* Maximum number of bytes moved by a single splice
+ * while relaying the data between two sockets.
+ */
+#define TCN_SPLICE_CHUNK            65536
+/* Socket.splice flags.
+ * TCN_SPLICE_MORE hints that more data follows (SPLICE_F_MORE),
+ * TCN_SPLICE_NONBLOCK returns APR_EAGAIN instead of waiting
+ * for the socket timeout, for use with the Poll.
+ */
+#define TCN_SPLICE_MORE             0x0001
+#define TCN_SPLICE_NONBLOCK         0x0002
+
+/* Maximum number of datagrams moved by a
+ * single recvfromBatch or sendtoBatch call.
+ */
+#define TCN_MMSG_MAX                64
+
+/* Maximum number of wire datagrams the kernel
+ * accepts in a single UDP_SEGMENT send.
+ */
+#define TCN_UDP_MAX_SEGMENTS        64
+
+/* Default upper limit of the per-thread bounce buffer
+ * used for heap byte[] transfers above TCN_BUFFER_SZ.
+ */
+#define TCN_BOUNCE_MAX              (1024 * 1024)
+
+/* Default time a deferred close drains the input
+ * before closing, and the maximum number of sockets
+ * the close thread keeps lingering at once.
+ */
+#define TCN_CLOSE_LINGER            apr_time_from_sec(2)
+#define TCN_CLOSE_MAX               256
+
+/* Socket.wbufSet flags.
+ * TCN_WBUF_CORK keeps TCP_CORK (TCP_NOPUSH) set while data is
+ * buffered and clears it on the end of response flush.
+ */
+#define TCN_WBUF_CORK               0x0001
+
+/* Socket.proxyProtocol modes, the time allowed for the
+ * header to arrive after the accept and the maximum header
+ * size accepted.
+ */
+#define TCN_PROXY_NONE              0
+#define TCN_PROXY_REQUIRED          1
+#define TCN_PROXY_OPTIONAL          2
+#define TCN_PROXY_TIMEOUT           apr_time_from_sec(3)
+#define TCN_PROXY_MAX               4096
+
+/* Address resolver cache defaults: number of cached names,
+ * lifetime of the resolved and of the failed lookups and the
+ * number of the background resolver threads.
+ */
+#define TCN_RESOLVER_MAX            1024
+#define TCN_RESOLVER_TTL            apr_time_from_sec(30)
+#define TCN_RESOLVER_NEGATIVE_TTL   apr_time_from_sec(5)
+#define TCN_RESOLVER_THREADS        2
+/* Longest time Address.getnameinfo waits for an uncached
+ * name when the reverse cache is enabled, and the flag that
+ * makes it return the address at once on a cache miss.
+ */
+#define TCN_RESOLVER_DEADLINE       apr_time_from_msec(500)
+#define TCN_NI_CACHED               0x10000
+
+/* Prefork worker slot states */
+#define TCN_PREFORK_FREE            0
+#define TCN_PREFORK_RUNNING         1
+#define TCN_PREFORK_DRAINING        2
+
 #endif /* TCN_H */
@@ -96,6 +96,10 @@ SOURCE=.\src\address.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\src\capture.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\src\dir.c
 # End Source File
 # Begin Source File
@@ -120,6 +124,10 @@ SOURCE=.\src\lock.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\src\memnet.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\src\misc.c
 # End Source File
 # Begin Source File
@@ -144,6 +152,10 @@ SOURCE=.\src\pool.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\src\prefork.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\src\proc.c
 # End Source File
 # Begin Source File
@@ -20,6 +20,10 @@
  * @version $Id$
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Needed for struct ucred */
+#define _GNU_SOURCE
+#endif
 
 #include "tcn.h"
 #include "apr_thread_mutex.h"
@@ -59,16 +63,72 @@ void uxp_network_dump_statistics()
 #define TCN_UXP_SERVER      3
 
 #define TCN_UNIX_MAXPATH    1024
+#define TCN_UXP_MAXFDS      64      /* Descriptors passed in one message */
 typedef struct {
     apr_pool_t          *pool;
     apr_socket_t        *sock;               /* APR socket */
     int                 sd;
     struct sockaddr_un  uxaddr;
+    socklen_t           uxlen;                /* Used length of the uxaddr */
     int                 timeout;
     int                 mode;                 /* Client or server mode */
     char                name[TCN_UNIX_MAXPATH+1];
 } tcn_uxp_conn_t;
 
+/* Set the name, a leading '@' selects the Linux abstract namespace */
+static apr_status_t uxp_addr_set(tcn_uxp_conn_t *con, const char *name)
+{
+    apr_size_t len = strlen(name);
+
+    if (len >= sizeof(con->uxaddr.sun_path))
+        return APR_ENAMETOOLONG;
+    con->uxaddr.sun_family = AF_UNIX;
+    memcpy(con->uxaddr.sun_path, name, len + 1);
+    con->uxlen = (socklen_t)(APR_OFFSETOF(struct sockaddr_un, sun_path) +
+                             len + 1);
+#ifdef __linux__
+    if (name[0] == '@') {
+        /* Abstract names are not NUL terminated */
+        con->uxaddr.sun_path[0] = '\0';
+        con->uxlen--;
+    }
+#endif
+    return APR_SUCCESS;
+}
+
+/* The timeout is applied to the APR socket once it is connected,
+ * so that the blocking accept and connect keep working.
+ */
+static apr_status_t uxp_timeout_apply(tcn_uxp_conn_t *con)
+{
+    if (con->mode != TCN_UXP_CLIENT && con->mode != TCN_UXP_ACCEPTED)
+        return APR_SUCCESS;
+    if (con->timeout < 0)
+        return apr_socket_timeout_set(con->sock, -1);
+    else
+        return apr_socket_timeout_set(con->sock,
+                                      apr_time_from_msec(con->timeout));
+}
+
+/* Wait until the socket is ready or the timeout expires */
+static apr_status_t uxp_wait(tcn_uxp_conn_t *con, apr_int16_t events)
+{
+    apr_pollfd_t pfd;
+    apr_int32_t  n;
+    apr_status_t rv;
+
+    pfd.p         = con->pool;
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s    = con->sock;
+    pfd.reqevents = events;
+    pfd.rtnevents = 0;
+    do {
+        rv = apr_poll(&pfd, 1, &n, con->timeout < 0 ? -1 :
+                      apr_time_from_msec(con->timeout));
+    } while (APR_STATUS_IS_EINTR(rv));
+    return rv;
+}
+
 static apr_status_t APR_THREAD_FUNC
 uxp_socket_timeout_set(apr_socket_t *sock, apr_interval_time_t t)
 {
@@ -77,7 +137,7 @@ uxp_socket_timeout_set(apr_socket_t *sock, apr_interval_time_t t)
         con->timeout = -1;
     else
         con->timeout = (int)(apr_time_as_msec(t));
-    return APR_SUCCESS;
+    return uxp_timeout_apply(con);
 }
 
 static apr_status_t APR_THREAD_FUNC
@@ -109,13 +169,11 @@ static apr_status_t uxp_cleanup(void *data)
 {
     tcn_uxp_conn_t *con = (tcn_uxp_conn_t *)data;
 
+    /* The socket itself is owned and closed by the tcn_socket_t */
     if (con) {
-        if (con->sock) {
-            apr_socket_close(con->sock);
-            con->sock = NULL;
-        }
         if (con->mode == TCN_UXP_SERVER) {
-            unlink(con->name);
+            if (con->uxaddr.sun_path[0])
+                unlink(con->uxaddr.sun_path);
             con->mode = TCN_UXP_UNKNOWN;
         }
     }
@@ -171,9 +229,14 @@ static apr_status_t uxp_socket_cleanup(void *data)
 {
     tcn_socket_t *s = (tcn_socket_t *)data;
 
-    if (s->net->cleanup) {
+    if (s->net && s->net->cleanup) {
         (*s->net->cleanup)(s->opaque);
-        s->net->cleanup = NULL;
+        s->net = NULL;
+    }
+    if (s->sock) {
+        apr_socket_t *as = s->sock;
+        s->sock = NULL;
+        apr_socket_close(as);
     }
 #ifdef TCN_DO_STATISTICS
     apr_atomic_inc32(&uxp_cleared);
@@ -192,7 +255,8 @@ static tcn_nlayer_t uxp_socket_layer = {
     uxp_socket_timeout_set,
     uxp_socket_send,
     uxp_socket_sendv,
-    uxp_socket_recv
+    uxp_socket_recv,
+    NULL
 };
 
 TCN_IMPLEMENT_CALL(jlong, Local, create)(TCN_STDARGS, jstring name,
@@ -201,6 +265,7 @@ TCN_IMPLEMENT_CALL(jlong, Local, create)(TCN_STDARGS, jstring name,
     apr_pool_t *p = J2P(pool, apr_pool_t *);
     tcn_socket_t   *s   = NULL;
     tcn_uxp_conn_t *con = NULL;
+    apr_status_t rv;
     int sd;
     TCN_ALLOC_CSTRING(name);
 
@@ -219,13 +284,13 @@ TCN_IMPLEMENT_CALL(jlong, Local, create)(TCN_STDARGS, jstring name,
     con->mode = TCN_UXP_UNKNOWN;
     con->timeout = DEFTIMEOUT;
     con->sd = sd;
-    con->uxaddr.sun_family = AF_UNIX;
-    if (J2S(name)) {
-        strcpy(con->uxaddr.sun_path, J2S(name));
-        TCN_FREE_CSTRING(name);
+    rv = uxp_addr_set(con, J2S(name) ? J2S(name) : DEFNAME);
+    TCN_FREE_CSTRING(name);
+    if (rv != APR_SUCCESS) {
+        close(sd);
+        tcn_ThrowAPRException(e, rv);
+        return 0;
     }
-    else
-        strcpy(con->uxaddr.sun_path, DEFNAME);
     s = (tcn_socket_t *)apr_pcalloc(p, sizeof(tcn_socket_t));
     s->pool   = p;
     s->net    = &uxp_socket_layer;
@@ -235,6 +300,8 @@ TCN_IMPLEMENT_CALL(jlong, Local, create)(TCN_STDARGS, jstring name,
                               apr_pool_cleanup_null);
 
     apr_os_sock_put(&(con->sock), &(con->sd), p);
+    /* Lets the Poll, sendfile and splice use the socket directly */
+    s->sock = con->sock;
 
     return P2J(s);
 
@@ -249,9 +316,9 @@ TCN_IMPLEMENT_CALL(jint, Local, bind)(TCN_STDARGS, jlong sock,
     TCN_ASSERT(sock != 0);
     if (s->net->type == TCN_SOCKET_UNIX) {
         int rc;
-        tcn_uxp_conn_t *c = (tcn_uxp_conn_t *)s->opaque;
+        tcn_uxp_conn_t *c = (tcn_uxp_conn_t *)tcn_nlayer_base(s);
         c->mode = TCN_UXP_SERVER;
-        rc = bind(c->sd, (struct sockaddr *)&(c->uxaddr), sizeof(c->uxaddr));
+        rc = bind(c->sd, (struct sockaddr *)&(c->uxaddr), c->uxlen);
         if (rc < 0)
             return errno;
         else
@@ -269,7 +336,7 @@ TCN_IMPLEMENT_CALL(jint, Local, listen)(TCN_STDARGS, jlong sock,
 
     TCN_ASSERT(sock != 0);
     if (s->net->type == TCN_SOCKET_UNIX) {
-        tcn_uxp_conn_t *c = (tcn_uxp_conn_t *)s->opaque;
+        tcn_uxp_conn_t *c = (tcn_uxp_conn_t *)tcn_nlayer_base(s);
         c->mode = TCN_UXP_SERVER;
         return apr_socket_listen(c->sock, (apr_int32_t)backlog);
     }
@@ -290,18 +357,19 @@ TCN_IMPLEMENT_CALL(jlong, Local, accept)(TCN_STDARGS, jlong sock)
     TCN_THROW_IF_ERR(apr_pool_create(&p, s->pool), p);
     if (s->net->type == TCN_SOCKET_UNIX) {
         apr_socklen_t len;
-        tcn_uxp_conn_t *c = (tcn_uxp_conn_t *)s->opaque;
+        tcn_uxp_conn_t *c = (tcn_uxp_conn_t *)tcn_nlayer_base(s);
         con = (tcn_uxp_conn_t *)apr_pcalloc(p, sizeof(tcn_uxp_conn_t));
         con->pool = p;
         con->mode = TCN_UXP_ACCEPTED;
         con->timeout = c->timeout;
-        len = sizeof(c->uxaddr);
+        len = sizeof(con->uxaddr);
         /* Block until a client connects */
         con->sd = accept(c->sd, (struct sockaddr *)&(con->uxaddr), &len);
         if (con->sd < 0) {
             tcn_ThrowAPRException(e, apr_get_os_error());
             goto cleanup;
         }
+        con->uxlen = len;
     }
     else {
         tcn_ThrowAPRException(e, APR_ENOTIMPL);
@@ -319,6 +387,8 @@ TCN_IMPLEMENT_CALL(jlong, Local, accept)(TCN_STDARGS, jlong sock)
                                   uxp_socket_cleanup,
                                   apr_pool_cleanup_null);
         apr_os_sock_put(&(con->sock), &(con->sd), p);
+        a->sock = con->sock;
+        uxp_timeout_apply(con);
     }
     return P2J(a);
 cleanup:
@@ -339,17 +409,238 @@ TCN_IMPLEMENT_CALL(jint, Local, connect)(TCN_STDARGS, jlong sock,
     TCN_ASSERT(sock != 0);
     if (s->net->type != TCN_SOCKET_UNIX)
         return APR_ENOTSOCK;
-    con = (tcn_uxp_conn_t *)s->opaque;
+    con = (tcn_uxp_conn_t *)tcn_nlayer_base(s);
     if (con->mode != TCN_UXP_UNKNOWN)
         return APR_EINVAL;
     do {
         rc = connect(con->sd, (const struct sockaddr *)&(con->uxaddr),
-                     sizeof(con->uxaddr));
+                     con->uxlen);
     } while (rc == -1 && errno == EINTR);
 
     if (rc == -1 && errno != EISCONN)
         return errno;
     con->mode = TCN_UXP_CLIENT;
 
+    return uxp_timeout_apply(con);
+}
+
+TCN_IMPLEMENT_CALL(jint, Local, peerCred)(TCN_STDARGS, jlong sock,
+                                          jintArray cred)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_uxp_conn_t *con = NULL;
+#ifdef SO_PEERCRED
+    struct ucred uc;
+    socklen_t len = sizeof(uc);
+    jint c[3];
+#endif
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    if (s->net->type != TCN_SOCKET_UNIX)
+        return APR_ENOTSOCK;
+    if ((*e)->GetArrayLength(e, cred) < 3)
+        return APR_EINVAL;
+    con = (tcn_uxp_conn_t *)tcn_nlayer_base(s);
+    if (con->mode != TCN_UXP_CLIENT && con->mode != TCN_UXP_ACCEPTED)
+        return APR_EINVAL;
+#ifdef SO_PEERCRED
+    if (getsockopt(con->sd, SOL_SOCKET, SO_PEERCRED, &uc, &len) < 0)
+        return apr_get_netos_error();
+    c[0] = (jint)uc.pid;
+    c[1] = (jint)uc.uid;
+    c[2] = (jint)uc.gid;
+    (*e)->SetIntArrayRegion(e, cred, 0, 3, c);
     return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+/* Pass the descriptors of the socks to the peer process (SCM_RIGHTS).
+ * At least one byte of data has to be sent along with them.
+ * Only plain sockets can be passed, the state of the SSL or the
+ * pushed layers and any buffered data stays in this process.
+ */
+TCN_IMPLEMENT_CALL(jint, Local, sendSockets)(TCN_STDARGS, jlong sock,
+                                             jlongArray socks,
+                                             jbyteArray data, jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_uxp_conn_t *con = NULL;
+    char buf[TCN_BUFFER_SZ];
+    union {
+        struct cmsghdr h;
+        char           b[CMSG_SPACE(sizeof(int) * TCN_UXP_MAXFDS)];
+    } cm;
+    struct cmsghdr *ch;
+    struct msghdr  mh;
+    struct iovec   iov;
+    jlong  sa[TCN_UXP_MAXFDS];
+    int    fds[TCN_UXP_MAXFDS];
+    jsize  i, n;
+    ssize_t rc;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    if (s->net->type != TCN_SOCKET_UNIX)
+        return -(jint)APR_ENOTSOCK;
+    con = (tcn_uxp_conn_t *)tcn_nlayer_base(s);
+    if (con->mode != TCN_UXP_CLIENT && con->mode != TCN_UXP_ACCEPTED)
+        return -(jint)APR_EINVAL;
+    n = (*e)->GetArrayLength(e, socks);
+    if (n < 1 || n > TCN_UXP_MAXFDS || len < 1 ||
+        len > (*e)->GetArrayLength(e, data))
+        return -(jint)APR_EINVAL;
+    if (len > TCN_BUFFER_SZ)
+        len = TCN_BUFFER_SZ;
+    (*e)->GetLongArrayRegion(e, socks, 0, n, sa);
+    if ((*e)->ExceptionCheck(e))
+        return -(jint)APR_EINVAL;
+    for (i = 0; i < n; i++) {
+        tcn_socket_t *t = J2P(sa[i], tcn_socket_t *);
+        apr_os_sock_t sd;
+
+        if (t == NULL || t->net == NULL || !TCN_SOCKET_IS_APR(t) ||
+            t->sock == NULL)
+            return -(jint)APR_ENOTSOCK;
+        apr_os_sock_get(&sd, t->sock);
+        fds[i] = sd;
+    }
+    (*e)->GetByteArrayRegion(e, data, 0, len, (jbyte *)buf);
+    if ((*e)->ExceptionCheck(e))
+        return -(jint)APR_EINVAL;
+
+    memset(&cm, 0, sizeof(cm));
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base      = buf;
+    iov.iov_len       = len;
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = cm.b;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    ch = CMSG_FIRSTHDR(&mh);
+    ch->cmsg_level = SOL_SOCKET;
+    ch->cmsg_type  = SCM_RIGHTS;
+    ch->cmsg_len   = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(ch), fds, sizeof(int) * n);
+
+    for (;;) {
+        apr_status_t rv;
+
+        rc = sendmsg(con->sd, &mh, 0);
+        if (rc >= 0)
+            return (jint)rc;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -(jint)apr_get_netos_error();
+        if ((rv = uxp_wait(con, APR_POLLOUT)) != APR_SUCCESS)
+            return -(jint)rv;
+    }
+}
+
+/* Receive the data and the sockets passed by the peer process.
+ * Each descriptor is wrapped into a new socket allocated from
+ * its own child pool of the pool. The unused entries of the socks
+ * are set to zero and the descriptors that do not fit are closed.
+ * Returns the length of the data or negative error, APR_ENOSPC
+ * if the peer passed more than TCN_UXP_MAXFDS descriptors.
+ */
+TCN_IMPLEMENT_CALL(jint, Local, recvSockets)(TCN_STDARGS, jlong sock,
+                                             jlongArray socks,
+                                             jbyteArray data, jlong pool)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_pool_t   *p = J2P(pool, apr_pool_t *);
+    tcn_uxp_conn_t *con = NULL;
+    char buf[TCN_BUFFER_SZ];
+    union {
+        struct cmsghdr h;
+        char           b[CMSG_SPACE(sizeof(int) * TCN_UXP_MAXFDS)];
+    } cm;
+    struct cmsghdr *ch;
+    struct msghdr  mh;
+    struct iovec   iov;
+    jlong  sa[TCN_UXP_MAXFDS];
+    jsize  k = 0, n, len;
+    int    flags = 0;
+    ssize_t rc;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(pool != 0);
+    if (s->net->type != TCN_SOCKET_UNIX)
+        return -(jint)APR_ENOTSOCK;
+    con = (tcn_uxp_conn_t *)tcn_nlayer_base(s);
+    if (con->mode != TCN_UXP_CLIENT && con->mode != TCN_UXP_ACCEPTED)
+        return -(jint)APR_EINVAL;
+    n   = (*e)->GetArrayLength(e, socks);
+    len = (*e)->GetArrayLength(e, data);
+    if (n < 1 || len < 1)
+        return -(jint)APR_EINVAL;
+    if (n > TCN_UXP_MAXFDS)
+        n = TCN_UXP_MAXFDS;
+    if (len > TCN_BUFFER_SZ)
+        len = TCN_BUFFER_SZ;
+
+    memset(&cm, 0, sizeof(cm));
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base      = buf;
+    iov.iov_len       = len;
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = cm.b;
+    /* Room for all the descriptors the peer may pass,
+     * not only for the ones that fit into the socks.
+     */
+    mh.msg_controllen = sizeof(cm.b);
+#ifdef MSG_CMSG_CLOEXEC
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+    for (;;) {
+        apr_status_t rv;
+
+        rc = recvmsg(con->sd, &mh, flags);
+        if (rc > 0)
+            break;
+        if (rc == 0)
+            return -(jint)APR_EOF;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -(jint)apr_get_netos_error();
+        if ((rv = uxp_wait(con, APR_POLLIN)) != APR_SUCCESS)
+            return -(jint)rv;
+    }
+    if (mh.msg_flags & MSG_CTRUNC) {
+        /* The kernel dropped the descriptors that did not fit,
+         * close the delivered ones and fail the whole message.
+         */
+        n = 0;
+    }
+
+    for (ch = CMSG_FIRSTHDR(&mh); ch; ch = CMSG_NXTHDR(&mh, ch)) {
+        int *fd;
+        apr_size_t i, nfd;
+
+        if (ch->cmsg_level != SOL_SOCKET || ch->cmsg_type != SCM_RIGHTS)
+            continue;
+        fd  = (int *)CMSG_DATA(ch);
+        nfd = (ch->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < nfd; i++) {
+            tcn_socket_t *t = NULL;
+            if (k < n && tcn_socket_import(&t, fd[i], p) == APR_SUCCESS)
+                sa[k++] = P2J(t);
+            else
+                close(fd[i]);
+        }
+    }
+    if (n == 0)
+        return -(jint)APR_ENOSPC;
+    while (k < n)
+        sa[k++] = 0;
+    (*e)->SetLongArrayRegion(e, socks, 0, n, sa);
+    (*e)->SetByteArrayRegion(e, data, 0, (jsize)rc, (jbyte *)buf);
+    return (jint)rc;
 }
@@ -290,7 +290,8 @@ static tcn_nlayer_t ntp_socket_layer = {
     ntp_socket_timeout_set,
     ntp_socket_send,
     ntp_socket_sendv,
-    ntp_socket_recv
+    ntp_socket_recv,
+    NULL
 };
 
 static BOOL create_DACL(LPSECURITY_ATTRIBUTES psa)
@@ -21,11 +21,451 @@
  */
 
 #include "tcn.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_strings.h"
+#include "apr_ring.h"
 
-TCN_IMPLEMENT_CALL(jlong, Address, info)(TCN_STDARGS,
-                                         jstring hostname,
-                                         jint family, jint port,
-                                         jint flags, jlong pool)
+/* Resolver cache.
+ * Entries are keyed by host, family, port and flags. The addresses
+ * of each entry live in their own pool and are copied into the
+ * caller pool on every hit. Expired entries are still returned
+ * while a background thread refreshes them.
+ */
+typedef struct rc_entry_t rc_entry_t;
+struct rc_entry_t {
+    apr_pool_t     *pool;       /* Entry, key and host */
+    apr_pool_t     *sapool;     /* Resolved addresses */
+    const char     *key;
+    const char     *host;
+    apr_int32_t    family;
+    apr_port_t     port;
+    apr_int32_t    flags;
+    apr_sockaddr_t *sa;         /* NULL for the failed lookups */
+    apr_status_t   status;
+    apr_time_t     expires;     /* Zero until the first lookup is done */
+    int            queued;
+    int            evicted;     /* Freed by the resolver once done */
+    rc_entry_t     *next;
+    /* Reverse lookups */
+    int            reverse;
+    int            waiters;     /* Threads waiting for the result */
+    char           *name;
+    APR_RING_ENTRY(rc_entry_t) lru;
+};
+
+APR_RING_HEAD(rn_ring_t, rc_entry_t);
+
+static volatile apr_uint32_t rc_state = 0;
+static apr_pool_t           *rc_pool   = NULL;
+static apr_thread_mutex_t   *rc_mutex  = NULL;
+static apr_thread_cond_t    *rc_cond   = NULL;
+static apr_thread_t         *rc_thread[TCN_RESOLVER_THREADS];
+static apr_hash_t           *rc_cache  = NULL;
+static rc_entry_t           *rc_head   = NULL;
+static rc_entry_t           *rc_tail   = NULL;
+static int                   rc_stop   = 0;
+static volatile apr_uint32_t rc_enabled = 0;
+/* Forward lookup cache in LRU order, most recent first */
+static struct rn_ring_t      rc_lru;
+static unsigned int          rc_max    = TCN_RESOLVER_MAX;
+static apr_interval_time_t   rc_ttl    = TCN_RESOLVER_TTL;
+static apr_interval_time_t   rc_nttl   = TCN_RESOLVER_NEGATIVE_TTL;
+/* Reverse lookup cache in LRU order, most recent first */
+static apr_hash_t           *rn_cache  = NULL;
+static struct rn_ring_t      rn_lru;
+static apr_thread_cond_t    *rn_cond   = NULL;
+static volatile apr_uint32_t rn_enabled = 0;
+static unsigned int          rn_max    = TCN_RESOLVER_MAX;
+static apr_interval_time_t   rn_ttl    = TCN_RESOLVER_TTL;
+static apr_interval_time_t   rn_nttl   = TCN_RESOLVER_NEGATIVE_TTL;
+static apr_interval_time_t   rn_wait   = TCN_RESOLVER_DEADLINE;
+
+/* Deep copy of the address list into the pool p */
+static apr_sockaddr_t *rc_copy(const apr_sockaddr_t *src, apr_pool_t *p)
+{
+    apr_sockaddr_t *first = NULL;
+    apr_sockaddr_t **last = &first;
+
+    for (; src; src = src->next) {
+        apr_sockaddr_t *d = apr_pmemdup(p, src, sizeof(apr_sockaddr_t));
+        d->pool       = p;
+        d->hostname   = src->hostname ? apr_pstrdup(p, src->hostname) : NULL;
+        d->servname   = src->servname ? apr_pstrdup(p, src->servname) : NULL;
+        d->ipaddr_ptr = (char *)d + ((char *)src->ipaddr_ptr - (char *)src);
+        d->next       = NULL;
+        *last = d;
+        last  = &d->next;
+    }
+    return first;
+}
+
+/* Store the lookup result, the entry takes the np.
+ * A failed refresh of a resolved entry keeps serving the stale
+ * addresses and is retried after the negative ttl.
+ * Must be called with the rc_mutex held.
+ */
+static void rc_store(rc_entry_t *e, apr_sockaddr_t *sa, apr_status_t rv,
+                     apr_pool_t *np)
+{
+    if (rv != APR_SUCCESS && e->sa) {
+        if (np)
+            apr_pool_destroy(np);
+        e->expires = apr_time_now() + rc_nttl;
+        return;
+    }
+    if (e->sapool)
+        apr_pool_destroy(e->sapool);
+    e->sapool  = np;
+    e->sa      = rv == APR_SUCCESS ? sa : NULL;
+    e->status  = rv;
+    e->expires = apr_time_now() + (rv == APR_SUCCESS ? rc_ttl : rc_nttl);
+}
+
+/* Must be called with the rc_mutex held */
+static void rn_store(rc_entry_t *e, char *name, apr_status_t rv,
+                     apr_pool_t *np)
+{
+    if (e->sapool)
+        apr_pool_destroy(e->sapool);
+    e->sapool  = np;
+    e->name    = rv == APR_SUCCESS ? name : NULL;
+    e->status  = rv;
+    e->expires = apr_time_now() + (rv == APR_SUCCESS ? rn_ttl : rn_nttl);
+    apr_thread_cond_broadcast(rn_cond);
+}
+
+/* Drop the entry from the cache. An entry waiting for the
+ * resolver is only unlinked and freed by the resolver thread.
+ * Must be called with the rc_mutex held.
+ */
+static void rc_remove(rc_entry_t *e)
+{
+    APR_RING_REMOVE(e, lru);
+    apr_hash_set(rc_cache, e->key, APR_HASH_KEY_STRING, NULL);
+    if (e->queued) {
+        e->evicted = 1;
+        return;
+    }
+    if (e->sapool)
+        apr_pool_destroy(e->sapool);
+    apr_pool_destroy(e->pool);
+}
+
+/* Drop the least recently used entries.
+ * Must be called with the rc_mutex held.
+ */
+static void rc_evict(void)
+{
+    while (apr_hash_count(rc_cache) >= rc_max &&
+           !APR_RING_EMPTY(&rc_lru, rc_entry_t, lru))
+        rc_remove(APR_RING_LAST(&rc_lru));
+}
+
+/* Must be called with the rc_mutex held */
+static void rc_queue(rc_entry_t *e)
+{
+    if (e->queued)
+        return;
+    e->queued = 1;
+    e->next   = NULL;
+    if (rc_tail)
+        rc_tail->next = e;
+    else
+        rc_head = e;
+    rc_tail = e;
+    apr_thread_cond_signal(rc_cond);
+}
+
+static void * APR_THREAD_FUNC rc_main(apr_thread_t *thd, void *data)
+{
+    UNREFERENCED(data);
+    for (;;) {
+        rc_entry_t *e;
+        apr_sockaddr_t *sa = NULL;
+        apr_pool_t *np = NULL;
+        char *name = NULL;
+        apr_status_t rv;
+
+        apr_thread_mutex_lock(rc_mutex);
+        while (!rc_stop && rc_head == NULL)
+            apr_thread_cond_wait(rc_cond, rc_mutex);
+        if (rc_stop) {
+            apr_thread_mutex_unlock(rc_mutex);
+            break;
+        }
+        e = rc_head;
+        if ((rc_head = e->next) == NULL)
+            rc_tail = NULL;
+        rv = apr_pool_create(&np, rc_pool);
+        /* apr_getnameinfo allocates from the address pool,
+         * so it works on a private copy.
+         */
+        if (rv == APR_SUCCESS && e->reverse)
+            sa = rc_copy(e->sa, np);
+        apr_thread_mutex_unlock(rc_mutex);
+
+        if (rv == APR_SUCCESS) {
+            if (e->reverse)
+                rv = apr_getnameinfo(&name, sa, e->flags);
+            else
+                rv = apr_sockaddr_info_get(&sa, e->host, e->family,
+                                           e->port, e->flags, np);
+        }
+        apr_thread_mutex_lock(rc_mutex);
+        if (e->reverse)
+            rn_store(e, name, rv, np);
+        else
+            rc_store(e, sa, rv, np);
+        e->queued = 0;
+        if (e->evicted) {
+            if (e->sapool)
+                apr_pool_destroy(e->sapool);
+            apr_pool_destroy(e->pool);
+        }
+        apr_thread_mutex_unlock(rc_mutex);
+    }
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t rc_cleanup(void *data)
+{
+    apr_status_t rv;
+    int i;
+
+    UNREFERENCED(data);
+    apr_thread_mutex_lock(rc_mutex);
+    rc_stop = 1;
+    apr_thread_cond_broadcast(rc_cond);
+    apr_thread_mutex_unlock(rc_mutex);
+    for (i = 0; i < TCN_RESOLVER_THREADS; i++) {
+        if (rc_thread[i])
+            apr_thread_join(&rv, rc_thread[i]);
+        rc_thread[i] = NULL;
+    }
+    /* Entries are released with the rc_pool */
+    rc_cache   = NULL;
+    rn_cache   = NULL;
+    apr_atomic_set32(&rn_enabled, 0);
+    rc_head    = NULL;
+    rc_tail    = NULL;
+    rc_stop    = 0;
+    apr_atomic_set32(&rc_enabled, 0);
+    apr_atomic_set32(&rc_state, 0);
+    return APR_SUCCESS;
+}
+
+static apr_status_t rc_start(void)
+{
+    apr_pool_t *p;
+    apr_status_t rv;
+    int i;
+
+    if ((p = tcn_get_global_pool()) == NULL)
+        return APR_ENOPOOL;
+    if ((rv = apr_pool_create(&rc_pool, p)) == APR_SUCCESS &&
+        (rv = apr_thread_mutex_create(&rc_mutex,
+                                      APR_THREAD_MUTEX_DEFAULT,
+                                      rc_pool)) == APR_SUCCESS &&
+        (rv = apr_thread_cond_create(&rc_cond,
+                                     rc_pool)) == APR_SUCCESS)
+        rv = apr_thread_cond_create(&rn_cond, rc_pool);
+    if (rv == APR_SUCCESS) {
+        rc_cache = apr_hash_make(rc_pool);
+        rn_cache = apr_hash_make(rc_pool);
+        APR_RING_INIT(&rc_lru, rc_entry_t, lru);
+        APR_RING_INIT(&rn_lru, rc_entry_t, lru);
+        for (i = 0; i < TCN_RESOLVER_THREADS && rv == APR_SUCCESS; i++)
+            rv = apr_thread_create(&rc_thread[i], NULL, rc_main,
+                                   NULL, rc_pool);
+        if (rv != APR_SUCCESS)
+            rc_cleanup(NULL);
+    }
+    if (rv != APR_SUCCESS) {
+        if (rc_pool)
+            apr_pool_destroy(rc_pool);
+        rc_pool = NULL;
+        return rv;
+    }
+    /* Stop the threads before the entry pools are destroyed */
+    tcn_pool_pre_cleanup_register(rc_pool, NULL, rc_cleanup);
+    return APR_SUCCESS;
+}
+
+static apr_status_t rc_init(void)
+{
+    return tcn_service_start(&rc_state, rc_start);
+}
+
+/* Cached apr_sockaddr_info_get. Returns TCN_EAGAIN when the
+ * name is not cached yet and wait is zero, the lookup is then
+ * queued to the resolver threads.
+ */
+static apr_status_t rc_lookup(apr_sockaddr_t **sa, const char *host,
+                              apr_int32_t family, apr_port_t port,
+                              apr_int32_t flags, apr_pool_t *p, int wait)
+{
+    const char *key;
+    rc_entry_t *e;
+    apr_pool_t *np = NULL;
+    apr_sockaddr_t *ra = NULL;
+    apr_status_t rv;
+
+    if ((rv = rc_init()) != APR_SUCCESS)
+        return rv;
+    key = apr_psprintf(p, "%s/%d/%d/%d", host, (int)family, (int)port,
+                       (int)flags);
+    apr_thread_mutex_lock(rc_mutex);
+    e = (rc_entry_t *)apr_hash_get(rc_cache, key, APR_HASH_KEY_STRING);
+    if (e == NULL) {
+        apr_pool_t *ep;
+        rc_evict();
+        if ((rv = apr_pool_create(&ep, rc_pool)) != APR_SUCCESS) {
+            apr_thread_mutex_unlock(rc_mutex);
+            return rv;
+        }
+        e = (rc_entry_t *)apr_pcalloc(ep, sizeof(rc_entry_t));
+        e->pool   = ep;
+        e->key    = apr_pstrdup(ep, key);
+        e->host   = apr_pstrdup(ep, host);
+        e->family = family;
+        e->port   = port;
+        e->flags  = flags;
+        apr_hash_set(rc_cache, e->key, APR_HASH_KEY_STRING, e);
+    }
+    else
+        APR_RING_REMOVE(e, lru);
+    APR_RING_INSERT_HEAD(&rc_lru, e, rc_entry_t, lru);
+    if (e->expires) {
+        /* Refresh in the background while serving the old result */
+        if (e->expires < apr_time_now())
+            rc_queue(e);
+        if ((rv = e->status) == APR_SUCCESS)
+            *sa = rc_copy(e->sa, p);
+        apr_thread_mutex_unlock(rc_mutex);
+        return rv;
+    }
+    if (!wait) {
+        rc_queue(e);
+        apr_thread_mutex_unlock(rc_mutex);
+        return TCN_EAGAIN;
+    }
+    rv = apr_pool_create(&np, rc_pool);
+    apr_thread_mutex_unlock(rc_mutex);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    rv = apr_sockaddr_info_get(&ra, host, family, port, flags, np);
+    apr_thread_mutex_lock(rc_mutex);
+    /* The entry could have been evicted meanwhile */
+    e = (rc_entry_t *)apr_hash_get(rc_cache, key, APR_HASH_KEY_STRING);
+    if (e && !e->queued) {
+        rc_store(e, ra, rv, np);
+        np = NULL;
+    }
+    if (rv == APR_SUCCESS)
+        *sa = rc_copy(ra, p);
+    if (np)
+        apr_pool_destroy(np);
+    apr_thread_mutex_unlock(rc_mutex);
+    return rv;
+}
+
+/* Drop the least recently used reverse entries.
+ * Must be called with the rc_mutex held.
+ */
+static void rn_evict(void)
+{
+    rc_entry_t *v = APR_RING_LAST(&rn_lru);
+
+    while (apr_hash_count(rn_cache) >= rn_max &&
+           v != APR_RING_SENTINEL(&rn_lru, rc_entry_t, lru)) {
+        rc_entry_t *prev = APR_RING_PREV(v, lru);
+        if (!v->queued && !v->waiters) {
+            APR_RING_REMOVE(v, lru);
+            apr_hash_set(rn_cache, v->key, APR_HASH_KEY_STRING, NULL);
+            if (v->sapool)
+                apr_pool_destroy(v->sapool);
+            apr_pool_destroy(v->pool);
+        }
+        v = prev;
+    }
+}
+
+/* Cached apr_getnameinfo. The name is allocated from the address
+ * pool like apr_getnameinfo does. On a miss the lookup is queued
+ * and the call waits up to rn_wait for it, or not at all if wait
+ * is zero. TCN_EAGAIN is returned if the name is not known yet.
+ */
+static apr_status_t rn_lookup(char **name, apr_sockaddr_t *sa,
+                              apr_int32_t flags, int wait)
+{
+    const char *key;
+    char *ip;
+    rc_entry_t *e;
+    apr_status_t rv;
+
+    if ((rv = rc_init()) != APR_SUCCESS)
+        return rv;
+    if ((rv = apr_sockaddr_ip_get(&ip, sa)) != APR_SUCCESS)
+        return rv;
+    key = apr_psprintf(sa->pool, "%s/%d", ip, (int)flags);
+    apr_thread_mutex_lock(rc_mutex);
+    e = (rc_entry_t *)apr_hash_get(rn_cache, key, APR_HASH_KEY_STRING);
+    if (e == NULL) {
+        apr_pool_t *ep;
+        rn_evict();
+        if ((rv = apr_pool_create(&ep, rc_pool)) != APR_SUCCESS) {
+            apr_thread_mutex_unlock(rc_mutex);
+            return rv;
+        }
+        e = (rc_entry_t *)apr_pcalloc(ep, sizeof(rc_entry_t));
+        e->pool     = ep;
+        e->key      = apr_pstrdup(ep, key);
+        e->sa       = rc_copy(sa, ep);
+        e->sa->next = NULL;
+        e->flags    = flags;
+        e->reverse  = 1;
+        apr_hash_set(rn_cache, e->key, APR_HASH_KEY_STRING, e);
+    }
+    else
+        APR_RING_REMOVE(e, lru);
+    APR_RING_INSERT_HEAD(&rn_lru, e, rc_entry_t, lru);
+
+    if (e->expires == 0) {
+        rc_queue(e);
+        if (wait) {
+            apr_time_t deadline = apr_time_now() + rn_wait;
+            apr_interval_time_t t;
+            e->waiters++;
+            while (e->expires == 0 &&
+                   (t = deadline - apr_time_now()) > 0)
+                apr_thread_cond_timedwait(rn_cond, rc_mutex, t);
+            e->waiters--;
+        }
+    }
+    else if (e->expires < apr_time_now()) {
+        /* Refresh in the background while serving the old name */
+        rc_queue(e);
+    }
+    if (e->expires == 0)
+        rv = TCN_EAGAIN;
+    else if ((rv = e->status) == APR_SUCCESS)
+        *name = apr_pstrdup(sa->pool, e->name);
+    apr_thread_mutex_unlock(rc_mutex);
+    return rv;
+}
+
+#define RESOLVE_DIRECT  0
+#define RESOLVE_WAIT    1
+#define RESOLVE_NOWAIT  2
+
+static jlong info_get(JNIEnv *e, jstring hostname, jint family, jint port,
+                      jint flags, jlong pool, int mode)
 {
     apr_pool_t *p = J2P(pool, apr_pool_t *);
     TCN_ALLOC_CSTRING(hostname);
@@ -34,9 +474,8 @@ TCN_IMPLEMENT_CALL(jlong, Address, info)(TCN_STDARGS,
     apr_sockaddr_t *sa = NULL;
     apr_sockaddr_t *sl = NULL;
     apr_int32_t f;
+    apr_status_t rv;
 
-
-    UNREFERENCED(o);
     GET_S_FAMILY(f, family);
 #if APR_HAVE_IPV6
     if (hostname) {
@@ -48,9 +487,17 @@ TCN_IMPLEMENT_CALL(jlong, Address, info)(TCN_STDARGS,
         }
     }
 #endif
-    TCN_THROW_IF_ERR(apr_sockaddr_info_get(&sa,
-            J2S(hostname), f, (apr_port_t)port,
-            (apr_int32_t)flags, p), sa);
+    if (hostname && mode != RESOLVE_DIRECT)
+        rv = rc_lookup(&sa, J2S(hostname), f, (apr_port_t)port,
+                       (apr_int32_t)flags, p, mode == RESOLVE_WAIT);
+    else
+        rv = apr_sockaddr_info_get(&sa, J2S(hostname), f, (apr_port_t)port,
+                                   (apr_int32_t)flags, p);
+    /* Lookup is pending */
+    if (rv == TCN_EAGAIN)
+        goto cleanup;
+    TCN_THROW_IF_ERR(rv, sa);
+
     sl = sa;
     /* 
      * apr_sockaddr_info_get may return several address so this is not
@@ -84,19 +531,106 @@ cleanup:
     return P2J(sl);
 }
 
+TCN_IMPLEMENT_CALL(jlong, Address, info)(TCN_STDARGS,
+                                         jstring hostname,
+                                         jint family, jint port,
+                                         jint flags, jlong pool)
+{
+    UNREFERENCED(o);
+    return info_get(e, hostname, family, port, flags, pool,
+                    apr_atomic_read32(&rc_enabled) ?
+                    RESOLVE_WAIT : RESOLVE_DIRECT);
+}
+
+/* Non blocking lookup. Returns zero if the name is not cached
+ * yet, the lookup is then done in the background.
+ */
+TCN_IMPLEMENT_CALL(jlong, Address, infoCached)(TCN_STDARGS,
+                                               jstring hostname,
+                                               jint family, jint port,
+                                               jint flags, jlong pool)
+{
+    UNREFERENCED(o);
+    return info_get(e, hostname, family, port, flags, pool,
+                    RESOLVE_NOWAIT);
+}
+
+/* Enable the resolver cache for the Address.info.
+ * Negative ttl values use the defaults, zero max disables the cache.
+ */
+TCN_IMPLEMENT_CALL(jint, Address, resolverConfig)(TCN_STDARGS, jint max,
+                                                  jlong ttl, jlong nttl)
+{
+    apr_status_t rv;
+
+    UNREFERENCED_STDARGS;
+    if (max <= 0) {
+        apr_atomic_set32(&rc_enabled, 0);
+        return APR_SUCCESS;
+    }
+    if ((rv = rc_init()) != APR_SUCCESS)
+        return rv;
+    apr_thread_mutex_lock(rc_mutex);
+    rc_max  = (unsigned int)max;
+    rc_ttl  = ttl  < 0 ? TCN_RESOLVER_TTL : J2T(ttl);
+    rc_nttl = nttl < 0 ? TCN_RESOLVER_NEGATIVE_TTL : J2T(nttl);
+    rc_evict();
+    apr_thread_mutex_unlock(rc_mutex);
+    apr_atomic_set32(&rc_enabled, 1);
+    return APR_SUCCESS;
+}
+
 TCN_IMPLEMENT_CALL(jstring, Address, getnameinfo)(TCN_STDARGS,
                                                   jlong sa, jint flags)
 {
     apr_sockaddr_t *s = J2P(sa, apr_sockaddr_t *);
     char *hostname;
+    apr_status_t rv;
 
     UNREFERENCED(o);
-    if (apr_getnameinfo(&hostname, s, (apr_int32_t)flags) == APR_SUCCESS)
+    if (apr_atomic_read32(&rn_enabled) || (flags & TCN_NI_CACHED)) {
+        rv = rn_lookup(&hostname, s, (apr_int32_t)(flags & ~TCN_NI_CACHED),
+                       !(flags & TCN_NI_CACHED));
+        /* Use the address until the name is resolved */
+        if (rv == TCN_EAGAIN)
+            rv = apr_sockaddr_ip_get(&hostname, s);
+    }
+    else
+        rv = apr_getnameinfo(&hostname, s, (apr_int32_t)flags);
+    if (rv == APR_SUCCESS)
         return AJP_TO_JSTRING(hostname);
     else
         return NULL;
 }
 
+/* Enable the reverse lookup cache for the Address.getnameinfo.
+ * Negative values use the defaults, zero max disables the cache.
+ * wait is the longest time a lookup blocks for an uncached name.
+ */
+TCN_IMPLEMENT_CALL(jint, Address, reverseConfig)(TCN_STDARGS, jint max,
+                                                 jlong ttl, jlong nttl,
+                                                 jlong wait)
+{
+    apr_status_t rv;
+
+    UNREFERENCED_STDARGS;
+    if (max <= 0) {
+        apr_atomic_set32(&rn_enabled, 0);
+        return APR_SUCCESS;
+    }
+    if ((rv = rc_init()) != APR_SUCCESS)
+        return rv;
+    apr_thread_mutex_lock(rc_mutex);
+    rn_max  = (unsigned int)max;
+    rn_ttl  = ttl  < 0 ? TCN_RESOLVER_TTL : J2T(ttl);
+    rn_nttl = nttl < 0 ? TCN_RESOLVER_NEGATIVE_TTL : J2T(nttl);
+    rn_wait = wait < 0 ? TCN_RESOLVER_DEADLINE : J2T(wait);
+    rn_evict();
+    apr_thread_mutex_unlock(rc_mutex);
+    apr_atomic_set32(&rn_enabled, 1);
+    return APR_SUCCESS;
+}
+
 TCN_IMPLEMENT_CALL(jstring, Address, getip)(TCN_STDARGS, jlong sa)
 {
     apr_sockaddr_t *s = J2P(sa, apr_sockaddr_t *);
@@ -116,6 +650,15 @@ TCN_IMPLEMENT_CALL(jlong, Address, get)(TCN_STDARGS, jint which,
     apr_sockaddr_t *sa = NULL;
 
     UNREFERENCED(o);
+    if (s->sock == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return 0;
+    }
+    /* Addresses received in the PROXY protocol header */
+    if (which == APR_REMOTE && s->proxy_src)
+        return P2J(s->proxy_src);
+    if (which == APR_LOCAL && s->proxy_dst)
+        return P2J(s->proxy_dst);
     TCN_THROW_IF_ERR(apr_socket_addr_get(&sa,
                         (apr_interface_e)which, s->sock), sa);
 cleanup:
@@ -0,0 +1,629 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** Traffic capture and replay
+ *
+ * The capture layer records the inbound bytes of a socket into
+ * a file. The replay feeds the recorded connections back through
+ * in-memory socket pairs.
+ *
+ * File layout: the 8 byte TCN_CAPTURE_MAGIC followed by records
+ * made of a TCN_CAPTURE_HDR byte header in network byte order
+ *    type(1) reserved(3) id(4) time(8) length(4)
+ * and length bytes of data.
+ *
+ * @version $Id$
+ */
+
+#include "tcn.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_atomic.h"
+
+#define TCN_CAPTURE_MAGIC   "TCNCAP01"
+#define TCN_CAPTURE_HDR     20
+
+#define CAP_OPEN            1
+#define CAP_DATA            2
+#define CAP_CLOSE           3
+
+typedef struct {
+    apr_pool_t          *pool;      /* Own pool, destroyed with the last ref */
+    volatile apr_uint32_t refs;     /* Creator pool and captured sockets */
+    apr_file_t          *fp;
+    apr_thread_mutex_t  *mutex;
+    apr_thread_cond_t   *cond;
+    apr_thread_t        *thread;
+    char                *buf;
+    apr_size_t          size;
+    apr_size_t          head;       /* Offset of the first unwritten byte */
+    apr_size_t          len;        /* Bytes waiting to be written */
+    apr_uint32_t        next_id;
+    apr_uint64_t        records;
+    apr_uint64_t        dropped;    /* Records lost because of a full ring */
+    apr_status_t        status;     /* First write error */
+    int                 running;
+} cap_file_t;
+
+typedef struct {
+    cap_file_t   *cap;
+    apr_uint32_t id;
+    int          closed;
+} cap_conn_t;
+
+static void cap_put32(unsigned char *p, apr_uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)(v);
+}
+
+static apr_uint32_t cap_get32(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16) |
+           ((apr_uint32_t)p[2] << 8)  |  (apr_uint32_t)p[3];
+}
+
+/* Copy into the ring at the tail. Caller checked the free space */
+static void cap_ring_put(cap_file_t *c, const char *data, apr_size_t len)
+{
+    apr_size_t tail = (c->head + c->len) % c->size;
+    apr_size_t n    = TCN_MIN(len, c->size - tail);
+
+    memcpy(c->buf + tail, data, n);
+    if (n < len)
+        memcpy(c->buf, data + n, len - n);
+    c->len += len;
+}
+
+/* Queue one record. The I/O path never waits for the disk,
+ * if the ring is full the record is dropped and counted.
+ */
+static void cap_record(cap_file_t *c, int type, apr_uint32_t id,
+                       const struct iovec *vec, apr_int32_t nvec,
+                       apr_size_t len)
+{
+    unsigned char hdr[TCN_CAPTURE_HDR];
+    apr_uint64_t  t = (apr_uint64_t)apr_time_now();
+    apr_size_t    n;
+    apr_int32_t   i;
+
+    memset(hdr, 0, sizeof(hdr));
+    hdr[0] = (unsigned char)type;
+    cap_put32(hdr + 4,  id);
+    cap_put32(hdr + 8,  (apr_uint32_t)(t >> 32));
+    cap_put32(hdr + 12, (apr_uint32_t)t);
+    cap_put32(hdr + 16, (apr_uint32_t)len);
+
+    apr_thread_mutex_lock(c->mutex);
+    if (!c->running || c->size - c->len < sizeof(hdr) + len) {
+        c->dropped++;
+        apr_thread_mutex_unlock(c->mutex);
+        return;
+    }
+    cap_ring_put(c, (const char *)hdr, sizeof(hdr));
+    for (i = 0; i < nvec && len > 0; i++) {
+        n = TCN_MIN(len, vec[i].iov_len);
+        cap_ring_put(c, (const char *)vec[i].iov_base, n);
+        len -= n;
+    }
+    c->records++;
+    apr_thread_cond_signal(c->cond);
+    apr_thread_mutex_unlock(c->mutex);
+}
+
+/* Writer thread. Only this thread advances the head so the
+ * region between head and tail can be written without the lock.
+ */
+static void * APR_THREAD_FUNC cap_writer(apr_thread_t *thd, void *data)
+{
+    cap_file_t  *c = (cap_file_t *)data;
+    apr_size_t  n, wr;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(c->mutex);
+    for (;;) {
+        while (c->len == 0 && c->running)
+            apr_thread_cond_wait(c->cond, c->mutex);
+        if (c->len == 0)
+            break;
+        n = TCN_MIN(c->len, c->size - c->head);
+        apr_thread_mutex_unlock(c->mutex);
+        rv = apr_file_write_full(c->fp, c->buf + c->head, n, &wr);
+        apr_thread_mutex_lock(c->mutex);
+        if (rv != APR_SUCCESS && c->status == APR_SUCCESS)
+            c->status = rv;
+        c->head = (c->head + n) % c->size;
+        c->len -= n;
+    }
+    apr_thread_mutex_unlock(c->mutex);
+    apr_file_flush(c->fp);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static void cap_stop(cap_file_t *c)
+{
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(c->mutex);
+    if (!c->running) {
+        apr_thread_mutex_unlock(c->mutex);
+        return;
+    }
+    c->running = 0;
+    apr_thread_cond_signal(c->cond);
+    apr_thread_mutex_unlock(c->mutex);
+    apr_thread_join(&rv, c->thread);
+}
+
+static void cap_release(cap_file_t *c)
+{
+    if (apr_atomic_dec32(&c->refs) == 0)
+        apr_pool_destroy(c->pool);
+}
+
+static apr_status_t cap_cleanup(void *data)
+{
+    cap_file_t *c = (cap_file_t *)data;
+
+    cap_stop(c);
+    cap_release(c);
+    return APR_SUCCESS;
+}
+
+/* Socket pool cleanup. It runs before the socket cleanup,
+ * so it records the close and drops the socket reference.
+ */
+static apr_status_t cap_conn_cleanup(void *data)
+{
+    cap_conn_t *c = (cap_conn_t *)data;
+
+    if (!c->closed) {
+        c->closed = 1;
+        cap_record(c->cap, CAP_CLOSE, c->id, NULL, 0, 0);
+    }
+    cap_release(c->cap);
+    return APR_SUCCESS;
+}
+
+static apr_status_t APR_THREAD_FUNC
+cap_socket_recv(apr_socket_t *sock, char *buf, apr_size_t *len)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    cap_conn_t  *c = (cap_conn_t *)l->ctx;
+    apr_status_t rv;
+    struct iovec vec;
+
+    rv = TCN_NLAYER_NEXT(l, recv)(l->next_opaque, buf, len);
+    if (*len > 0) {
+        vec.iov_base = buf;
+        vec.iov_len  = *len;
+        cap_record(c->cap, CAP_DATA, c->id, &vec, 1, *len);
+    }
+    return rv;
+}
+
+static apr_status_t APR_THREAD_FUNC
+cap_socket_recvv(apr_socket_t *sock, const struct iovec *vec,
+                 apr_int32_t nvec, apr_size_t *len)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    cap_conn_t  *c = (cap_conn_t *)l->ctx;
+    apr_status_t rv;
+
+    rv = TCN_NLAYER_NEXT(l, recvv)(l->next_opaque, vec, nvec, len);
+    if (*len > 0)
+        cap_record(c->cap, CAP_DATA, c->id, vec, nvec, *len);
+    return rv;
+}
+
+static apr_status_t APR_THREAD_FUNC
+cap_socket_close(apr_socket_t *sock)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    cap_conn_t  *c = (cap_conn_t *)l->ctx;
+
+    if (!c->closed) {
+        c->closed = 1;
+        cap_record(c->cap, CAP_CLOSE, c->id, NULL, 0, 0);
+    }
+    if (l->next->close)
+        return TCN_NLAYER_NEXT(l, close)(l->next_opaque);
+    return APR_SUCCESS;
+}
+
+static apr_status_t cap_socket_cleanup(void *data)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)data;
+    cap_conn_t  *c = (cap_conn_t *)l->ctx;
+
+    if (!c->closed) {
+        c->closed = 1;
+        cap_record(c->cap, CAP_CLOSE, c->id, NULL, 0, 0);
+    }
+    if (l->next->cleanup)
+        return TCN_NLAYER_NEXT(l, cleanup)(l->next_opaque);
+    return APR_SUCCESS;
+}
+
+static tcn_nlayer_t cap_socket_layer = {
+    TCN_SOCKET_UNKNOWN,
+    cap_socket_cleanup,
+    cap_socket_close,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    cap_socket_recv,
+    cap_socket_recvv
+};
+
+TCN_IMPLEMENT_CALL(jlong, Socket, captureCreate)(TCN_STDARGS, jstring path,
+                                                 jint size, jlong pool)
+{
+    apr_pool_t *p = J2P(pool, apr_pool_t *);
+    apr_pool_t *cp = NULL;
+    cap_file_t *c = NULL;
+    apr_size_t wr;
+    TCN_ALLOC_CSTRING(path);
+
+    UNREFERENCED(o);
+    TCN_ASSERT(pool != 0);
+
+    /* The captured sockets may outlive the pool, so the capture
+     * lives in its own pool released by the last of them.
+     */
+    TCN_THROW_IF_ERR(apr_pool_create(&cp, tcn_get_global_pool()), c);
+    c = (cap_file_t *)apr_pcalloc(cp, sizeof(cap_file_t));
+    TCN_CHECK_ALLOCATED(c);
+    c->pool = cp;
+    c->refs = 1;
+    c->size = size > 0 ? (apr_size_t)size : TCN_CAPTURE_SIZE;
+    c->buf  = apr_palloc(cp, c->size);
+    TCN_CHECK_ALLOCATED(c->buf);
+    TCN_THROW_IF_ERR(apr_file_open(&c->fp, J2S(path),
+                     APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                     APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                     APR_OS_DEFAULT, cp), c);
+    TCN_THROW_IF_ERR(apr_file_write_full(c->fp, TCN_CAPTURE_MAGIC, 8,
+                                         &wr), c);
+    TCN_THROW_IF_ERR(apr_thread_mutex_create(&c->mutex,
+                     APR_THREAD_MUTEX_DEFAULT, cp), c);
+    TCN_THROW_IF_ERR(apr_thread_cond_create(&c->cond, cp), c);
+    c->running = 1;
+    TCN_THROW_IF_ERR(apr_thread_create(&c->thread, NULL, cap_writer,
+                                       c, cp), c);
+    /* Stops the writer and drops the reference of the pool */
+    apr_pool_cleanup_register(p, (const void *)c,
+                              cap_cleanup,
+                              apr_pool_cleanup_null);
+cleanup:
+    if (cp && (c == NULL || c->thread == NULL)) {
+        apr_pool_destroy(cp);
+        c = NULL;
+    }
+    TCN_FREE_CSTRING(path);
+    return P2J(c);
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, capture)(TCN_STDARGS, jlong sock,
+                                          jlong cap)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    cap_file_t   *c = J2P(cap, cap_file_t *);
+    cap_conn_t   *cc;
+    apr_status_t rv;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(cap != 0);
+
+    if (!c->running)
+        return APR_EINVAL;
+    cc = (cap_conn_t *)apr_pcalloc(s->pool, sizeof(cap_conn_t));
+    cc->cap = c;
+    apr_thread_mutex_lock(c->mutex);
+    cc->id  = ++c->next_id;
+    apr_thread_mutex_unlock(c->mutex);
+    if ((rv = tcn_nlayer_push(s, &cap_socket_layer, cc)) != APR_SUCCESS)
+        return rv;
+    /* The socket keeps the capture alive until its pool is gone */
+    apr_atomic_inc32(&c->refs);
+    apr_pool_cleanup_register(s->pool, (const void *)cc,
+                              cap_conn_cleanup,
+                              apr_pool_cleanup_null);
+    cap_record(c, CAP_OPEN, cc->id, NULL, 0, 0);
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, captureClose)(TCN_STDARGS, jlong cap)
+{
+    cap_file_t *c = J2P(cap, cap_file_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(cap != 0);
+    cap_stop(c);
+    return (jint)c->status;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, captureStats)(TCN_STDARGS, jlong cap,
+                                               jlongArray stats)
+{
+    cap_file_t *c = J2P(cap, cap_file_t *);
+    jlong st[3];
+
+    UNREFERENCED(o);
+    TCN_ASSERT(cap != 0);
+    if ((*e)->GetArrayLength(e, stats) < 3)
+        return APR_EINVAL;
+    apr_thread_mutex_lock(c->mutex);
+    st[0] = (jlong)c->records;
+    st[1] = (jlong)c->dropped;
+    st[2] = (jlong)c->len;
+    apr_thread_mutex_unlock(c->mutex);
+    (*e)->SetLongArrayRegion(e, stats, 0, 3, st);
+    return (jint)c->status;
+}
+
+/* Replay */
+
+/* Replayed connection, allocated from its own pool that also
+ * holds the client end. The server end handed to the replayAccept
+ * is in the replay pool and stays valid after the connection is
+ * removed.
+ */
+typedef struct {
+    apr_uint32_t id;
+    apr_pool_t   *pool;
+    tcn_socket_t *s;            /* Client end of the pair */
+} rpl_conn_t;
+
+typedef struct {
+    apr_pool_t          *pool;
+    apr_file_t          *fp;
+    apr_thread_mutex_t  *mutex;
+    apr_thread_cond_t   *cond;
+    apr_thread_t        *thread;
+    double              speed;      /* Time scale, 0 for no delays */
+    apr_hash_t          *conn;      /* Open connections by id */
+    tcn_socket_t        *backlog[TCN_REPLAY_MAX];
+    int                 head;
+    int                 pending;    /* Connections waiting for accept */
+    int                 done;
+    int                 stop;
+    apr_status_t        status;
+} rpl_file_t;
+
+static rpl_conn_t *rpl_conn_find(rpl_file_t *r, apr_uint32_t id)
+{
+    return (rpl_conn_t *)apr_hash_get(r->conn, &id, sizeof(id));
+}
+
+/* Destroying the client end gives the server the EOF */
+static void rpl_conn_remove(rpl_file_t *r, rpl_conn_t *c)
+{
+    apr_hash_set(r->conn, &c->id, sizeof(c->id), NULL);
+    apr_pool_destroy(c->pool);
+}
+
+/* Queue the server end of a new connection for the replayAccept */
+static apr_status_t rpl_open(rpl_file_t *r, apr_uint32_t id)
+{
+    tcn_socket_t *srv, *cli;
+    apr_pool_t   *cp = NULL;
+    rpl_conn_t   *c;
+    apr_status_t rv;
+
+    if ((rv = apr_pool_create(&cp, r->pool)) != APR_SUCCESS)
+        return rv;
+    if ((rv = tcn_socket_pair(&srv, &cli, 0, r->pool, cp)) != APR_SUCCESS) {
+        apr_pool_destroy(cp);
+        return rv;
+    }
+    apr_thread_mutex_lock(r->mutex);
+    while (r->pending == TCN_REPLAY_MAX && !r->stop)
+        apr_thread_cond_wait(r->cond, r->mutex);
+    if (r->stop) {
+        apr_thread_mutex_unlock(r->mutex);
+        apr_pool_destroy(srv->pool);
+        apr_pool_destroy(cp);
+        return APR_EOF;
+    }
+    r->backlog[(r->head + r->pending) % TCN_REPLAY_MAX] = srv;
+    r->pending++;
+    apr_thread_cond_broadcast(r->cond);
+    apr_thread_mutex_unlock(r->mutex);
+    /* Bounded waits so that the stop request is noticed even
+     * if the server does not read.
+     */
+    (*cli->net->timeout_set)(cli->opaque, apr_time_from_sec(1));
+    c = (rpl_conn_t *)apr_palloc(cp, sizeof(rpl_conn_t));
+    c->id   = id;
+    c->pool = cp;
+    c->s    = cli;
+    apr_hash_set(r->conn, &c->id, sizeof(c->id), c);
+    return APR_SUCCESS;
+}
+
+static void * APR_THREAD_FUNC rpl_reader(apr_thread_t *thd, void *data)
+{
+    rpl_file_t    *r = (rpl_file_t *)data;
+    unsigned char hdr[TCN_CAPTURE_HDR];
+    char          buf[TCN_BUFFER_SZ];
+    char          *b;
+    apr_time_t    base = 0, start = 0, t, at;
+    apr_uint32_t  id, len;
+    apr_size_t    n, wr;
+    rpl_conn_t    *c;
+    apr_hash_index_t *hi;
+    void          *v;
+    apr_status_t  rv;
+
+    for (;;) {
+        if (r->stop)
+            break;
+        if ((rv = apr_file_read_full(r->fp, hdr, sizeof(hdr),
+                                     &n)) != APR_SUCCESS) {
+            if (!APR_STATUS_IS_EOF(rv))
+                r->status = rv;
+            break;
+        }
+        id  = cap_get32(hdr + 4);
+        t   = (apr_time_t)(((apr_uint64_t)cap_get32(hdr + 8) << 32) |
+                           cap_get32(hdr + 12));
+        len = cap_get32(hdr + 16);
+        if (start == 0) {
+            base  = t;
+            start = apr_time_now();
+        }
+        /* Keep the recorded timing scaled by the speed */
+        if (r->speed > 0) {
+            at = start + (apr_time_t)((double)(t - base) / r->speed);
+            while (!r->stop && at > apr_time_now())
+                apr_sleep(TCN_MIN(at - apr_time_now(),
+                                  APR_USEC_PER_SEC / 10));
+        }
+        c = rpl_conn_find(r, id);
+        switch (hdr[0]) {
+            case CAP_OPEN:
+                if (c == NULL && (rv = rpl_open(r, id)) != APR_SUCCESS)
+                    r->status = rv;
+            break;
+            case CAP_CLOSE:
+                if (c != NULL)
+                    rpl_conn_remove(r, c);
+            break;
+        }
+        while (len > 0 && r->status == APR_SUCCESS) {
+            n = TCN_MIN(len, sizeof(buf));
+            if ((rv = apr_file_read_full(r->fp, buf, n,
+                                         &n)) != APR_SUCCESS) {
+                r->status = rv;
+                break;
+            }
+            len -= (apr_uint32_t)n;
+            /* Drop the data of the connections closed by the server */
+            if (c == NULL || hdr[0] != CAP_DATA)
+                continue;
+            for (b = buf; n > 0; b += wr, n -= wr) {
+                wr = n;
+                rv = (*c->s->net->send)(c->s->opaque, b, &wr);
+                if (APR_STATUS_IS_TIMEUP(rv) && !r->stop)
+                    continue;
+                if (rv != APR_SUCCESS) {
+                    rpl_conn_remove(r, c);
+                    c = NULL;
+                    break;
+                }
+            }
+        }
+        if (r->status != APR_SUCCESS)
+            break;
+    }
+    for (hi = apr_hash_first(NULL, r->conn); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &v);
+        rpl_conn_remove(r, (rpl_conn_t *)v);
+    }
+    apr_thread_mutex_lock(r->mutex);
+    r->done = 1;
+    apr_thread_cond_broadcast(r->cond);
+    apr_thread_mutex_unlock(r->mutex);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t rpl_cleanup(void *data)
+{
+    rpl_file_t *r = (rpl_file_t *)data;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(r->mutex);
+    r->stop = 1;
+    apr_thread_cond_broadcast(r->cond);
+    apr_thread_mutex_unlock(r->mutex);
+    apr_thread_join(&rv, r->thread);
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(jlong, Socket, replayCreate)(TCN_STDARGS, jstring path,
+                                                jdouble speed, jlong pool)
+{
+    apr_pool_t *p = J2P(pool, apr_pool_t *);
+    rpl_file_t *r = NULL;
+    char       magic[8];
+    apr_size_t n;
+    TCN_ALLOC_CSTRING(path);
+
+    UNREFERENCED(o);
+    TCN_ASSERT(pool != 0);
+
+    r = (rpl_file_t *)apr_pcalloc(p, sizeof(rpl_file_t));
+    TCN_CHECK_ALLOCATED(r);
+    r->pool  = p;
+    r->speed = speed;
+    r->conn  = apr_hash_make(p);
+    TCN_THROW_IF_ERR(apr_file_open(&r->fp, J2S(path),
+                     APR_FOPEN_READ | APR_FOPEN_BUFFERED | APR_FOPEN_BINARY,
+                     APR_OS_DEFAULT, p), r);
+    TCN_THROW_IF_ERR(apr_file_read_full(r->fp, magic, sizeof(magic),
+                                        &n), r);
+    if (memcmp(magic, TCN_CAPTURE_MAGIC, sizeof(magic))) {
+        tcn_ThrowAPRException(e, APR_EINVAL);
+        r = NULL;
+        goto cleanup;
+    }
+    TCN_THROW_IF_ERR(apr_thread_mutex_create(&r->mutex,
+                     APR_THREAD_MUTEX_DEFAULT, p), r);
+    TCN_THROW_IF_ERR(apr_thread_cond_create(&r->cond, p), r);
+    TCN_THROW_IF_ERR(apr_thread_create(&r->thread, NULL, rpl_reader,
+                                       r, p), r);
+    /* Stop the thread before the socket pools are destroyed */
+    tcn_pool_pre_cleanup_register(p, (const void *)r, rpl_cleanup);
+cleanup:
+    TCN_FREE_CSTRING(path);
+    return P2J(r);
+}
+
+TCN_IMPLEMENT_CALL(jlong, Socket, replayAccept)(TCN_STDARGS, jlong replay)
+{
+    rpl_file_t   *r = J2P(replay, rpl_file_t *);
+    tcn_socket_t *s = NULL;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(replay != 0);
+
+    apr_thread_mutex_lock(r->mutex);
+    while (r->pending == 0 && !r->done && !r->stop)
+        apr_thread_cond_wait(r->cond, r->mutex);
+    if (r->pending > 0) {
+        s = r->backlog[r->head];
+        r->head = (r->head + 1) % TCN_REPLAY_MAX;
+        r->pending--;
+        apr_thread_cond_broadcast(r->cond);
+    }
+    apr_thread_mutex_unlock(r->mutex);
+    if (s == NULL && r->status != APR_SUCCESS)
+        tcn_ThrowAPRException(e, r->status);
+    return P2J(s);
+}
@@ -32,6 +32,7 @@
 extern void sp_poll_dump_statistics();
 extern void sp_network_dump_statistics();
 extern void ssl_network_dump_statistics();
+extern void mem_network_dump_statistics();
 #endif
 
 apr_pool_t *tcn_global_pool = NULL;
@@ -243,6 +244,7 @@ TCN_IMPLEMENT_CALL(void, Library, terminate)(TCN_STDARGS)
         sp_poll_dump_statistics();
         sp_network_dump_statistics();
         ssl_network_dump_statistics();
+        mem_network_dump_statistics();
         fprintf(stderr, "APR Terminated\n");
 #endif
         apr_terminate();
@@ -461,6 +463,45 @@ apr_pool_t *tcn_get_global_pool()
     return tcn_global_pool;
 }
 
+/* Start a lazily started background service once.
+ * The state is 0 not started, 1 starting, 2 running. Concurrent
+ * callers wait for the one running the start, a failed start
+ * leaves the state at 0 so that the next call retries it.
+ * The cleanup stopping the service resets the state to 0.
+ */
+apr_status_t tcn_service_start(volatile apr_uint32_t *state,
+                               apr_status_t (*start)(void))
+{
+    apr_status_t rv;
+
+    while (apr_atomic_read32(state) != 2) {
+        if (apr_atomic_cas32(state, 1, 0) != 0) {
+            apr_sleep(1000);
+            continue;
+        }
+        if ((rv = (*start)()) != APR_SUCCESS) {
+            apr_atomic_set32(state, 0);
+            return rv;
+        }
+        apr_atomic_set32(state, 2);
+    }
+    return APR_SUCCESS;
+}
+
+/* Register a cleanup that runs before the subpools are destroyed,
+ * so that it can stop the threads still using them. Old APR has
+ * no pre-cleanups and it becomes the first cleanup to run.
+ */
+void tcn_pool_pre_cleanup_register(apr_pool_t *p, const void *data,
+                                   apr_status_t (*cleanup)(void *))
+{
+#if ((APR_MAJOR_VERSION >= 1) && (APR_MINOR_VERSION >= 3))
+    apr_pool_pre_cleanup_register(p, data, cleanup);
+#else
+    apr_pool_cleanup_register(p, data, cleanup, apr_pool_cleanup_null);
+#endif
+}
+
 jclass tcn_get_string_class()
 {
     return jString_class;
@@ -0,0 +1,448 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** In-memory loopback network layer
+ *
+ * Two connected sockets that exchange data through a pair
+ * of in-process ring buffers instead of the kernel.
+ *
+ * @version $Id$
+ */
+
+#include "tcn.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_atomic.h"
+
+#ifdef TCN_DO_STATISTICS
+
+static volatile apr_uint32_t mem_created  = 0;
+static volatile apr_uint32_t mem_closed   = 0;
+static volatile apr_uint32_t mem_cleared  = 0;
+
+void mem_network_dump_statistics()
+{
+    fprintf(stderr, "Memory Network Statistics ..\n");
+    fprintf(stderr, "Sockets created         : %d\n", mem_created);
+    fprintf(stderr, "Sockets closed          : %d\n", mem_closed);
+    fprintf(stderr, "Sockets cleared         : %d\n", mem_cleared);
+}
+
+#endif
+
+typedef struct {
+    char       *buf;
+    apr_size_t size;
+    apr_size_t head;        /* Offset of the first unread byte */
+    apr_size_t len;         /* Bytes in the ring */
+    int        eof;         /* Writer shut down */
+    int        closed;      /* Reader shut down */
+} mem_ring_t;
+
+/* The state shared by both ends lives in its own pool,
+ * released when the pools of both sockets are gone.
+ */
+typedef struct {
+    apr_pool_t         *pool;
+    volatile apr_uint32_t refs;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t  *cond;
+    mem_ring_t         ring[2];
+} mem_pair_t;
+
+typedef struct {
+    mem_pair_t          *pair;
+    mem_ring_t          *in;
+    mem_ring_t          *out;
+    apr_interval_time_t timeout;
+    int                 closed;
+} mem_conn_t;
+
+/* Wait for the peer to change the ring state.
+ * Must be called with the pair mutex held.
+ */
+static apr_status_t mem_wait(mem_conn_t *con, apr_time_t deadline)
+{
+    apr_interval_time_t t;
+
+    if (con->timeout == 0)
+        return TCN_EAGAIN;
+    if (con->timeout < 0)
+        return apr_thread_cond_wait(con->pair->cond, con->pair->mutex);
+    t = deadline - apr_time_now();
+    if (t <= 0)
+        return APR_TIMEUP;
+    return apr_thread_cond_timedwait(con->pair->cond, con->pair->mutex, t);
+}
+
+static apr_size_t mem_ring_put(mem_ring_t *r, const char *buf,
+                               apr_size_t len)
+{
+    apr_size_t tail, n;
+
+    len  = TCN_MIN(len, r->size - r->len);
+    tail = (r->head + r->len) % r->size;
+    n    = TCN_MIN(len, r->size - tail);
+    memcpy(r->buf + tail, buf, n);
+    if (n < len)
+        memcpy(r->buf, buf + n, len - n);
+    r->len += len;
+    return len;
+}
+
+static apr_size_t mem_ring_get(mem_ring_t *r, char *buf, apr_size_t len)
+{
+    apr_size_t n;
+
+    len = TCN_MIN(len, r->len);
+    n   = TCN_MIN(len, r->size - r->head);
+    memcpy(buf, r->buf + r->head, n);
+    if (n < len)
+        memcpy(buf + n, r->buf, len - n);
+    r->head = (r->head + len) % r->size;
+    r->len -= len;
+    if (r->len == 0)
+        r->head = 0;
+    return len;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_sendv(apr_socket_t *sock, const struct iovec *vec,
+                 apr_int32_t nvec, apr_size_t *len)
+{
+    mem_conn_t  *con = (mem_conn_t *)sock;
+    mem_ring_t  *r   = con->out;
+    apr_time_t  deadline = 0;
+    apr_size_t  written  = 0;
+    apr_status_t rv = APR_SUCCESS;
+    apr_int32_t i;
+
+    *len = 0;
+    if (con->closed)
+        return APR_ENOTSOCK;
+    if (r->eof)
+        return APR_EPIPE;
+    if (con->timeout > 0)
+        deadline = apr_time_now() + con->timeout;
+    apr_thread_mutex_lock(con->pair->mutex);
+    while (r->len == r->size && !r->closed) {
+        if ((rv = mem_wait(con, deadline)) != APR_SUCCESS)
+            break;
+    }
+    if (r->closed)
+        rv = APR_EPIPE;
+    if (rv == APR_SUCCESS) {
+        /* Write what fits, like a socket send does */
+        for (i = 0; i < nvec && r->len < r->size; i++) {
+            written += mem_ring_put(r, (const char *)vec[i].iov_base,
+                                    vec[i].iov_len);
+        }
+        if (written)
+            apr_thread_cond_broadcast(con->pair->cond);
+    }
+    apr_thread_mutex_unlock(con->pair->mutex);
+    *len = written;
+    return rv;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_send(apr_socket_t *sock, const char *buf, apr_size_t *len)
+{
+    struct iovec vec;
+
+    vec.iov_base = (void *)buf;
+    vec.iov_len  = *len;
+    return mem_socket_sendv(sock, &vec, 1, len);
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_recvv(apr_socket_t *sock, const struct iovec *vec,
+                 apr_int32_t nvec, apr_size_t *len)
+{
+    mem_conn_t  *con = (mem_conn_t *)sock;
+    mem_ring_t  *r   = con->in;
+    apr_time_t  deadline = 0;
+    apr_size_t  nread = 0;
+    apr_status_t rv = APR_SUCCESS;
+    apr_int32_t i;
+
+    *len = 0;
+    if (con->closed)
+        return APR_ENOTSOCK;
+    if (r->closed)
+        return APR_EOF;
+    if (con->timeout > 0)
+        deadline = apr_time_now() + con->timeout;
+    apr_thread_mutex_lock(con->pair->mutex);
+    while (r->len == 0 && !r->eof) {
+        if ((rv = mem_wait(con, deadline)) != APR_SUCCESS)
+            break;
+    }
+    if (rv == APR_SUCCESS) {
+        if (r->len == 0)
+            rv = APR_EOF;
+        for (i = 0; i < nvec && r->len > 0; i++) {
+            nread += mem_ring_get(r, (char *)vec[i].iov_base,
+                                  vec[i].iov_len);
+        }
+        if (nread)
+            apr_thread_cond_broadcast(con->pair->cond);
+    }
+    apr_thread_mutex_unlock(con->pair->mutex);
+    *len = nread;
+    return rv;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_recv(apr_socket_t *sock, char *buf, apr_size_t *len)
+{
+    struct iovec vec;
+
+    vec.iov_base = buf;
+    vec.iov_len  = *len;
+    return mem_socket_recvv(sock, &vec, 1, len);
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_shutdown(apr_socket_t *sock, apr_shutdown_how_e how)
+{
+    mem_conn_t *con = (mem_conn_t *)sock;
+
+    apr_thread_mutex_lock(con->pair->mutex);
+    if (how == APR_SHUTDOWN_READ || how == APR_SHUTDOWN_READWRITE)
+        con->in->closed = 1;
+    if (how == APR_SHUTDOWN_WRITE || how == APR_SHUTDOWN_READWRITE)
+        con->out->eof = 1;
+    apr_thread_cond_broadcast(con->pair->cond);
+    apr_thread_mutex_unlock(con->pair->mutex);
+    return APR_SUCCESS;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_close(apr_socket_t *sock)
+{
+    mem_conn_t *con = (mem_conn_t *)sock;
+
+    if (con->closed)
+        return APR_SUCCESS;
+#ifdef TCN_DO_STATISTICS
+    apr_atomic_inc32(&mem_closed);
+#endif
+    mem_socket_shutdown(sock, APR_SHUTDOWN_READWRITE);
+    con->closed = 1;
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_cleanup(void *data)
+{
+    mem_conn_t *con = (mem_conn_t *)data;
+
+    if (con && !con->closed) {
+        mem_socket_shutdown((apr_socket_t *)con, APR_SHUTDOWN_READWRITE);
+        con->closed = 1;
+    }
+#ifdef TCN_DO_STATISTICS
+    apr_atomic_inc32(&mem_cleared);
+#endif
+    return APR_SUCCESS;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_opt_get(apr_socket_t *sock, apr_int32_t opt, apr_int32_t *on)
+{
+    mem_conn_t *con = (mem_conn_t *)sock;
+
+    if (opt == APR_SO_NONBLOCK) {
+        *on = con->timeout == 0;
+        return APR_SUCCESS;
+    }
+    return APR_ENOTIMPL;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_opt_set(apr_socket_t *sock, apr_int32_t opt, apr_int32_t on)
+{
+    mem_conn_t *con = (mem_conn_t *)sock;
+
+    if (opt == APR_SO_NONBLOCK) {
+        if (on)
+            con->timeout = 0;
+        else if (con->timeout == 0)
+            con->timeout = -1;
+    }
+    /* Other options have no meaning for the memory sockets */
+    return APR_SUCCESS;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_timeout_get(apr_socket_t *sock, apr_interval_time_t *t)
+{
+    mem_conn_t *con = (mem_conn_t *)sock;
+    *t = con->timeout;
+    return APR_SUCCESS;
+}
+
+static apr_status_t APR_THREAD_FUNC
+mem_socket_timeout_set(apr_socket_t *sock, apr_interval_time_t t)
+{
+    mem_conn_t *con = (mem_conn_t *)sock;
+    con->timeout = t;
+    return APR_SUCCESS;
+}
+
+static tcn_nlayer_t mem_socket_layer = {
+    TCN_SOCKET_MEMORY,
+    mem_cleanup,
+    mem_socket_close,
+    mem_socket_shutdown,
+    mem_socket_opt_get,
+    mem_socket_opt_set,
+    mem_socket_timeout_get,
+    mem_socket_timeout_set,
+    mem_socket_send,
+    mem_socket_sendv,
+    mem_socket_recv,
+    mem_socket_recvv
+};
+
+static apr_status_t mem_socket_cleanup(void *data)
+{
+    tcn_socket_t *s = (tcn_socket_t *)data;
+
+    if (s->net && s->net->cleanup) {
+        (*s->net->cleanup)(s->opaque);
+        s->net = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_pair_cleanup(void *data)
+{
+    mem_pair_t *pair = (mem_pair_t *)data;
+
+    if (apr_atomic_dec32(&pair->refs) == 0)
+        apr_pool_destroy(pair->pool);
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_socket_create(tcn_socket_t **sock, mem_pair_t *pair,
+                                      int side, apr_pool_t *p)
+{
+    apr_pool_t   *c;
+    tcn_socket_t *s;
+    mem_conn_t   *con;
+    apr_status_t rv;
+
+    if ((rv = apr_pool_create(&c, p)) != APR_SUCCESS)
+        return rv;
+    s   = (tcn_socket_t *)apr_pcalloc(c, sizeof(tcn_socket_t));
+    con = (mem_conn_t *)apr_pcalloc(c, sizeof(mem_conn_t));
+    if ((rv = apr_pool_create(&s->child, c)) != APR_SUCCESS) {
+        apr_pool_destroy(c);
+        return rv;
+    }
+    con->pair    = pair;
+    con->in      = &pair->ring[side];
+    con->out     = &pair->ring[!side];
+    con->timeout = -1;
+    s->pool   = c;
+    s->net    = &mem_socket_layer;
+    s->opaque = con;
+    /* Registered first so that it runs after the socket cleanup */
+    apr_atomic_inc32(&pair->refs);
+    apr_pool_cleanup_register(c, (const void *)pair,
+                              mem_pair_cleanup,
+                              apr_pool_cleanup_null);
+    apr_pool_cleanup_register(c, (const void *)s,
+                              mem_socket_cleanup,
+                              apr_pool_cleanup_null);
+#ifdef TCN_DO_STATISTICS
+    apr_atomic_inc32(&mem_created);
+#endif
+    *sock = s;
+    return APR_SUCCESS;
+}
+
+/* Create two connected memory sockets, the first one inside
+ * a subpool of the pool p0 and the second one of the pool p1.
+ * Either end can be destroyed first, the peer gets EOF.
+ */
+apr_status_t tcn_socket_pair(tcn_socket_t **s0, tcn_socket_t **s1,
+                             apr_size_t size, apr_pool_t *p0,
+                             apr_pool_t *p1)
+{
+    apr_pool_t   *pp = NULL;
+    mem_pair_t   *pair;
+    tcn_socket_t *s[2];
+    apr_status_t rv;
+    int i;
+
+    if (size == 0)
+        size = TCN_MEMNET_SIZE;
+    if ((rv = apr_pool_create(&pp, tcn_get_global_pool())) != APR_SUCCESS)
+        return rv;
+    pair = (mem_pair_t *)apr_pcalloc(pp, sizeof(mem_pair_t));
+    pair->pool = pp;
+    if ((rv = apr_thread_mutex_create(&pair->mutex,
+                                      APR_THREAD_MUTEX_DEFAULT,
+                                      pp)) != APR_SUCCESS)
+        goto cleanup;
+    if ((rv = apr_thread_cond_create(&pair->cond, pp)) != APR_SUCCESS)
+        goto cleanup;
+    for (i = 0; i < 2; i++) {
+        pair->ring[i].size = size;
+        pair->ring[i].buf  = apr_palloc(pp, size);
+        if (pair->ring[i].buf == NULL) {
+            rv = APR_ENOMEM;
+            goto cleanup;
+        }
+    }
+    /* Each socket holds a reference, the pair goes with the last one */
+    if ((rv = mem_socket_create(&s[0], pair, 0, p0)) != APR_SUCCESS)
+        goto cleanup;
+    if ((rv = mem_socket_create(&s[1], pair, 1, p1)) != APR_SUCCESS) {
+        apr_pool_destroy(s[0]->pool);
+        return rv;
+    }
+    *s0 = s[0];
+    *s1 = s[1];
+    return APR_SUCCESS;
+cleanup:
+    apr_pool_destroy(pp);
+    return rv;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, createPair)(TCN_STDARGS, jlongArray sp,
+                                             jint size, jlong pool)
+{
+    apr_pool_t   *p = J2P(pool, apr_pool_t *);
+    tcn_socket_t *s0, *s1;
+    jlong        js[2];
+    apr_status_t rv;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(pool != 0);
+
+    if ((*e)->GetArrayLength(e, sp) < 2)
+        return APR_EINVAL;
+    if ((rv = tcn_socket_pair(&s0, &s1, size > 0 ? (apr_size_t)size : 0,
+                              p, p)) != APR_SUCCESS)
+        return rv;
+    js[0] = P2J(s0);
+    js[1] = P2J(s1);
+    (*e)->SetLongArrayRegion(e, sp, 0, 2, js);
+    return APR_SUCCESS;
+}
@@ -20,12 +20,43 @@
  * @version $Id$
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Needed for splice(2) and recvmmsg(2) */
+#define _GNU_SOURCE
+#endif
+
 #include "tcn.h"
+#include "apr_atomic.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_version.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define TCN_HAVE_ZEROCOPY 1
+#endif
+#if defined(SPLICE_F_MOVE) && defined(SPLICE_F_NONBLOCK)
+#define TCN_HAVE_SPLICE 1
+#endif
+#if defined(MSG_WAITFORONE)
+#define TCN_HAVE_MMSG 1
+#endif
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define TCN_HAVE_UDP_GSO 1
+#endif
+#if defined(TCP_INFO)
+#define TCN_HAVE_TCP_INFO 1
+#endif
+#endif
 
 #ifdef TCN_DO_STATISTICS
 
-#include "apr_atomic.h"
-
 static volatile apr_uint32_t sp_created  = 0;
 static volatile apr_uint32_t sp_closed   = 0;
 static volatile apr_uint32_t sp_cleared  = 0;
@@ -77,6 +108,160 @@ void sp_network_dump_statistics()
 #endif /* TCN_DO_STATISTICS */
 
 extern apr_pool_t *tcn_global_pool;
+
+/* Per-thread bounce buffers.
+ * Heap byte[] transfers larger than TCN_BUFFER_SZ are copied through
+ * a buffer owned by the calling thread. The buffer grows on demand up
+ * to sp_bounce_max and is freed when the thread exits.
+ */
+typedef struct {
+    char       *buf;
+    apr_size_t  size;
+} sp_bounce_t;
+
+static volatile void *sp_bounce_key = NULL;
+static volatile apr_uint32_t sp_bounce_max   = TCN_BOUNCE_MAX;
+static volatile apr_uint32_t sp_bounce_hits  = 0;
+static volatile apr_uint32_t sp_bounce_grows = 0;
+static volatile apr_uint32_t sp_bounce_bytes = 0;
+static volatile apr_uint32_t sp_bounce_clamp = 0;
+
+static void sp_bounce_free(void *data)
+{
+    sp_bounce_t *b = (sp_bounce_t *)data;
+
+    if (b) {
+        apr_atomic_sub32(&sp_bounce_bytes, (apr_uint32_t)b->size);
+        free(b->buf);
+        free(b);
+    }
+}
+
+static apr_status_t sp_bounce_key_cleanup(void *data)
+{
+    UNREFERENCED(data);
+    sp_bounce_key = NULL;
+    return APR_SUCCESS;
+}
+
+/* Return the calling thread bounce buffer holding at least *len
+ * bytes. Requests above the limit are clamped and *len is
+ * updated to the usable size.
+ */
+static char *sp_bounce_get(apr_size_t *len)
+{
+    apr_threadkey_t *key = (apr_threadkey_t *)sp_bounce_key;
+    apr_size_t max = apr_atomic_read32(&sp_bounce_max);
+    sp_bounce_t *b = NULL;
+    apr_size_t sz;
+
+    if (key == NULL) {
+        apr_pool_t *p = tcn_get_global_pool();
+        if (p == NULL ||
+            apr_threadkey_private_create(&key, sp_bounce_free,
+                                         p) != APR_SUCCESS)
+            return NULL;
+        if (apr_atomic_casptr(&sp_bounce_key, key, NULL) != NULL) {
+            apr_threadkey_private_delete(key);
+            key = (apr_threadkey_t *)sp_bounce_key;
+        }
+        else
+            apr_pool_cleanup_register(p, NULL, sp_bounce_key_cleanup,
+                                      apr_pool_cleanup_null);
+    }
+    if (*len > max) {
+        *len = max;
+        apr_atomic_inc32(&sp_bounce_clamp);
+    }
+    apr_threadkey_private_get((void **)&b, key);
+    if (b && b->size >= *len) {
+        apr_atomic_inc32(&sp_bounce_hits);
+        return b->buf;
+    }
+    if (b == NULL) {
+        if ((b = (sp_bounce_t *)calloc(1, sizeof(sp_bounce_t))) == NULL)
+            return NULL;
+        apr_threadkey_private_set(b, key);
+    }
+    for (sz = TCN_BUFFER_SZ * 2; sz < *len; sz <<= 1)
+        ;
+    if (sz > max)
+        sz = max;
+    apr_atomic_sub32(&sp_bounce_bytes, (apr_uint32_t)b->size);
+    free(b->buf);
+    b->size = 0;
+    if ((b->buf = (char *)malloc(sz)) == NULL)
+        return NULL;
+    b->size = sz;
+    apr_atomic_add32(&sp_bounce_bytes, (apr_uint32_t)sz);
+    apr_atomic_inc32(&sp_bounce_grows);
+    return b->buf;
+}
+
+/* Set the bounce buffer limit for buffers allocated from now on.
+ * Returns the previous limit, max <= 0 only queries it.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, bounceMax)(TCN_STDARGS, jint max)
+{
+    UNREFERENCED_STDARGS;
+    if (max <= 0)
+        return (jint)apr_atomic_read32(&sp_bounce_max);
+    if (max < TCN_BUFFER_SZ * 2)
+        max = TCN_BUFFER_SZ * 2;
+    return (jint)apr_atomic_xchg32(&sp_bounce_max, (apr_uint32_t)max);
+}
+
+/* Fill the bounce buffer statistics: reuses, allocations,
+ * bytes currently allocated by all threads and clamped transfers.
+ */
+TCN_IMPLEMENT_CALL(void, Socket, bounceStats)(TCN_STDARGS, jlongArray out)
+{
+    jlong st[4];
+
+    UNREFERENCED(o);
+    st[0] = (jlong)apr_atomic_read32(&sp_bounce_hits);
+    st[1] = (jlong)apr_atomic_read32(&sp_bounce_grows);
+    st[2] = (jlong)apr_atomic_read32(&sp_bounce_bytes);
+    st[3] = (jlong)apr_atomic_read32(&sp_bounce_clamp);
+    (*e)->SetLongArrayRegion(e, out, 0, 4, st);
+}
+
+/* Update the per-socket counters after an I/O call.
+ * The counters are not atomic. A socket is expected to
+ * be used by a single thread at a time.
+ * Zero-copy sends are counted by the send calls issuing them,
+ * splice and relay count the bytes moved on both sockets.
+ */
+static APR_INLINE void sp_count_io(tcn_socket_t *s, int out,
+                                   apr_status_t ss, apr_size_t n)
+{
+    tcn_sockstat_t *st = s->stat;
+    int again;
+
+    if (st == NULL || !st->enabled)
+        return;
+    again = APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN;
+    if (ss != APR_SUCCESS && !again)
+        n = 0;
+    if (out) {
+        st->writes++;
+        st->bytes_out += n;
+        if (again)
+            st->write_again++;
+    }
+    else {
+        st->reads++;
+        st->bytes_in += n;
+        if (again)
+            st->read_again++;
+    }
+    st->last = apr_time_now();
+    if (st->first == 0)
+        st->first = st->last;
+}
+
+static void sp_pacer_detach(tcn_socket_t *s);
+
 static apr_status_t sp_socket_cleanup(void *data)
 {
     tcn_socket_t *s = (tcn_socket_t *)data;
@@ -88,6 +273,7 @@ static apr_status_t sp_socket_cleanup(void *data)
         s->sock = NULL;
         apr_socket_close(as);
     }
+    sp_pacer_detach(s);
 #ifdef TCN_DO_STATISTICS
     apr_atomic_inc32(&sp_cleared);
 #endif
@@ -155,6 +341,66 @@ APR_socket_opt_get(apr_socket_t *sock, apr_int32_t opt, apr_int32_t *on)
 #define APR_socket_opt_get      apr_socket_opt_get
 #endif
 
+#if !defined(WIN32)
+/* Wait for the socket to become ready the same way APR does
+ * when it gets EAGAIN on a socket with timeout.
+ */
+static apr_status_t sp_socket_wait(apr_socket_t *sock, apr_int16_t events)
+{
+    apr_interval_time_t t;
+    apr_pollfd_t pfd;
+    apr_int32_t  n;
+    apr_status_t ss;
+
+    apr_socket_timeout_get(sock, &t);
+    if (t == 0)
+        return APR_EAGAIN;
+    pfd.p         = NULL;
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s    = sock;
+    pfd.reqevents = events;
+    do {
+        ss = apr_poll(&pfd, 1, &n, t);
+    } while (APR_STATUS_IS_EINTR(ss));
+    return ss;
+}
+
+/* APR has no scatter read, so do the readv directly on the
+ * native descriptor honoring the socket timeout the same way
+ * apr_socket_recv does.
+ */
+static apr_status_t APR_THREAD_FUNC
+APR_socket_recvv(apr_socket_t *sock, const struct iovec *vec,
+                 apr_int32_t nvec, apr_size_t *len)
+{
+    apr_os_sock_t sd;
+    apr_status_t ss;
+    ssize_t rd;
+
+    *len = 0;
+    if ((ss = apr_os_sock_get(&sd, sock)) != APR_SUCCESS)
+        return ss;
+    for (;;) {
+        do {
+            rd = readv(sd, vec, nvec);
+        } while (rd == -1 && errno == EINTR);
+        if (rd >= 0)
+            break;
+        ss = apr_get_netos_error();
+        if (!APR_STATUS_IS_EAGAIN(ss))
+            return ss;
+        if ((ss = sp_socket_wait(sock, APR_POLLIN)) != APR_SUCCESS)
+            return ss;
+    }
+    if (rd == 0)
+        return APR_EOF;
+    *len = (apr_size_t)rd;
+    return APR_SUCCESS;
+}
+#else
+#define APR_socket_recvv        NULL
+#endif
+
 static tcn_nlayer_t apr_socket_layer = {
     TCN_SOCKET_APR,
     NULL,
@@ -166,1064 +412,4630 @@ static tcn_nlayer_t apr_socket_layer = {
     APR_socket_timeout_set,
     APR_socket_send,
     APR_socket_sendv,
-    APR_socket_recv
+    APR_socket_recv,
+    APR_socket_recvv
 };
 
-TCN_IMPLEMENT_CALL(jlong, Socket, create)(TCN_STDARGS, jint family,
-                                          jint type, jint protocol,
-                                          jlong pool)
+/* Pass-through functions used by the pushed layers for every
+ * function the filter does not implement itself.
+ */
+static apr_status_t nl_cleanup(void *data)
 {
-    apr_pool_t *p = J2P(pool, apr_pool_t *);
-    apr_pool_t *c = NULL;
-    apr_socket_t *s = NULL;
-    tcn_socket_t *a = NULL;
-    apr_int32_t f, t;
+    tcn_nlink_t *l = (tcn_nlink_t *)data;
+    return TCN_NLAYER_NEXT(l, cleanup)(l->next_opaque);
+}
 
-    UNREFERENCED(o);
-    TCN_ASSERT(pool != 0);
-    GET_S_FAMILY(f, family);
-    GET_S_TYPE(t, type);
+static apr_status_t APR_THREAD_FUNC
+nl_close(apr_socket_t *sock)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, close)(l->next_opaque);
+}
 
-    TCN_THROW_IF_ERR(apr_pool_create(&c, p), c);
+static apr_status_t APR_THREAD_FUNC
+nl_shutdown(apr_socket_t *sock, apr_shutdown_how_e how)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, shutdown)(l->next_opaque, how);
+}
 
-    a = (tcn_socket_t *)apr_pcalloc(c, sizeof(tcn_socket_t));
-    TCN_CHECK_ALLOCATED(a);
-    TCN_THROW_IF_ERR(apr_pool_create(&a->child, c), a->child);
-    a->pool = c;
+static apr_status_t APR_THREAD_FUNC
+nl_opt_get(apr_socket_t *sock, apr_int32_t opt, apr_int32_t *on)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, opt_get)(l->next_opaque, opt, on);
+}
 
-    if (family >= 0) {
-        a->net = &apr_socket_layer;
-        TCN_THROW_IF_ERR(apr_socket_create(&s,
-                         f, t, protocol, c), a);
-    }
-    apr_pool_cleanup_register(c, (const void *)a,
-                              sp_socket_cleanup,
-                              apr_pool_cleanup_null);
+static apr_status_t APR_THREAD_FUNC
+nl_opt_set(apr_socket_t *sock, apr_int32_t opt, apr_int32_t on)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, opt_set)(l->next_opaque, opt, on);
+}
 
-#ifdef TCN_DO_STATISTICS
-    sp_created++;
-#endif
-    a->sock = s;
-    if (family >= 0)
-        a->net = &apr_socket_layer;
-    a->opaque  = s;
-    return P2J(a);
-cleanup:
-    if (c)
-        apr_pool_destroy(c);
-    return 0;
+static apr_status_t APR_THREAD_FUNC
+nl_timeout_get(apr_socket_t *sock, apr_interval_time_t *t)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, timeout_get)(l->next_opaque, t);
+}
 
+static apr_status_t APR_THREAD_FUNC
+nl_timeout_set(apr_socket_t *sock, apr_interval_time_t t)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, timeout_set)(l->next_opaque, t);
 }
 
-TCN_IMPLEMENT_CALL(void, Socket, destroy)(TCN_STDARGS, jlong sock)
+static apr_status_t APR_THREAD_FUNC
+nl_send(apr_socket_t *sock, const char *buf, apr_size_t *len)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_socket_t *as;
-    UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, send)(l->next_opaque, buf, len);
+}
 
-    as = s->sock;
-    s->sock = NULL;
-    apr_pool_cleanup_kill(s->pool, s, sp_socket_cleanup);
-    if (s->net && s->net->cleanup) {
-        (*s->net->cleanup)(s->opaque);
-        s->net = NULL;
-    }
-    if (as) {
-        apr_socket_close(as);
-    }
+static apr_status_t APR_THREAD_FUNC
+nl_sendv(apr_socket_t *sock, const struct iovec *vec,
+         apr_int32_t nvec, apr_size_t *len)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, sendv)(l->next_opaque, vec, nvec, len);
+}
 
-    apr_pool_destroy(s->pool);
+static apr_status_t APR_THREAD_FUNC
+nl_recv(apr_socket_t *sock, char *buf, apr_size_t *len)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, recv)(l->next_opaque, buf, len);
 }
 
-TCN_IMPLEMENT_CALL(jlong, Socket, pool)(TCN_STDARGS, jlong sock)
+static apr_status_t APR_THREAD_FUNC
+nl_recvv(apr_socket_t *sock, const struct iovec *vec,
+         apr_int32_t nvec, apr_size_t *len)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_pool_t *n;
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    return TCN_NLAYER_NEXT(l, recvv)(l->next_opaque, vec, nvec, len);
+}
 
-    UNREFERENCED(o);
-    TCN_ASSERT(sock != 0);
-    TCN_THROW_IF_ERR(apr_pool_create(&n, s->pool), n);
-cleanup:
-    return P2J(n);
+/* Layer below a popped link, it has nothing to forward to.
+ * The filters call the layer below unconditionally, so the
+ * control calls succeed doing nothing and the I/O fails.
+ */
+static apr_status_t nd_cleanup(void *data)
+{
+    UNREFERENCED(data);
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jlong, Socket, get)(TCN_STDARGS, jlong sock, jint what)
+static apr_status_t APR_THREAD_FUNC nd_close(apr_socket_t *sock)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
+    UNREFERENCED(sock);
+    return APR_SUCCESS;
+}
 
-    switch (what) {
-        case TCN_SOCKET_GET_POOL:
-            return P2J(s->pool);
-        break;
-        case TCN_SOCKET_GET_IMPL:
-            return P2J(s->opaque);
-        break;
-        case TCN_SOCKET_GET_APRS:
-            return P2J(s->sock);
-        break;
-        case TCN_SOCKET_GET_TYPE:
-            return (jlong)(s->net->type);
-        break;
-    }
-    return 0;
+static apr_status_t APR_THREAD_FUNC nd_shutdown(apr_socket_t *sock,
+                                                apr_shutdown_how_e how)
+{
+    UNREFERENCED(sock);
+    UNREFERENCED(how);
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, shutdown)(TCN_STDARGS, jlong sock,
-                                           jint how)
+static apr_status_t APR_THREAD_FUNC nd_opt_get(apr_socket_t *sock,
+                                               apr_int32_t opt,
+                                               apr_int32_t *on)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    UNREFERENCED(sock);
+    UNREFERENCED(opt);
+    *on = 0;
+    return APR_SUCCESS;
+}
 
-    UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
-    return (jint)(*s->net->shutdown)(s->opaque, how);
+static apr_status_t APR_THREAD_FUNC nd_opt_set(apr_socket_t *sock,
+                                               apr_int32_t opt,
+                                               apr_int32_t on)
+{
+    UNREFERENCED(sock);
+    UNREFERENCED(opt);
+    UNREFERENCED(on);
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, close)(TCN_STDARGS, jlong sock)
+static apr_status_t APR_THREAD_FUNC nd_timeout_get(apr_socket_t *sock,
+                                                   apr_interval_time_t *t)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    jint rv = APR_SUCCESS;
-    apr_socket_t *as;
-    UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
+    UNREFERENCED(sock);
+    *t = 0;
+    return APR_SUCCESS;
+}
 
-    as = s->sock;
-    s->sock = NULL;
-    apr_pool_cleanup_kill(s->pool, s, sp_socket_cleanup);
-    if (s->child) {
-        apr_pool_clear(s->child);
-    }
-#ifdef TCN_DO_STATISTICS
-    apr_atomic_inc32(&sp_closed);
-#endif
-    if (s->net && s->net->close) {
-        rv = (*s->net->close)(s->opaque);
-        s->net = NULL;
-    }
-    if (as) {
-        rv = (jint)apr_socket_close(as);
-    }
-    return rv;
+static apr_status_t APR_THREAD_FUNC nd_timeout_set(apr_socket_t *sock,
+                                                   apr_interval_time_t t)
+{
+    UNREFERENCED(sock);
+    UNREFERENCED(t);
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, bind)(TCN_STDARGS, jlong sock,
-                                       jlong sa)
+static apr_status_t APR_THREAD_FUNC nd_send(apr_socket_t *sock,
+                                            const char *buf,
+                                            apr_size_t *len)
 {
-    jint rv = APR_SUCCESS;
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_sockaddr_t *a = J2P(sa, apr_sockaddr_t *);
+    UNREFERENCED(sock);
+    UNREFERENCED(buf);
+    *len = 0;
+    return APR_ENOTSOCK;
+}
 
-    UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->sock != NULL);
-    rv = (jint)apr_socket_bind(s->sock, a);
-    return rv;
+static apr_status_t APR_THREAD_FUNC nd_sendv(apr_socket_t *sock,
+                                             const struct iovec *vec,
+                                             apr_int32_t nvec,
+                                             apr_size_t *len)
+{
+    UNREFERENCED(sock);
+    UNREFERENCED(vec);
+    UNREFERENCED(nvec);
+    *len = 0;
+    return APR_ENOTSOCK;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, listen)(TCN_STDARGS, jlong sock,
-                                         jint backlog)
+static apr_status_t APR_THREAD_FUNC nd_recv(apr_socket_t *sock,
+                                            char *buf, apr_size_t *len)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    UNREFERENCED(sock);
+    UNREFERENCED(buf);
+    *len = 0;
+    return APR_ENOTSOCK;
+}
 
-    UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->sock != NULL);
-    return (jint)apr_socket_listen(s->sock, backlog);
+static apr_status_t APR_THREAD_FUNC nd_recvv(apr_socket_t *sock,
+                                             const struct iovec *vec,
+                                             apr_int32_t nvec,
+                                             apr_size_t *len)
+{
+    UNREFERENCED(sock);
+    UNREFERENCED(vec);
+    UNREFERENCED(nvec);
+    *len = 0;
+    return APR_ENOTSOCK;
 }
 
-TCN_IMPLEMENT_CALL(jlong, Socket, acceptx)(TCN_STDARGS, jlong sock,
-                                           jlong pool)
+static tcn_nlayer_t nl_detached = {
+    TCN_SOCKET_UNKNOWN,
+    nd_cleanup,
+    nd_close,
+    nd_shutdown,
+    nd_opt_get,
+    nd_opt_set,
+    nd_timeout_get,
+    nd_timeout_set,
+    nd_send,
+    nd_sendv,
+    nd_recv,
+    nd_recvv
+};
+
+/* Use the filter function if present, otherwise pass the call
+ * to the layer below if that one implements it.
+ */
+#define NL_SET(F)                                               \
+    l->net.F = layer->F ? layer->F : (l->next->F ? nl_##F : NULL)
+
+/* Push a filter layer on top of the socket. All the I/O done
+ * through s->net will go through the layer functions.
+ * The layers must be pushed after the SSLSocket.attach.
+ * Filter functions must check that the function they forward
+ * to exists in the layer below, close and cleanup may be NULL.
+ */
+apr_status_t tcn_nlayer_push(tcn_socket_t *s, const tcn_nlayer_t *layer,
+                             void *ctx)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_pool_t   *p = J2P(pool, apr_pool_t *);
-    apr_socket_t *n = NULL;
-    tcn_socket_t *a = NULL;
+    tcn_nlink_t *l;
 
-    UNREFERENCED(o);
-    TCN_ASSERT(sock != 0);
+    if (s->net == NULL)
+        return APR_ENOTSOCK;
+    l = (tcn_nlink_t *)apr_pcalloc(s->pool, sizeof(tcn_nlink_t));
+    if (l == NULL)
+        return APR_ENOMEM;
+    l->next        = s->net;
+    l->next_opaque = s->opaque;
+    l->below       = s->link;
+    l->sock        = s;
+    l->ctx         = ctx;
+    /* Keep the type of the transport so that the
+     * type checks of the SSL and Local calls still work.
+     */
+    l->net.type    = s->net->type;
+    NL_SET(cleanup);
+    NL_SET(close);
+    NL_SET(shutdown);
+    NL_SET(opt_get);
+    NL_SET(opt_set);
+    NL_SET(timeout_get);
+    NL_SET(timeout_set);
+    NL_SET(send);
+    NL_SET(sendv);
+    NL_SET(recv);
+    /* Without recvv below the callers fall back to the recv */
+    if (l->next->recvv)
+        NL_SET(recvv);
+
+    s->net    = &l->net;
+    s->opaque = l;
+    s->link   = l;
+    return APR_SUCCESS;
+}
 
-    if (s->net->type == TCN_SOCKET_APR) {
-        TCN_ASSERT(s->sock != NULL);
-        a = (tcn_socket_t *)apr_pcalloc(p, sizeof(tcn_socket_t));
-        TCN_CHECK_ALLOCATED(a);
-        a->pool   = p;
-        apr_pool_cleanup_register(a->pool, (const void *)a,
-                                  sp_socket_cleanup,
-                                  apr_pool_cleanup_null);
-
-        TCN_THROW_IF_ERR(apr_socket_accept(&n, s->sock, p), n);
-    }
-    else {
-        tcn_ThrowAPRException(e, APR_ENOTIMPL);
-        goto cleanup;
-    }
-    if (n) {
-#ifdef TCN_DO_STATISTICS
-        apr_atomic_inc32(&sp_accepted);
-#endif
-        a->net    = &apr_socket_layer;
-        a->sock   = n;
-        a->opaque = n;
-    }
-
-cleanup:
-    return P2J(a);
+/* Remove the topmost layer and return its private data.
+ * The layer cleanup is not called.
+ */
+void *tcn_nlayer_pop(tcn_socket_t *s)
+{
+    tcn_nlink_t *l = s->link;
+
+    if (l == NULL)
+        return NULL;
+    s->net    = l->next;
+    s->opaque = l->next_opaque;
+    s->link   = l->below;
+    return l->ctx;
 }
 
-TCN_IMPLEMENT_CALL(jlong, Socket, accept)(TCN_STDARGS, jlong sock)
+/* Returns the opaque data of the transport layer */
+void *tcn_nlayer_base(tcn_socket_t *s)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_pool_t   *p = NULL;
-    apr_socket_t *n = NULL;
-    tcn_socket_t *a = NULL;
+    tcn_nlink_t *l = s->link;
 
-    UNREFERENCED(o);
-    TCN_ASSERT(sock != 0);
+    if (l == NULL)
+        return s->opaque;
+    while (l->below)
+        l = l->below;
+    return l->next_opaque;
+}
 
-    TCN_THROW_IF_ERR(apr_pool_create(&p, s->child), p);
-    if (s->net->type == TCN_SOCKET_APR) {
-        TCN_ASSERT(s->sock != NULL);
-        a = (tcn_socket_t *)apr_pcalloc(p, sizeof(tcn_socket_t));
-        TCN_CHECK_ALLOCATED(a);
-        TCN_THROW_IF_ERR(apr_socket_accept(&n, s->sock, p), n);
+/* Tell if any of the pushed layers filters the recv (TCN_NLAYER_IN)
+ * or the send (TCN_NLAYER_OUT) calls. The functions that only pass
+ * the call to the layer below do not count.
+ */
+int tcn_nlayer_filters(tcn_socket_t *s, int dir)
+{
+    tcn_nlink_t *l;
+
+    for (l = s->link; l; l = l->below) {
+        if ((dir & TCN_NLAYER_IN) &&
+            ((l->net.recv  && l->net.recv  != nl_recv) ||
+             (l->net.recvv && l->net.recvv != nl_recvv)))
+            return 1;
+        if ((dir & TCN_NLAYER_OUT) &&
+            ((l->net.send  && l->net.send  != nl_send) ||
+             (l->net.sendv && l->net.sendv != nl_sendv)))
+            return 1;
+    }
+    return 0;
+}
 
-        a->pool = p;
-        apr_pool_cleanup_register(a->pool, (const void *)a,
-                                  sp_socket_cleanup,
-                                  apr_pool_cleanup_null);
+/* Wrap the socket descriptor received from another process.
+ * On success the new socket owns the descriptor.
+ */
+apr_status_t tcn_socket_import(tcn_socket_t **sock, apr_os_sock_t sd,
+                               apr_pool_t *pool)
+{
+    apr_pool_t   *c = NULL;
+    tcn_socket_t *a;
+    apr_socket_t *s = NULL;
+    apr_os_sock_info_t info;
+    struct sockaddr_storage ss;
+    socklen_t    sl = sizeof(ss);
+    int          st;
+    socklen_t    tl = sizeof(st);
+    apr_status_t rv;
 
-    }
-    else {
-        tcn_ThrowAPRException(e, APR_ENOTIMPL);
+    if (getsockname(sd, (struct sockaddr *)&ss, &sl) == -1 ||
+        getsockopt(sd, SOL_SOCKET, SO_TYPE, (char *)&st, &tl) == -1)
+        return apr_get_netos_error();
+    if ((rv = apr_pool_create(&c, pool)) != APR_SUCCESS)
+        return rv;
+    a = (tcn_socket_t *)apr_pcalloc(c, sizeof(tcn_socket_t));
+    if ((rv = apr_pool_create(&a->child, c)) != APR_SUCCESS)
         goto cleanup;
-    }
-    if (n) {
+    info.os_sock  = &sd;
+    info.local    = (struct sockaddr *)&ss;
+    info.remote   = NULL;
+    info.family   = ss.ss_family;
+    info.type     = st;
+    info.protocol = 0;
+    if ((rv = apr_os_sock_make(&s, &info, c)) != APR_SUCCESS)
+        goto cleanup;
+    /* The descriptor shares the file status with the sender
+     * so it may be non blocking. Set the blocking mode the
+     * APR expects for a socket without a timeout.
+     */
+    apr_socket_opt_set(s, APR_SO_NONBLOCK, 1);
+    apr_socket_opt_set(s, APR_SO_NONBLOCK, 0);
+
+    a->pool   = c;
+    a->sock   = s;
+    a->net    = &apr_socket_layer;
+    a->opaque = s;
+    apr_pool_cleanup_register(c, (const void *)a,
+                              sp_socket_cleanup,
+                              apr_pool_cleanup_null);
 #ifdef TCN_DO_STATISTICS
-        apr_atomic_inc32(&sp_accepted);
+    sp_created++;
 #endif
-        a->net    = &apr_socket_layer;
-        a->sock   = n;
-        a->opaque = n;
-    }
-    return P2J(a);
+    *sock = a;
+    return APR_SUCCESS;
 cleanup:
-    if (tcn_global_pool && p && s->sock)
-        apr_pool_destroy(p);
-    return 0;
+    apr_pool_destroy(c);
+    return rv;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, connect)(TCN_STDARGS, jlong sock,
-                                          jlong sa)
+#ifdef TCN_HAVE_ZEROCOPY
+/* Send with MSG_ZEROCOPY. The pages are pinned instead of copied
+ * so the buffer must not be modified until the kernel reports the
+ * completion on the socket error queue.
+ */
+static apr_status_t sp_zerocopy_send(tcn_socket_t *s, const char *buf,
+                                     apr_size_t *len)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_sockaddr_t *a = J2P(sa, apr_sockaddr_t *);
+    apr_os_sock_t sd;
+    apr_status_t ss;
+    ssize_t wr;
+
+    if ((ss = apr_os_sock_get(&sd, s->sock)) != APR_SUCCESS)
+        return ss;
+    for (;;) {
+        do {
+            wr = send(sd, buf, *len, MSG_ZEROCOPY);
+        } while (wr == -1 && errno == EINTR);
+        if (wr >= 0)
+            break;
+        ss = apr_get_netos_error();
+        if (ss == ENOBUFS) {
+            /* Out of optmem for the notifications */
+            return (*s->net->send)(s->opaque, buf, len);
+        }
+        if (!APR_STATUS_IS_EAGAIN(ss) ||
+            (ss = sp_socket_wait(s->sock, APR_POLLOUT)) != APR_SUCCESS) {
+            *len = 0;
+            return ss;
+        }
+    }
+    apr_atomic_inc32(&s->zc_sent);
+    *len = (apr_size_t)wr;
+    return APR_SUCCESS;
+}
 
-    UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->sock != NULL);
-    return (jint)apr_socket_connect(s->sock, a);
+/* Drain the socket error queue and advance the completed count.
+ * The Poll thread calls this on POLLERR and Socket.zerocopyDone from
+ * the Java thread, only one of them drains at a time and the other
+ * returns at once. Returns the number of completion notifications,
+ * or -1 if the queue also held a real socket error. The error is
+ * kept in zc_error and reported by Socket.zerocopyDone.
+ */
+int tcn_zerocopy_drain(tcn_socket_t *s)
+{
+    apr_os_sock_t sd;
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int n = 0;
+    int err = 0;
+
+    if (!s->sock || apr_os_sock_get(&sd, s->sock) != APR_SUCCESS)
+        return -1;
+    if (apr_atomic_cas32(&s->zc_lock, 1, 0) != 0)
+        return 0;
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee;
+            apr_uint32_t d;
+
+            if (!(cm->cmsg_level == IPPROTO_IP   && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0) {
+                err = ee->ee_errno ? ee->ee_errno : EIO;
+                continue;
+            }
+            /* ee_data is the last id of the completed range */
+            d = (ee->ee_data + 1) - apr_atomic_read32(&s->zc_done);
+            if ((apr_int32_t)d > 0)
+                apr_atomic_add32(&s->zc_done, d);
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* The kernel had to copy anyhow (eg. loopback)
+                 * so pinning the pages is pure overhead.
+                 */
+                s->zc_min = 0;
+            }
+            n++;
+        }
+    }
+    if (err)
+        s->zc_error = err;
+    apr_atomic_set32(&s->zc_lock, 0);
+    return err ? -1 : n;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, send)(TCN_STDARGS, jlong sock,
-                                      jbyteArray buf, jint offset, jint tosend)
+#else
+
+int tcn_zerocopy_drain(tcn_socket_t *s)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_size_t nbytes = (apr_size_t)tosend;
-    apr_status_t ss;
+    UNREFERENCED(s);
+    return 0;
+}
 
-    UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
-    }
-    TCN_ASSERT(s->opaque != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
-#ifdef TCN_DO_STATISTICS
-    sp_max_send = TCN_MAX(sp_max_send, nbytes);
-    sp_min_send = TCN_MIN(sp_min_send, nbytes);
-    sp_tot_send += nbytes;
-    sp_num_send++;
-#endif
+#endif /* TCN_HAVE_ZEROCOPY */
 
-    if (tosend <= TCN_BUFFER_SZ) {
-        jbyte sb[TCN_BUFFER_SZ];
-        (*e)->GetByteArrayRegion(e, buf, offset, tosend, &sb[0]);
-        ss = (*s->net->send)(s->opaque, (const char *)&sb[0], &nbytes);
-    }
-    else {
-        jbyte *sb = (jbyte *)malloc(nbytes);
-        if (sb == NULL)
-            return -APR_ENOMEM;
-        (*e)->GetByteArrayRegion(e, buf, offset, tosend, sb);
-        ss = (*s->net->send)(s->opaque, (const char *)sb, &nbytes);
-        free(sb);
-    }
-    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && nbytes > 0))
-        return (jint)nbytes;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
-    }
+/* Token bucket send pacing.
+ * A pacer can be attached to a single socket or shared by a group
+ * of sockets. Sends take tokens from the bucket, which is refilled
+ * at rate bytes per second up to burst bytes.
+ * The pacer lives in its own pool and is referenced by the pool
+ * it was created from and by every socket it is attached to,
+ * so it stays valid until the last of them is gone.
+ */
+struct tcn_pacer_t {
+    apr_pool_t         *pool;
+    volatile apr_uint32_t refs;
+    apr_thread_mutex_t *mutex;
+    apr_int64_t  rate;            /* Bytes per second */
+    apr_int64_t  burst;           /* Bucket size */
+    apr_int64_t  tokens;
+    apr_time_t   last;            /* Last refill time */
+    apr_uint64_t passed;          /* Bytes granted */
+    apr_uint64_t throttled;       /* Number of delayed sends */
+    apr_uint64_t throttled_time;  /* Time spent waiting for tokens */
+};
+
+static void pacer_release(tcn_pacer_t *p)
+{
+    if (apr_atomic_dec32(&p->refs) == 0)
+        apr_pool_destroy(p->pool);
 }
 
-TCN_IMPLEMENT_CALL(void, Socket, setsbb)(TCN_STDARGS, jlong sock,
-                                         jobject buf)
+static void sp_pacer_detach(tcn_socket_t *s)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return;
+    tcn_pacer_t *p = s->pacer;
+
+    if (p) {
+        s->pacer = NULL;
+        pacer_release(p);
     }
-    TCN_ASSERT(s->opaque != NULL);
-    if (buf)
-        s->jsbbuff = (char *)(*e)->GetDirectBufferAddress(e, buf);
-    else
-        s->jsbbuff = NULL;
 }
 
-TCN_IMPLEMENT_CALL(void, Socket, setrbb)(TCN_STDARGS, jlong sock,
-                                         jobject buf)
+static APR_INLINE void pacer_refill(tcn_pacer_t *p, apr_time_t now)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return;
+    if (now > p->last) {
+        p->tokens += (p->rate * (now - p->last)) / APR_USEC_PER_SEC;
+        if (p->tokens > p->burst)
+            p->tokens = p->burst;
+        p->last = now;
     }
-    TCN_ASSERT(s->opaque != NULL);
-    if (buf)
-        s->jrbbuff = (char *)(*e)->GetDirectBufferAddress(e, buf);
-    else
-        s->jrbbuff = NULL;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, sendb)(TCN_STDARGS, jlong sock,
-                                        jobject buf, jint offset, jint len)
+/* Microseconds until want bytes may be sent, 0 if now */
+static APR_INLINE apr_interval_time_t pacer_wait(tcn_pacer_t *p,
+                                                 apr_size_t want)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_size_t nbytes = (apr_size_t)len;
-    apr_size_t sent = 0;
-    char *bytes;
-    apr_status_t ss = APR_SUCCESS;
+    apr_int64_t need = TCN_MIN((apr_int64_t)want, p->burst);
 
-    UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
-    }
-    TCN_ASSERT(s->opaque != NULL);
-    TCN_ASSERT(buf != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
-#ifdef TCN_DO_STATISTICS
-    sp_max_send = TCN_MAX(sp_max_send, nbytes);
-    sp_min_send = TCN_MIN(sp_min_send, nbytes);
-    sp_tot_send += nbytes;
-    sp_num_send++;
-#endif
+    if (p->tokens >= need && p->tokens > 0)
+        return 0;
+    return ((need - p->tokens) * APR_USEC_PER_SEC) / p->rate + 1;
+}
 
-    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+/* Take up to len bytes of tokens. Blocking sockets wait for the
+ * tokens, non-blocking ones get APR_EAGAIN and should use
+ * Socket.pacerDelay to schedule the retry.
+ */
+static apr_status_t sp_pace(tcn_socket_t *s, apr_size_t *len)
+{
+    tcn_pacer_t *p = s->pacer;
+    apr_interval_time_t t, w, waited = 0;
+    apr_status_t ss = APR_SUCCESS;
 
-    while (sent < nbytes) {
-        apr_size_t wr = nbytes - sent;
-        ss = (*s->net->send)(s->opaque, bytes + offset + sent, &wr);
-        if (ss != APR_SUCCESS)
+    (*s->net->timeout_get)(s->opaque, &t);
+    apr_thread_mutex_lock(p->mutex);
+    for (;;) {
+        if (p->rate <= 0) {
+            p->passed += *len;
             break;
-        sent += wr;
+        }
+        pacer_refill(p, apr_time_now());
+        if ((w = pacer_wait(p, *len)) == 0) {
+            if ((apr_int64_t)*len > p->tokens)
+                *len = (apr_size_t)p->tokens;
+            p->tokens -= *len;
+            p->passed += *len;
+            break;
+        }
+        if (t == 0) {
+            ss = APR_EAGAIN;
+            break;
+        }
+        if (t > 0 && waited + w > t) {
+            ss = APR_TIMEUP;
+            break;
+        }
+        apr_thread_mutex_unlock(p->mutex);
+        apr_sleep(w);
+        apr_thread_mutex_lock(p->mutex);
+        waited += w;
     }
-
-    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && sent > 0))
-        return (jint)sent;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
+    if (ss != APR_SUCCESS || waited) {
+        p->throttled++;
+        p->throttled_time += waited;
     }
+    apr_thread_mutex_unlock(p->mutex);
+    if (ss != APR_SUCCESS)
+        *len = 0;
+    return ss;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, sendib)(TCN_STDARGS, jlong sock,
-                                         jobject buf, jint offset, jint len)
+/* Give back the tokens a send did not use */
+static void sp_pace_refund(tcn_socket_t *s, apr_size_t unused)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_size_t nbytes = (apr_size_t)len;
-    char *bytes;
-    apr_status_t ss = APR_SUCCESS;
+    tcn_pacer_t *p = s->pacer;
 
-    UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
-    }
-    TCN_ASSERT(s->opaque != NULL);
-    TCN_ASSERT(buf != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
-#ifdef TCN_DO_STATISTICS
-    sp_max_send = TCN_MAX(sp_max_send, nbytes);
-    sp_min_send = TCN_MIN(sp_min_send, nbytes);
-    sp_tot_send += nbytes;
-    sp_num_send++;
-#endif
+    if (unused == 0)
+        return;
+    apr_thread_mutex_lock(p->mutex);
+    if (p->rate > 0)
+        p->tokens = TCN_MIN(p->tokens + (apr_int64_t)unused, p->burst);
+    p->passed -= unused;
+    apr_thread_mutex_unlock(p->mutex);
+}
 
-    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+static apr_status_t wbuf_drain(tcn_socket_t *s);
 
-    ss = (*s->net->send)(s->opaque, bytes + offset, &nbytes);
+/* Send from the memory that stays valid after the call returns,
+ * using the zero-copy path when enabled for the socket.
+ */
+static APR_INLINE apr_status_t sp_socket_send(tcn_socket_t *s, const char *buf,
+                                              apr_size_t *len)
+{
+    apr_size_t granted;
+    apr_status_t ss;
 
-    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && nbytes > 0))
-        return (jint)nbytes;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
+    if (s->wbuf && s->wbuf->len && (ss = wbuf_drain(s)) != APR_SUCCESS) {
+        *len = 0;
+        return ss;
     }
+    if (s->pacer && (ss = sp_pace(s, len)) != APR_SUCCESS)
+        return ss;
+    granted = *len;
+#ifdef TCN_HAVE_ZEROCOPY
+    if (s->zc_min && *len >= s->zc_min && TCN_SOCKET_IS_APR(s))
+        ss = sp_zerocopy_send(s, buf, len);
+    else
+#endif
+    ss = (*s->net->send)(s->opaque, buf, len);
+    if (s->pacer && *len < granted)
+        sp_pace_refund(s, granted - *len);
+    return ss;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, sendbb)(TCN_STDARGS, jlong sock,
-                                         jint offset, jint len)
-{
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_size_t nbytes = (apr_size_t)len;
-    apr_size_t sent = 0;
-    apr_status_t ss = APR_SUCCESS;
+TCN_IMPLEMENT_CALL(jlong, Socket, create)(TCN_STDARGS, jint family,
+                                          jint type, jint protocol,
+                                          jlong pool)
+{
+    apr_pool_t *p = J2P(pool, apr_pool_t *);
+    apr_pool_t *c = NULL;
+    apr_socket_t *s = NULL;
+    tcn_socket_t *a = NULL;
+    apr_int32_t f, t;
 
     UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
-    }
-    TCN_ASSERT(s->opaque != NULL);
-    TCN_ASSERT(s->jsbbuff != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
+    TCN_ASSERT(pool != 0);
+    GET_S_FAMILY(f, family);
+    GET_S_TYPE(t, type);
+
+    TCN_THROW_IF_ERR(apr_pool_create(&c, p), c);
+
+    a = (tcn_socket_t *)apr_pcalloc(c, sizeof(tcn_socket_t));
+    TCN_CHECK_ALLOCATED(a);
+    TCN_THROW_IF_ERR(apr_pool_create(&a->child, c), a->child);
+    a->pool = c;
+
+    if (family >= 0) {
+        a->net = &apr_socket_layer;
+        TCN_THROW_IF_ERR(apr_socket_create(&s,
+                         f, t, protocol, c), a);
     }
+    apr_pool_cleanup_register(c, (const void *)a,
+                              sp_socket_cleanup,
+                              apr_pool_cleanup_null);
+
 #ifdef TCN_DO_STATISTICS
-    sp_max_send = TCN_MAX(sp_max_send, nbytes);
-    sp_min_send = TCN_MIN(sp_min_send, nbytes);
-    sp_tot_send += nbytes;
-    sp_num_send++;
+    sp_created++;
 #endif
+    a->sock = s;
+    if (family >= 0)
+        a->net = &apr_socket_layer;
+    a->opaque  = s;
+    return P2J(a);
+cleanup:
+    if (c)
+        apr_pool_destroy(c);
+    return 0;
 
-    while (sent < nbytes) {
-        apr_size_t wr = nbytes - sent;
-        ss = (*s->net->send)(s->opaque, s->jsbbuff + offset + sent, &wr);
-        if (ss != APR_SUCCESS || wr == 0)
-            break;
-        sent += wr;
-    }
-    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && sent > 0))
-        return (jint)sent;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
-    }
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, sendibb)(TCN_STDARGS, jlong sock,
-                                          jint offset, jint len)
+static void sp_socket_destroy(tcn_socket_t *s)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_size_t nbytes = (apr_size_t)len;
-    apr_status_t ss = APR_SUCCESS;
+    apr_socket_t *as;
 
-    UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
+    as = s->sock;
+    s->sock = NULL;
+    apr_pool_cleanup_kill(s->pool, s, sp_socket_cleanup);
+    if (s->net && s->net->cleanup) {
+        (*s->net->cleanup)(s->opaque);
+        s->net = NULL;
     }
-    TCN_ASSERT(s->opaque != NULL);
-    TCN_ASSERT(s->jsbbuff != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
+    if (as) {
+        apr_socket_close(as);
     }
-#ifdef TCN_DO_STATISTICS
-    sp_max_send = TCN_MAX(sp_max_send, nbytes);
-    sp_min_send = TCN_MIN(sp_min_send, nbytes);
-    sp_tot_send += nbytes;
-    sp_num_send++;
-#endif
-
-    ss = (*s->net->send)(s->opaque, s->jsbbuff + offset, &nbytes);
+    sp_pacer_detach(s);
 
-    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && nbytes > 0))
-        return (jint)nbytes;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
-    }
+    apr_pool_destroy(s->pool);
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, sendv)(TCN_STDARGS, jlong sock,
-                                        jobjectArray bufs)
+TCN_IMPLEMENT_CALL(void, Socket, destroy)(TCN_STDARGS, jlong sock)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    jsize nvec;
-    jsize i;
-    struct iovec vec[APR_MAX_IOVEC_SIZE];
-    jobject ba[APR_MAX_IOVEC_SIZE];
-    apr_size_t written = 0;
-    apr_status_t ss;
 
-    UNREFERENCED(o);
+    UNREFERENCED_STDARGS;
     TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->opaque != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
+    sp_socket_destroy(s);
+}
 
-    nvec = (*e)->GetArrayLength(e, bufs);
-    if (nvec >= APR_MAX_IOVEC_SIZE)
-        return (jint)(-APR_ENOMEM);
+/* Deferred close.
+ * Sockets are handed to a single background thread that shuts
+ * down the write side, drains the input until the peer closes or
+ * the linger time expires, and then destroys the socket.
+ * This avoids a RST truncating the response without blocking
+ * the calling thread.
+ */
+typedef struct sp_close_t sp_close_t;
+struct sp_close_t {
+    tcn_socket_t *s;
+    apr_time_t    deadline;
+    sp_close_t   *next;
+    int           state;
+};
 
-    for (i = 0; i < nvec; i++) {
-        ba[i] = (*e)->GetObjectArrayElement(e, bufs, i);
-        vec[i].iov_len  = (*e)->GetArrayLength(e, ba[i]);
-        vec[i].iov_base = (void *)((*e)->GetByteArrayElements(e, ba[i], NULL));
-    }
+/* Owner of the queued socket */
+#define SP_CLOSE_QUEUED     0   /* In the sp_close_head list */
+#define SP_CLOSE_ACTIVE     1   /* Lingering on the close thread */
+#define SP_CLOSE_GONE       2   /* Pool destroyed while lingering */
+#define SP_CLOSE_FREE       3   /* Released by the close thread */
+#define SP_CLOSE_DONE       4   /* Being destroyed by the close thread */
+
+static apr_thread_mutex_t *sp_close_mutex = NULL;
+static apr_thread_cond_t  *sp_close_cond  = NULL;
+/* Signaled when the thread releases the SP_CLOSE_GONE sockets */
+static apr_thread_cond_t  *sp_close_done  = NULL;
+static apr_thread_t       *sp_close_thread = NULL;
+static sp_close_t         *sp_close_head  = NULL;
+static sp_close_t         *sp_close_tail  = NULL;
+static volatile apr_uint32_t sp_close_state = 0;
+static int                 sp_close_stop  = 0;
+/* Pipe that wakes the close thread from the apr_poll */
+static apr_file_t         *sp_close_wake[2] = { NULL, NULL };
+
+static void sp_close_drain(sp_close_t *c)
+{
+    char buf[TCN_BUFFER_SZ];
+    apr_size_t n;
+    apr_status_t ss;
 
-    ss = (*s->net->sendv)(s->opaque, vec, nvec, &written);
+    do {
+        n  = sizeof(buf);
+        ss = (*c->s->net->recv)(c->s->opaque, buf, &n);
+    } while (ss == APR_SUCCESS && n > 0);
+    if (APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN)
+        return;
+    /* EOF or error, nothing more to wait for */
+    c->deadline = 0;
+}
 
-    for (i = 0; i < nvec; i++) {
-        (*e)->ReleaseByteArrayElements(e, ba[i], (jbyte*)vec[i].iov_base, JNI_ABORT);
+/* Pre-cleanup of the queued socket pool.
+ * The owner destroys the pool, for example the connector pool on
+ * stop, before the close thread is done with the socket. Take the
+ * socket from the queue, or wait until the close thread stops
+ * using it, so that the pool is not destroyed under the thread.
+ */
+static apr_status_t sp_close_pool_cleanup(void *data)
+{
+    sp_close_t *c = (sp_close_t *)data;
+    sp_close_t *x, *prev = NULL;
+
+    apr_thread_mutex_lock(sp_close_mutex);
+    if (c->state == SP_CLOSE_QUEUED) {
+        for (x = sp_close_head; x && x != c; x = x->next)
+            prev = x;
+        if (x) {
+            if (prev)
+                prev->next = c->next;
+            else
+                sp_close_head = c->next;
+            if (sp_close_tail == c)
+                sp_close_tail = prev;
+        }
+        c->state = SP_CLOSE_FREE;
     }
-    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && written > 0))
-        return (jint)written;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
+    else if (c->state == SP_CLOSE_ACTIVE) {
+        c->state = SP_CLOSE_GONE;
+        apr_file_putc(1, sp_close_wake[1]);
+        while (c->state != SP_CLOSE_FREE)
+            apr_thread_cond_wait(sp_close_done, sp_close_mutex);
     }
+    /* SP_CLOSE_DONE is the close thread destroying the socket */
+    apr_thread_mutex_unlock(sp_close_mutex);
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, sendto)(TCN_STDARGS, jlong sock,
-                                         jlong where, jint flag,
-                                         jbyteArray buf, jint offset, jint tosend)
+static void * APR_THREAD_FUNC sp_close_main(apr_thread_t *thd, void *data)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_sockaddr_t *w = J2P(where, apr_sockaddr_t *);
-    apr_size_t nbytes = (apr_size_t)tosend;
-    jbyte *bytes;
-    apr_int32_t nb;
-    apr_status_t ss;
+    sp_close_t   *act[TCN_CLOSE_MAX];
+    tcn_socket_t *dead[TCN_CLOSE_MAX];
+    apr_pollfd_t  pfd[TCN_CLOSE_MAX + 1];
+    apr_int32_t   nact = 0;
+    JavaVM *vm = tcn_get_java_vm();
+    JNIEnv *env = NULL;
+    int i;
+
+    UNREFERENCED(data);
+    /* Pool cleanups of the closed sockets may release
+     * global references, so the thread needs a JNIEnv.
+     */
+    if (vm)
+        (*vm)->AttachCurrentThread(vm, (void **)&env, NULL);
+    for (;;) {
+        apr_time_t now, next = 0;
+        apr_int32_t n, k, num = 0;
+        apr_status_t rv;
+        int stop;
+
+        apr_thread_mutex_lock(sp_close_mutex);
+        while (!sp_close_stop && nact == 0 && sp_close_head == NULL)
+            apr_thread_cond_wait(sp_close_cond, sp_close_mutex);
+        stop = sp_close_stop;
+        n    = nact;
+        while (sp_close_head && nact < TCN_CLOSE_MAX) {
+            sp_close_head->state = SP_CLOSE_ACTIVE;
+            act[nact++]   = sp_close_head;
+            sp_close_head = sp_close_head->next;
+        }
+        if (sp_close_head == NULL)
+            sp_close_tail = NULL;
+        apr_thread_mutex_unlock(sp_close_mutex);
+
+        if (stop) {
+            /* Destroy the sockets still lingering or queued */
+            for (i = 0; i < nact; i++)
+                act[i]->deadline = 0;
+            n = 0;
+        }
+        for (i = n; i < nact; i++) {
+            tcn_socket_t *s = act[i]->s;
+            (*s->net->shutdown)(s->opaque, APR_SHUTDOWN_WRITE);
+            (*s->net->timeout_set)(s->opaque, 0);
+        }
+        now = apr_time_now();
+        for (i = 0, n = 0; i < nact; i++) {
+            if (act[i]->deadline > now && act[i]->s->sock) {
+                pfd[n].p         = NULL;
+                pfd[n].desc_type = APR_POLL_SOCKET;
+                pfd[n].desc.s    = act[i]->s->sock;
+                pfd[n].reqevents = APR_POLLIN;
+                pfd[n].rtnevents = 0;
+                pfd[n].client_data = act[i];
+                n++;
+                if (next == 0 || act[i]->deadline < next)
+                    next = act[i]->deadline;
+            }
+            else
+                act[i]->deadline = 0;
+        }
+        if (n > 0) {
+            /* Sleep until the first linger expires, new sockets
+             * are queued or a socket pool is destroyed.
+             */
+            pfd[n].p         = NULL;
+            pfd[n].desc_type = APR_POLL_FILE;
+            pfd[n].desc.f    = sp_close_wake[0];
+            pfd[n].reqevents = APR_POLLIN;
+            pfd[n].rtnevents = 0;
+            pfd[n].client_data = NULL;
+            rv = apr_poll(pfd, n + 1, &num, next - now);
+            if (rv == APR_SUCCESS) {
+                for (i = 0; i < n; i++) {
+                    if (pfd[i].rtnevents)
+                        sp_close_drain((sp_close_t *)pfd[i].client_data);
+                }
+                if (pfd[n].rtnevents) {
+                    char buf[64];
+                    apr_size_t nb = sizeof(buf);
+                    while (apr_file_read(sp_close_wake[0], buf,
+                                         &nb) == APR_SUCCESS)
+                        nb = sizeof(buf);
+                }
+            }
+            else if (!APR_STATUS_IS_TIMEUP(rv) && !APR_STATUS_IS_EINTR(rv)) {
+                /* Do not spin on a persistent poll error */
+                apr_sleep(apr_time_from_msec(10));
+            }
+        }
+        /* Release the sockets whose pool the owner destroys
+         * and take the expired ones.
+         */
+        apr_thread_mutex_lock(sp_close_mutex);
+        for (i = 0, n = 0, k = 0; i < nact; i++) {
+            if (act[i]->state == SP_CLOSE_GONE)
+                act[i]->state = SP_CLOSE_FREE;
+            else if (act[i]->deadline == 0) {
+                act[i]->state = SP_CLOSE_DONE;
+                dead[k++] = act[i]->s;
+            }
+            else
+                act[n++] = act[i];
+        }
+        nact = n;
+        apr_thread_cond_broadcast(sp_close_done);
+        apr_thread_mutex_unlock(sp_close_mutex);
+        for (i = 0; i < k; i++)
+            sp_socket_destroy(dead[i]);
+        if (stop) {
+            apr_thread_mutex_lock(sp_close_mutex);
+            if (sp_close_head == NULL) {
+                apr_thread_mutex_unlock(sp_close_mutex);
+                break;
+            }
+            apr_thread_mutex_unlock(sp_close_mutex);
+        }
+    }
+    if (env)
+        (*vm)->DetachCurrentThread(vm);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
 
-    UNREFERENCED(o);
-    TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->sock != NULL);
+static apr_status_t sp_close_cleanup(void *data)
+{
+    apr_status_t rv;
 
-    apr_socket_opt_get(s->sock, APR_SO_NONBLOCK, &nb);
-    if (nb)
-         bytes = (*e)->GetPrimitiveArrayCritical(e, buf, NULL);
-    else
-         bytes = (*e)->GetByteArrayElements(e, buf, NULL);
-    TCN_ASSERT(bytes != NULL);
-    ss = apr_socket_sendto(s->sock, w, flag, (char *)(bytes + offset), &nbytes);
+    UNREFERENCED(data);
+    apr_thread_mutex_lock(sp_close_mutex);
+    sp_close_stop = 1;
+    apr_thread_cond_signal(sp_close_cond);
+    apr_thread_mutex_unlock(sp_close_mutex);
+    apr_file_putc(1, sp_close_wake[1]);
+    apr_thread_join(&rv, sp_close_thread);
+    /* The thread destroyed all the queued sockets */
+    sp_close_head  = NULL;
+    sp_close_tail  = NULL;
+    sp_close_stop  = 0;
+    sp_close_thread = NULL;
+    apr_atomic_set32(&sp_close_state, 0);
+    return APR_SUCCESS;
+}
 
-    if (nb)
-        (*e)->ReleasePrimitiveArrayCritical(e, buf, bytes, 0);
-    else
-        (*e)->ReleaseByteArrayElements(e, buf, bytes, JNI_ABORT);
-    if (ss == APR_SUCCESS)
-        return (jint)nbytes;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
+static apr_status_t sp_close_start(void)
+{
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if ((p = tcn_get_global_pool()) == NULL)
+        return APR_ENOPOOL;
+    if ((rv = apr_thread_mutex_create(&sp_close_mutex,
+                                      APR_THREAD_MUTEX_DEFAULT,
+                                      p)) == APR_SUCCESS &&
+        (rv = apr_thread_cond_create(&sp_close_cond,
+                                     p)) == APR_SUCCESS &&
+        (rv = apr_thread_cond_create(&sp_close_done,
+                                     p)) == APR_SUCCESS &&
+        (rv = apr_file_pipe_create(&sp_close_wake[0],
+                                   &sp_close_wake[1],
+                                   p)) == APR_SUCCESS) {
+        apr_file_pipe_timeout_set(sp_close_wake[0], 0);
+        apr_file_pipe_timeout_set(sp_close_wake[1], 0);
+        rv = apr_thread_create(&sp_close_thread, NULL, sp_close_main,
+                               NULL, p);
     }
+    if (rv != APR_SUCCESS)
+        return rv;
+    /* Stop the thread before the socket pools are destroyed */
+    tcn_pool_pre_cleanup_register(p, NULL, sp_close_cleanup);
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, recv)(TCN_STDARGS, jlong sock,
-                                       jbyteArray buf, jint offset, jint toread)
+static apr_status_t sp_close_init(void)
+{
+    return tcn_service_start(&sp_close_state, sp_close_start);
+}
+
+/* Close and destroy the socket on the close thread.
+ * The socket must not be used, or be in any pollset, after this
+ * call. A negative linger uses the default, zero closes without
+ * draining the input.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, closeDeferred)(TCN_STDARGS, jlong sock,
+                                                jlong linger)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_size_t nbytes = (apr_size_t)toread;
-    apr_status_t ss;
+    apr_interval_time_t t = J2T(linger);
+    sp_close_t *c;
+    apr_status_t rv;
 
-    UNREFERENCED(o);
+    UNREFERENCED_STDARGS;
     TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->opaque != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
-
-    if (toread <= TCN_BUFFER_SZ) {
-        char sb[TCN_BUFFER_SZ];
-
-        if ((ss = (*s->net->recv)(s->opaque, sb, &nbytes)) == APR_SUCCESS)
-            (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, (jbyte*)&sb[0]);
-    }
-    else {
-        jbyte *bytes = (*e)->GetByteArrayElements(e, buf, NULL);
-        if ((ss = (*s->net->recv)(s->opaque, (char*)(bytes + offset),
-                                  &nbytes)) == APR_SUCCESS)
-            (*e)->ReleaseByteArrayElements(e, buf, bytes,
-                                           nbytes ? 0 : JNI_ABORT);
+    if (!s->net || !s->sock) {
+        sp_socket_destroy(s);
+        return APR_SUCCESS;
     }
+    if ((rv = sp_close_init()) != APR_SUCCESS)
+        return rv;
+    if (t < 0)
+        t = TCN_CLOSE_LINGER;
+    c = (sp_close_t *)apr_palloc(s->pool, sizeof(sp_close_t));
+    c->s        = s;
+    c->deadline = apr_time_now() + t;
+    c->next     = NULL;
+    c->state    = SP_CLOSE_QUEUED;
+    /* Run before the socket cleanup closes the descriptor */
+    tcn_pool_pre_cleanup_register(s->pool, c, sp_close_pool_cleanup);
 #ifdef TCN_DO_STATISTICS
-    if (ss == APR_SUCCESS) {
-        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
-        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
-        sp_tot_recv += nbytes;
-        sp_num_recv++;
-    }
-    else {
-        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
-            APR_STATUS_IS_TIMEUP(ss))
-            sp_tmo_recv++;
-        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
-                 APR_STATUS_IS_ECONNRESET(ss) ||
-                 APR_STATUS_IS_EOF(ss))
-            sp_rst_recv++;
-        else {
-            sp_err_recv++;
-            sp_erl_recv = ss;
-        }
-    }
+    apr_atomic_inc32(&sp_closed);
 #endif
-    if (ss == APR_SUCCESS)
-        return (jint)nbytes;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
-    }
+
+    apr_thread_mutex_lock(sp_close_mutex);
+    if (sp_close_tail)
+        sp_close_tail->next = c;
+    else
+        sp_close_head = c;
+    sp_close_tail = c;
+    apr_thread_cond_signal(sp_close_cond);
+    apr_thread_mutex_unlock(sp_close_mutex);
+    /* Wake the thread if it is polling the lingering sockets.
+     * A full pipe means a wakeup is already pending.
+     */
+    apr_file_putc(1, sp_close_wake[1]);
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, recvt)(TCN_STDARGS, jlong sock,
-                                        jbyteArray buf, jint offset,
-                                        jint toread, jlong timeout)
+TCN_IMPLEMENT_CALL(jlong, Socket, pool)(TCN_STDARGS, jlong sock)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_size_t nbytes = (apr_size_t)toread;
-    apr_status_t ss;
-    apr_interval_time_t pt;
-    apr_interval_time_t nt = J2T(timeout);
+    apr_pool_t *n;
 
     UNREFERENCED(o);
     TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->opaque != NULL);
-    TCN_ASSERT(buf != NULL);
+    TCN_THROW_IF_ERR(apr_pool_create(&n, s->pool), n);
+cleanup:
+    return P2J(n);
+}
+
+TCN_IMPLEMENT_CALL(jlong, Socket, get)(TCN_STDARGS, jlong sock, jint what)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+
+    switch (what) {
+        case TCN_SOCKET_GET_POOL:
+            return P2J(s->pool);
+        break;
+        case TCN_SOCKET_GET_IMPL:
+            return P2J(tcn_nlayer_base(s));
+        break;
+        case TCN_SOCKET_GET_APRS:
+            return P2J(s->sock);
+        break;
+        case TCN_SOCKET_GET_TYPE:
+            return (jlong)(s->net->type);
+        break;
+    }
+    return 0;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, layers)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_nlink_t  *l;
+    jint n = 0;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    for (l = s->link; l; l = l->below)
+        n++;
+    return n;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, layerPop)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_nlink_t  *l = s->link;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (l == NULL)
+        return APR_EINVAL;
+    tcn_nlayer_pop(s);
+    if (l->net.cleanup && l->net.cleanup != nl_cleanup) {
+        /* The popped layer is no longer reached by the socket
+         * cleanup, so run its own cleanup now. Detach it first
+         * so that it does not forward to the layers still in use.
+         */
+        l->next = &nl_detached;
+        (*l->net.cleanup)(l);
+    }
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, shutdown)(TCN_STDARGS, jlong sock,
+                                           jint how)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    return (jint)(*s->net->shutdown)(s->opaque, how);
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, close)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    jint rv = APR_SUCCESS;
+    apr_socket_t *as;
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+
+    as = s->sock;
+    s->sock = NULL;
+    apr_pool_cleanup_kill(s->pool, s, sp_socket_cleanup);
+    if (s->child) {
+        apr_pool_clear(s->child);
+    }
+#ifdef TCN_DO_STATISTICS
+    apr_atomic_inc32(&sp_closed);
+#endif
+    if (s->net && s->net->close) {
+        rv = (*s->net->close)(s->opaque);
+        s->net = NULL;
+    }
+    if (as) {
+        rv = (jint)apr_socket_close(as);
+    }
+    sp_pacer_detach(s);
+    return rv;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, bind)(TCN_STDARGS, jlong sock,
+                                       jlong sa)
+{
+    jint rv = APR_SUCCESS;
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_sockaddr_t *a = J2P(sa, apr_sockaddr_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (s->sock == NULL)
+        return APR_ENOTSOCK;
+    rv = (jint)apr_socket_bind(s->sock, a);
+    return rv;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, listen)(TCN_STDARGS, jlong sock,
+                                         jint backlog)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (s->sock == NULL)
+        return APR_ENOTSOCK;
+    return (jint)apr_socket_listen(s->sock, backlog);
+}
+
+/* PROXY protocol.
+ * The accept does not wait for the header. The accepted socket
+ * gets a filter layer that reads the header on the first recv,
+ * or when Socket.proxyRead is called, and removes itself once
+ * the header is consumed. The header is looked at with MSG_PEEK
+ * so that exactly the header bytes are consumed and any payload
+ * sent along with it stays in the socket for the first recv.
+ * While the header is incomplete the SO_RCVLOWAT is raised to
+ * the size still needed, so that neither our wait nor the Poller
+ * wake up before there is something new to look at.
+ */
+static const char proxy_v2_sig[12] = {
+    '\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n'
+};
+
+/* Set the receive low water mark, ignored where unsupported */
+static void proxy_lowat(apr_socket_t *sock, apr_size_t need)
+{
+#if defined(SO_RCVLOWAT) && !defined(WIN32)
+    apr_os_sock_t sd;
+    int n = (int)need;
+
+    if (apr_os_sock_get(&sd, sock) == APR_SUCCESS)
+        setsockopt(sd, SOL_SOCKET, SO_RCVLOWAT, (void *)&n, sizeof(int));
+#else
+    UNREFERENCED(sock);
+    UNREFERENCED(need);
+#endif
+}
+
+/* Peek at the bytes already received, without waiting */
+static apr_status_t proxy_peek(apr_socket_t *sock, char *buf,
+                               apr_size_t max, apr_size_t *got)
+{
+    apr_os_sock_t sd;
+    apr_pollfd_t pfd;
+    apr_int32_t n;
+    apr_status_t ss;
+    int rv;
+
+    *got = 0;
+    apr_os_sock_get(&sd, sock);
+    pfd.p         = NULL;
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s    = sock;
+    pfd.reqevents = APR_POLLIN;
+    ss = apr_poll(&pfd, 1, &n, 0);
+    if (APR_STATUS_IS_TIMEUP(ss) || APR_STATUS_IS_EINTR(ss))
+        return APR_SUCCESS;
+    if (ss != APR_SUCCESS)
+        return ss;
+    do {
+        rv = recv(sd, buf, (int)max, MSG_PEEK);
+    } while (rv < 0 && APR_STATUS_IS_EINTR(apr_get_netos_error()));
+    if (rv == 0)
+        return APR_EOF;
+    if (rv < 0) {
+        ss = apr_get_netos_error();
+        return APR_STATUS_IS_EAGAIN(ss) ? APR_SUCCESS : ss;
+    }
+    *got = (apr_size_t)rv;
+    return APR_SUCCESS;
+}
+
+/* Look at the got bytes received so far. Returns APR_SUCCESS with
+ * the header length in hlen, or with zero hlen if this is not
+ * a PROXY header, and APR_INCOMPLETE with the number of bytes
+ * needed to tell in need.
+ */
+static apr_status_t proxy_need(const char *buf, apr_size_t got,
+                               apr_size_t *hlen, apr_size_t *need)
+{
+    apr_size_t i;
+
+    *hlen = 0;
+    *need = got + 1;
+    if (got == 0)
+        return APR_INCOMPLETE;
+    if (memcmp(buf, proxy_v2_sig, TCN_MIN(got, 12)) == 0) {
+        if (got < 16) {
+            *need = 16;
+            return APR_INCOMPLETE;
+        }
+        i = 16 + (((unsigned char)buf[14] << 8) | (unsigned char)buf[15]);
+        if (i > TCN_PROXY_MAX)
+            return APR_EINVAL;
+        if (got < i) {
+            *need = i;
+            return APR_INCOMPLETE;
+        }
+        *hlen = i;
+        return APR_SUCCESS;
+    }
+    if (memcmp(buf, "PROXY ", TCN_MIN(got, 6)) == 0) {
+        /* The v1 header is at most 107 bytes */
+        for (i = 1; i < got && i < 107; i++) {
+            if (buf[i - 1] == '\r' && buf[i] == '\n') {
+                *hlen = i + 1;
+                return APR_SUCCESS;
+            }
+        }
+        return got >= 107 ? APR_EINVAL : APR_INCOMPLETE;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t proxy_addr(apr_sockaddr_t **sa, apr_int32_t family,
+                               const void *addr, apr_size_t alen,
+                               const unsigned char *port, apr_pool_t *p)
+{
+    apr_status_t ss;
+
+    ss = apr_sockaddr_info_get(sa, NULL, family,
+                               (apr_port_t)((port[0] << 8) | port[1]), 0, p);
+    if (ss == APR_SUCCESS)
+        memcpy((*sa)->ipaddr_ptr, addr, alen);
+    return ss;
+}
+
+static int proxy_numeric(const char *s, apr_int32_t family)
+{
+    if (!*s)
+        return 0;
+    for (; *s; s++) {
+        if (apr_isdigit(*s) || *s == '.')
+            continue;
+        if (family != APR_INET && (apr_isxdigit(*s) || *s == ':'))
+            continue;
+        return 0;
+    }
+    return 1;
+}
+
+/* Decimal port without sign or leading zeros */
+static int proxy_port(const char *s, apr_port_t *port)
+{
+    apr_uint32_t n = 0;
+    int i;
+
+    for (i = 0; s[i]; i++) {
+        if (i == 5 || !apr_isdigit(s[i]) || (i == 1 && s[0] == '0'))
+            return 0;
+        n = n * 10 + (s[i] - '0');
+    }
+    if (i == 0 || n > 65535)
+        return 0;
+    *port = (apr_port_t)n;
+    return 1;
+}
+
+static apr_status_t proxy_parse_v1(tcn_socket_t *a, char *line)
+{
+    char *tok[6];
+    char *last = NULL;
+    char *w;
+    int  n = 0;
+    apr_int32_t family;
+    apr_port_t sport, dport;
+    apr_status_t ss;
+
+    for (w = apr_strtok(line, " ", &last); w && n < 6;
+         w = apr_strtok(NULL, " ", &last))
+        tok[n++] = w;
+    if (n < 2 || strcmp(tok[0], "PROXY"))
+        return APR_EINVAL;
+    if (!strcmp(tok[1], "UNKNOWN"))
+        return APR_SUCCESS;
+    if (n != 6)
+        return APR_EINVAL;
+    if (!strcmp(tok[1], "TCP4"))
+        family = APR_INET;
+#if APR_HAVE_IPV6
+    else if (!strcmp(tok[1], "TCP6"))
+        family = APR_INET6;
+#endif
+    else
+        return APR_EINVAL;
+    /* Make sure no name lookup can be triggered */
+    if (!proxy_numeric(tok[2], family) || !proxy_numeric(tok[3], family))
+        return APR_EINVAL;
+    if (!proxy_port(tok[4], &sport) || !proxy_port(tok[5], &dport))
+        return APR_EINVAL;
+    ss = apr_sockaddr_info_get(&a->proxy_src, tok[2], family,
+                               sport, 0, a->pool);
+    if (ss == APR_SUCCESS)
+        ss = apr_sockaddr_info_get(&a->proxy_dst, tok[3], family,
+                                   dport, 0, a->pool);
+    return ss;
+}
+
+static apr_status_t proxy_parse_v2(tcn_socket_t *a, const unsigned char *h,
+                                   apr_size_t len)
+{
+    apr_status_t ss;
+
+    if ((h[12] & 0xF0) != 0x20)
+        return APR_EINVAL;
+    /* LOCAL command, keep the connection addresses */
+    if ((h[12] & 0x0F) == 0x00)
+        return APR_SUCCESS;
+    if ((h[12] & 0x0F) != 0x01)
+        return APR_EINVAL;
+    switch (h[13] >> 4) {
+        case 0x1:
+            if (len < 16 + 12)
+                return APR_EINVAL;
+            ss = proxy_addr(&a->proxy_src, APR_INET, h + 16, 4,
+                            h + 24, a->pool);
+            if (ss == APR_SUCCESS)
+                ss = proxy_addr(&a->proxy_dst, APR_INET, h + 20, 4,
+                                h + 26, a->pool);
+            return ss;
+#if APR_HAVE_IPV6
+        case 0x2:
+            if (len < 16 + 36)
+                return APR_EINVAL;
+            ss = proxy_addr(&a->proxy_src, APR_INET6, h + 16, 16,
+                            h + 48, a->pool);
+            if (ss == APR_SUCCESS)
+                ss = proxy_addr(&a->proxy_dst, APR_INET6, h + 32, 16,
+                                h + 50, a->pool);
+            return ss;
+#endif
+        default:
+            /* AF_UNSPEC and AF_UNIX carry no usable address */
+            return APR_SUCCESS;
+    }
+}
+
+static apr_status_t APR_THREAD_FUNC
+proxy_recv(apr_socket_t *sock, char *buf, apr_size_t *len);
+
+/* Read the PROXY header of the accepted socket, waiting for it up
+ * to t, or until the TCN_PROXY_TIMEOUT since the accept expires.
+ * A negative t waits for the whole TCN_PROXY_TIMEOUT.
+ * Returns APR_EAGAIN or APR_TIMEUP if the header is not complete
+ * yet, in which case the call can be repeated.
+ */
+static apr_status_t sp_proxy_read(tcn_socket_t *a, apr_interval_time_t t)
+{
+    char buf[TCN_PROXY_MAX + 1];
+    apr_time_t end = t > 0 ? apr_time_now() + t : 0;
+    apr_size_t got, hlen = 0, need;
+    apr_status_t ss;
+
+    if (a->proxy < 0)
+        return (apr_status_t)-a->proxy;
+    /* Nothing pending, or this is the listener */
+    if (a->proxy == TCN_PROXY_NONE || a->proxy_deadline == 0)
+        return APR_SUCCESS;
+    for (;;) {
+        apr_interval_time_t w;
+        apr_pollfd_t pfd;
+        apr_int32_t  n;
+        apr_time_t   now;
+
+        /* The peek itself must not be held back by the low mark
+         * left by the previous call or the previous round
+         */
+        proxy_lowat(a->sock, 1);
+        if ((ss = proxy_peek(a->sock, buf, TCN_PROXY_MAX, &got)) != APR_SUCCESS)
+            break;
+        if ((ss = proxy_need(buf, got, &hlen, &need)) != APR_INCOMPLETE)
+            break;
+        now = apr_time_now();
+        if (now >= a->proxy_deadline) {
+            ss = APR_TIMEUP;
+            break;
+        }
+        proxy_lowat(a->sock, need);
+        if (t == 0)
+            return APR_EAGAIN;
+        if (end && now >= end)
+            return APR_TIMEUP;
+        w = a->proxy_deadline - now;
+        if (end && end - now < w)
+            w = end - now;
+#if defined(WIN32) || !defined(SO_RCVLOWAT)
+        /* Without the low mark the poll returns at once */
+        if (got) {
+            apr_sleep(TCN_MIN(w, APR_USEC_PER_SEC / 100));
+            continue;
+        }
+#endif
+        pfd.p         = NULL;
+        pfd.desc_type = APR_POLL_SOCKET;
+        pfd.desc.s    = a->sock;
+        pfd.reqevents = APR_POLLIN;
+        ss = apr_poll(&pfd, 1, &n, w);
+        if (ss != APR_SUCCESS && !APR_STATUS_IS_TIMEUP(ss) &&
+            !APR_STATUS_IS_EINTR(ss))
+            break;
+    }
+
+    if (ss == APR_SUCCESS && hlen) {
+        /* Consume the header, it is all in the socket buffer */
+        apr_size_t n = hlen;
+        ss = apr_socket_recv(a->sock, buf, &n);
+        if (ss == APR_SUCCESS && n != hlen)
+            ss = APR_EINVAL;
+        if (ss == APR_SUCCESS && buf[0] == 'P') {
+            buf[hlen - 2] = '\0';
+            ss = proxy_parse_v1(a, buf);
+        }
+        else if (ss == APR_SUCCESS)
+            ss = proxy_parse_v2(a, (const unsigned char *)buf, hlen);
+    }
+    else if (ss == APR_SUCCESS && a->proxy == TCN_PROXY_REQUIRED)
+        ss = APR_EINVAL;
+
+    if (ss != APR_SUCCESS) {
+        /* Keep failing, the payload must not be taken for
+         * data coming from the load balancer.
+         */
+        a->proxy_src = NULL;
+        a->proxy_dst = NULL;
+        a->proxy     = -(int)ss;
+        return ss;
+    }
+    a->proxy = TCN_PROXY_NONE;
+    if (a->link && a->link->net.recv == proxy_recv)
+        tcn_nlayer_pop(a);
+    return APR_SUCCESS;
+}
+
+/* Filter layer of the sockets whose PROXY header is not read yet */
+static apr_status_t APR_THREAD_FUNC
+proxy_recv(apr_socket_t *sock, char *buf, apr_size_t *len)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    apr_interval_time_t t;
+    apr_status_t ss;
+
+    if (l->sock->proxy) {
+        TCN_NLAYER_NEXT(l, timeout_get)(l->next_opaque, &t);
+        if ((ss = sp_proxy_read(l->sock, t)) != APR_SUCCESS) {
+            *len = 0;
+            return ss;
+        }
+    }
+    return TCN_NLAYER_NEXT(l, recv)(l->next_opaque, buf, len);
+}
+
+static apr_status_t APR_THREAD_FUNC
+proxy_recvv(apr_socket_t *sock, const struct iovec *vec,
+            apr_int32_t nvec, apr_size_t *len)
+{
+    tcn_nlink_t *l = (tcn_nlink_t *)sock;
+    apr_interval_time_t t;
+    apr_status_t ss;
+
+    if (l->sock->proxy) {
+        TCN_NLAYER_NEXT(l, timeout_get)(l->next_opaque, &t);
+        if ((ss = sp_proxy_read(l->sock, t)) != APR_SUCCESS) {
+            *len = 0;
+            return ss;
+        }
+    }
+    return TCN_NLAYER_NEXT(l, recvv)(l->next_opaque, vec, nvec, len);
+}
+
+static const tcn_nlayer_t proxy_layer = {
+    TCN_SOCKET_APR,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    proxy_recv,
+    proxy_recvv
+};
+
+/* Make the accepted socket read the PROXY header lazily */
+static apr_status_t sp_proxy_attach(tcn_socket_t *a, int mode)
+{
+    a->proxy          = mode;
+    a->proxy_deadline = apr_time_now() + TCN_PROXY_TIMEOUT;
+    return tcn_nlayer_push(a, &proxy_layer, NULL);
+}
+
+/* Read a PROXY protocol v1 or v2 header from every socket accepted
+ * on this listener. The addresses it carries are returned by
+ * Address.get instead of the load balancer ones. The header is read
+ * by the first recv on the accepted socket or by Socket.proxyRead,
+ * which must complete before the SSLSocket.attach or the splice.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, proxyProtocol)(TCN_STDARGS, jlong sock,
+                                                jint mode)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (mode < TCN_PROXY_NONE || mode > TCN_PROXY_OPTIONAL)
+        return APR_EINVAL;
+    if (s->net && s->net->type != TCN_SOCKET_APR)
+        return APR_ENOTIMPL;
+    s->proxy = mode;
+    return APR_SUCCESS;
+}
+
+/* Read the PROXY header of the accepted socket, honoring the
+ * socket timeout. A non-blocking socket gets APR_EAGAIN until
+ * the whole header arrives; the socket does not poll readable
+ * again before that. Returns APR_SUCCESS once the header is read
+ * or if none is expected.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, proxyRead)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_interval_time_t t;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (s->proxy == TCN_PROXY_NONE)
+        return APR_SUCCESS;
+    (*s->net->timeout_get)(s->opaque, &t);
+    return (jint)sp_proxy_read(s, t);
+}
+
+TCN_IMPLEMENT_CALL(jlong, Socket, acceptx)(TCN_STDARGS, jlong sock,
+                                           jlong pool)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_pool_t   *p = J2P(pool, apr_pool_t *);
+    apr_socket_t *n = NULL;
+    tcn_socket_t *a = NULL;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+
+    if (s->net->type == TCN_SOCKET_APR) {
+        TCN_ASSERT(s->sock != NULL);
+        a = (tcn_socket_t *)apr_pcalloc(p, sizeof(tcn_socket_t));
+        TCN_CHECK_ALLOCATED(a);
+        a->pool   = p;
+        apr_pool_cleanup_register(a->pool, (const void *)a,
+                                  sp_socket_cleanup,
+                                  apr_pool_cleanup_null);
+
+        TCN_THROW_IF_ERR(apr_socket_accept(&n, s->sock, p), n);
+    }
+    else {
+        tcn_ThrowAPRException(e, APR_ENOTIMPL);
+        goto cleanup;
+    }
+    if (n) {
+#ifdef TCN_DO_STATISTICS
+        apr_atomic_inc32(&sp_accepted);
+#endif
+        a->net    = &apr_socket_layer;
+        a->sock   = n;
+        a->opaque = n;
+        if (s->stat && s->stat->enabled) {
+            a->stat = (tcn_sockstat_t *)apr_pcalloc(a->pool,
+                                                    sizeof(tcn_sockstat_t));
+            a->stat->enabled = 1;
+        }
+        if (s->proxy) {
+            apr_status_t ss = sp_proxy_attach(a, s->proxy);
+            if (ss != APR_SUCCESS) {
+                apr_pool_cleanup_run(a->pool, a, sp_socket_cleanup);
+                tcn_ThrowAPRException(e, ss);
+                a = NULL;
+            }
+        }
+    }
+
+cleanup:
+    return P2J(a);
+}
+
+TCN_IMPLEMENT_CALL(jlong, Socket, accept)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_pool_t   *p = NULL;
+    apr_socket_t *n = NULL;
+    tcn_socket_t *a = NULL;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+
+    TCN_THROW_IF_ERR(apr_pool_create(&p, s->child), p);
+    if (s->net->type == TCN_SOCKET_APR) {
+        TCN_ASSERT(s->sock != NULL);
+        a = (tcn_socket_t *)apr_pcalloc(p, sizeof(tcn_socket_t));
+        TCN_CHECK_ALLOCATED(a);
+        TCN_THROW_IF_ERR(apr_socket_accept(&n, s->sock, p), n);
+
+        a->pool = p;
+        apr_pool_cleanup_register(a->pool, (const void *)a,
+                                  sp_socket_cleanup,
+                                  apr_pool_cleanup_null);
+
+    }
+    else {
+        tcn_ThrowAPRException(e, APR_ENOTIMPL);
+        goto cleanup;
+    }
+    if (n) {
+#ifdef TCN_DO_STATISTICS
+        apr_atomic_inc32(&sp_accepted);
+#endif
+        a->net    = &apr_socket_layer;
+        a->sock   = n;
+        a->opaque = n;
+        if (s->stat && s->stat->enabled) {
+            a->stat = (tcn_sockstat_t *)apr_pcalloc(a->pool,
+                                                    sizeof(tcn_sockstat_t));
+            a->stat->enabled = 1;
+        }
+        if (s->proxy) {
+            TCN_THROW_IF_ERR(sp_proxy_attach(a, s->proxy), a);
+        }
+    }
+    return P2J(a);
+cleanup:
+    if (tcn_global_pool && p && s->sock)
+        apr_pool_destroy(p);
+    return 0;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, connect)(TCN_STDARGS, jlong sock,
+                                          jlong sa)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_sockaddr_t *a = J2P(sa, apr_sockaddr_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (s->sock == NULL)
+        return APR_ENOTSOCK;
+    return (jint)apr_socket_connect(s->sock, a);
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, send)(TCN_STDARGS, jlong sock,
+                                      jbyteArray buf, jint offset, jint tosend)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)tosend;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    if (s->wbuf && s->wbuf->len && (ss = wbuf_drain(s)) != APR_SUCCESS)
+        return -(jint)ss;
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, nbytes);
+    sp_min_send = TCN_MIN(sp_min_send, nbytes);
+    sp_tot_send += nbytes;
+    sp_num_send++;
+#endif
+
+    if (tosend <= TCN_BUFFER_SZ) {
+        jbyte sb[TCN_BUFFER_SZ];
+        (*e)->GetByteArrayRegion(e, buf, offset, tosend, &sb[0]);
+        ss = (*s->net->send)(s->opaque, (const char *)&sb[0], &nbytes);
+    }
+    else {
+        apr_size_t sent = 0;
+        apr_size_t chunk = nbytes;
+        char *sb = sp_bounce_get(&chunk);
+
+        if (sb == NULL)
+            return -APR_ENOMEM;
+        /* Transfers above the bounce buffer limit are
+         * sent in chunks of the buffer size.
+         */
+        ss = APR_SUCCESS;
+        while (sent < nbytes) {
+            apr_size_t cs = TCN_MIN(chunk, nbytes - sent);
+            apr_size_t wr = cs;
+
+            (*e)->GetByteArrayRegion(e, buf, offset + (jint)sent,
+                                     (jsize)cs, (jbyte *)sb);
+            ss = (*s->net->send)(s->opaque, sb, &wr);
+            sent += wr;
+            if (ss != APR_SUCCESS || wr < cs)
+                break;
+        }
+        nbytes = sent;
+    }
+    sp_count_io(s, 1, ss, nbytes);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && nbytes > 0))
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(void, Socket, setsbb)(TCN_STDARGS, jlong sock,
+                                         jobject buf)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    if (buf)
+        s->jsbbuff = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    else
+        s->jsbbuff = NULL;
+}
+
+TCN_IMPLEMENT_CALL(void, Socket, setrbb)(TCN_STDARGS, jlong sock,
+                                         jobject buf)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    if (buf)
+        s->jrbbuff = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    else
+        s->jrbbuff = NULL;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendb)(TCN_STDARGS, jlong sock,
+                                        jobject buf, jint offset, jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)len;
+    apr_size_t sent = 0;
+    char *bytes;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(buf != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, nbytes);
+    sp_min_send = TCN_MIN(sp_min_send, nbytes);
+    sp_tot_send += nbytes;
+    sp_num_send++;
+#endif
+
+    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+
+    while (sent < nbytes) {
+        apr_size_t wr = nbytes - sent;
+        ss = sp_socket_send(s, bytes + offset + sent, &wr);
+        if (ss != APR_SUCCESS)
+            break;
+        sent += wr;
+    }
+
+    sp_count_io(s, 1, ss, sent);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && sent > 0))
+        return (jint)sent;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendib)(TCN_STDARGS, jlong sock,
+                                         jobject buf, jint offset, jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)len;
+    char *bytes;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(buf != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, nbytes);
+    sp_min_send = TCN_MIN(sp_min_send, nbytes);
+    sp_tot_send += nbytes;
+    sp_num_send++;
+#endif
+
+    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+
+    ss = sp_socket_send(s, bytes + offset, &nbytes);
+
+    sp_count_io(s, 1, ss, nbytes);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && nbytes > 0))
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendbb)(TCN_STDARGS, jlong sock,
+                                         jint offset, jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)len;
+    apr_size_t sent = 0;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(s->jsbbuff != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, nbytes);
+    sp_min_send = TCN_MIN(sp_min_send, nbytes);
+    sp_tot_send += nbytes;
+    sp_num_send++;
+#endif
+
+    while (sent < nbytes) {
+        apr_size_t wr = nbytes - sent;
+        ss = sp_socket_send(s, s->jsbbuff + offset + sent, &wr);
+        if (ss != APR_SUCCESS || wr == 0)
+            break;
+        sent += wr;
+    }
+    sp_count_io(s, 1, ss, sent);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && sent > 0))
+        return (jint)sent;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendibb)(TCN_STDARGS, jlong sock,
+                                          jint offset, jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)len;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(s->jsbbuff != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, nbytes);
+    sp_min_send = TCN_MIN(sp_min_send, nbytes);
+    sp_tot_send += nbytes;
+    sp_num_send++;
+#endif
+
+    ss = sp_socket_send(s, s->jsbbuff + offset, &nbytes);
+
+    sp_count_io(s, 1, ss, nbytes);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && nbytes > 0))
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendv)(TCN_STDARGS, jlong sock,
+                                        jobjectArray bufs)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    jsize nvec;
+    jsize i;
+    struct iovec vec[APR_MAX_IOVEC_SIZE];
+    jobject ba[APR_MAX_IOVEC_SIZE];
+    apr_size_t written = 0;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    if (s->wbuf && s->wbuf->len && (ss = wbuf_drain(s)) != APR_SUCCESS)
+        return -(jint)ss;
+
+    nvec = (*e)->GetArrayLength(e, bufs);
+    if (nvec >= APR_MAX_IOVEC_SIZE)
+        return (jint)(-APR_ENOMEM);
+
+    for (i = 0; i < nvec; i++) {
+        ba[i] = (*e)->GetObjectArrayElement(e, bufs, i);
+        vec[i].iov_len  = (*e)->GetArrayLength(e, ba[i]);
+        vec[i].iov_base = (void *)((*e)->GetByteArrayElements(e, ba[i], NULL));
+    }
+
+    ss = (*s->net->sendv)(s->opaque, vec, nvec, &written);
+
+    for (i = 0; i < nvec; i++) {
+        (*e)->ReleaseByteArrayElements(e, ba[i], (jbyte*)vec[i].iov_base, JNI_ABORT);
+    }
+    sp_count_io(s, 1, ss, written);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && written > 0))
+        return (jint)written;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+/* Fill the iovec array from the direct ByteBuffer array.
+ * The data is never copied; each vector points directly
+ * at the buffer memory starting at offsets[i] for lens[i] bytes.
+ */
+static apr_status_t bb_iovec_fill(JNIEnv *e, jobjectArray bufs,
+                                  jintArray offsets, jintArray lens,
+                                  struct iovec *vec, jsize *nvec)
+{
+    jint  off[APR_MAX_IOVEC_SIZE];
+    jint  len[APR_MAX_IOVEC_SIZE];
+    jsize i, n;
+
+    n = (*e)->GetArrayLength(e, bufs);
+    if (n >= APR_MAX_IOVEC_SIZE)
+        return APR_ENOMEM;
+    if ((*e)->GetArrayLength(e, offsets) < n ||
+        (*e)->GetArrayLength(e, lens) < n)
+        return APR_EINVAL;
+    (*e)->GetIntArrayRegion(e, offsets, 0, n, &off[0]);
+    (*e)->GetIntArrayRegion(e, lens, 0, n, &len[0]);
+    for (i = 0; i < n; i++) {
+        jobject bb  = (*e)->GetObjectArrayElement(e, bufs, i);
+        char *bytes = bb ? (char *)(*e)->GetDirectBufferAddress(e, bb) : NULL;
+        if (bb)
+            (*e)->DeleteLocalRef(e, bb);
+        if (bytes == NULL || off[i] < 0 || len[i] < 0)
+            return APR_EINVAL;
+        vec[i].iov_base = bytes + off[i];
+        vec[i].iov_len  = (apr_size_t)len[i];
+    }
+    *nvec = n;
+    return APR_SUCCESS;
+}
+
+/* Fill the iovec array from the (address, length) pairs.
+ */
+static apr_status_t addr_iovec_fill(JNIEnv *e, jlongArray iov, jint n,
+                                    struct iovec *vec)
+{
+    jlong pairs[APR_MAX_IOVEC_SIZE * 2];
+    jint  i;
+
+    if (n < 0 || n >= APR_MAX_IOVEC_SIZE)
+        return APR_ENOMEM;
+    if ((*e)->GetArrayLength(e, iov) < n * 2)
+        return APR_EINVAL;
+    (*e)->GetLongArrayRegion(e, iov, 0, n * 2, &pairs[0]);
+    for (i = 0; i < n; i++) {
+        if (pairs[i*2+0] == 0 || pairs[i*2+1] < 0)
+            return APR_EINVAL;
+        vec[i].iov_base = J2P(pairs[i*2+0], void *);
+        vec[i].iov_len  = (apr_size_t)pairs[i*2+1];
+    }
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendvb)(TCN_STDARGS, jlong sock,
+                                         jobjectArray bufs,
+                                         jintArray offsets,
+                                         jintArray lens)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    jsize nvec = 0;
+    struct iovec vec[APR_MAX_IOVEC_SIZE];
+    apr_size_t written = 0;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    if ((ss = bb_iovec_fill(e, bufs, offsets, lens, vec, &nvec)) != APR_SUCCESS)
+        return -(jint)ss;
+    if (s->wbuf && s->wbuf->len && (ss = wbuf_drain(s)) != APR_SUCCESS)
+        return -(jint)ss;
+
+    ss = (*s->net->sendv)(s->opaque, vec, nvec, &written);
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, written);
+    sp_min_send = TCN_MIN(sp_min_send, written);
+    sp_tot_send += written;
+    sp_num_send++;
+#endif
+    sp_count_io(s, 1, ss, written);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && written > 0))
+        return (jint)written;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendva)(TCN_STDARGS, jlong sock,
+                                         jlongArray iov, jint nvec)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    struct iovec vec[APR_MAX_IOVEC_SIZE];
+    apr_size_t written = 0;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    if ((ss = addr_iovec_fill(e, iov, nvec, vec)) != APR_SUCCESS)
+        return -(jint)ss;
+    if (s->wbuf && s->wbuf->len && (ss = wbuf_drain(s)) != APR_SUCCESS)
+        return -(jint)ss;
+
+    ss = (*s->net->sendv)(s->opaque, vec, nvec, &written);
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, written);
+    sp_min_send = TCN_MIN(sp_min_send, written);
+    sp_tot_send += written;
+    sp_num_send++;
+#endif
+    sp_count_io(s, 1, ss, written);
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && written > 0))
+        return (jint)written;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+/* Write-combining output buffer.
+ * Small writes are copied into a per-socket buffer and sent with a
+ * single sendv when the buffer fills, on Socket.flush or when
+ * a write does not fit.
+ * The send, sendb, sendbb and sendv families send the buffered
+ * bytes first and return APR_EAGAIN if they cannot. The sendfile,
+ * datagram and deadline sends do not, callers must flush first.
+ */
+static apr_status_t wbuf_cork(tcn_socket_t *s, int on)
+{
+    tcn_wbuf_t *w = s->wbuf;
+    apr_status_t ss = APR_SUCCESS;
+
+    if (!(w->flags & TCN_WBUF_CORK) || w->corked == on)
+        return APR_SUCCESS;
+    if (s->sock)
+        ss = apr_socket_opt_set(s->sock, APR_TCP_NOPUSH, on);
+    if (ss == APR_SUCCESS)
+        w->corked = on;
+    return ss;
+}
+
+/* Send the buffered data followed by len bytes of data.
+ * On return *sent holds the number of bytes of data written.
+ * Buffered data that could not be written is kept.
+ */
+static apr_status_t wbuf_write(tcn_socket_t *s, const char *data,
+                               apr_size_t len, apr_size_t *sent)
+{
+    tcn_wbuf_t *w = s->wbuf;
+    apr_status_t ss = APR_SUCCESS;
+    apr_size_t off = 0;
+
+    *sent = 0;
+    while (off < w->len || *sent < len) {
+        struct iovec vec[2];
+        apr_int32_t  nvec = 0;
+        apr_size_t   wr = 0;
+
+        if (off < w->len) {
+            vec[nvec].iov_base = w->buf + off;
+            vec[nvec].iov_len  = w->len - off;
+            nvec++;
+        }
+        if (*sent < len) {
+            vec[nvec].iov_base = (void *)(data + *sent);
+            vec[nvec].iov_len  = len - *sent;
+            nvec++;
+        }
+        ss = (*s->net->sendv)(s->opaque, vec, nvec, &wr);
+        sp_count_io(s, 1, ss, wr);
+        if (wr > w->len - off) {
+            *sent += wr - (w->len - off);
+            off    = w->len;
+        }
+        else
+            off   += wr;
+        if (ss != APR_SUCCESS || wr == 0)
+            break;
+    }
+    if (off > 0) {
+        w->len -= off;
+        if (w->len)
+            memmove(w->buf, w->buf + off, w->len);
+    }
+    return ss;
+}
+
+/* Send the buffered bytes ahead of an unbuffered send */
+static apr_status_t wbuf_drain(tcn_socket_t *s)
+{
+    apr_size_t sent;
+    apr_status_t ss = wbuf_write(s, NULL, 0, &sent);
+
+    if (ss == APR_SUCCESS && s->wbuf->len)
+        ss = APR_EAGAIN;
+    return ss;
+}
+
+/* Enable the buffer with size bytes, or flush and
+ * disable it if size is zero. Returns APR_EAGAIN, and
+ * changes nothing, if the buffered bytes could not be sent.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, wbufSet)(TCN_STDARGS, jlong sock,
+                                          jint size, jint flags)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_wbuf_t *w;
+    apr_size_t sent;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!s->net)
+        return APR_EINVALSOCK;
+    if (size < 0)
+        return APR_EINVAL;
+    if ((w = s->wbuf) != NULL) {
+        if (w->len && (ss = wbuf_write(s, NULL, 0, &sent)) != APR_SUCCESS)
+            return ss;
+        /* Keep the buffer while it still holds unsent bytes */
+        if (w->len)
+            return APR_EAGAIN;
+        wbuf_cork(s, 0);
+        if (size == 0) {
+            s->wbuf = NULL;
+            return APR_SUCCESS;
+        }
+    }
+    else if (size == 0)
+        return APR_SUCCESS;
+    else {
+        w = (tcn_wbuf_t *)apr_pcalloc(s->pool, sizeof(tcn_wbuf_t));
+        s->wbuf = w;
+    }
+    if ((apr_size_t)size > w->size) {
+        w->buf  = (char *)apr_palloc(s->pool, size);
+        w->size = size;
+    }
+    w->flags = flags;
+    return APR_SUCCESS;
+}
+
+static jint wbuf_append(tcn_socket_t *s, const char *data,
+                        apr_size_t len)
+{
+    tcn_wbuf_t *w = s->wbuf;
+    apr_size_t sent = 0;
+    apr_status_t ss;
+
+    if (w == NULL) {
+        ss = (*s->net->send)(s->opaque, data, &len);
+        sp_count_io(s, 1, ss, len);
+        sent = len;
+    }
+    else if (len <= w->size - w->len) {
+        memcpy(w->buf + w->len, data, len);
+        w->len += len;
+        return (jint)len;
+    }
+    else {
+        wbuf_cork(s, 1);
+        ss = wbuf_write(s, data, len, &sent);
+        /* Keep what fits of the rest if the socket would block */
+        if (sent < len && w->len < w->size) {
+            apr_size_t n = TCN_MIN(len - sent, w->size - w->len);
+            memcpy(w->buf + w->len, data + sent, n);
+            w->len += n;
+            sent   += n;
+        }
+    }
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN) && sent > 0))
+        return (jint)sent;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+/* Buffered writes. They return the number of bytes accepted,
+ * which were either sent or copied to the buffer.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, sendw)(TCN_STDARGS, jlong sock,
+                                        jbyteArray buf, jint offset,
+                                        jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_wbuf_t *w = s->wbuf;
+    apr_size_t chunk = (apr_size_t)len;
+    jint done = 0;
+    char *sb;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    /* Small writes are copied straight into the buffer */
+    if (w && len <= (jint)(w->size - w->len)) {
+        (*e)->GetByteArrayRegion(e, buf, offset, len,
+                                 (jbyte *)(w->buf + w->len));
+        if ((*e)->ExceptionCheck(e))
+            return -(jint)APR_EINVAL;
+        w->len += len;
+        return len;
+    }
+    /* Copy only the range through the bounce buffer,
+     * in chunks of its size if the range is above the limit.
+     */
+    if ((sb = sp_bounce_get(&chunk)) == NULL)
+        return -(jint)APR_ENOMEM;
+    while (done < len) {
+        jint cs = (jint)TCN_MIN(chunk, (apr_size_t)(len - done));
+        jint rv;
+
+        (*e)->GetByteArrayRegion(e, buf, offset + done, cs, (jbyte *)sb);
+        if ((*e)->ExceptionCheck(e))
+            return done > 0 ? done : -(jint)APR_EINVAL;
+        rv = wbuf_append(s, sb, (apr_size_t)cs);
+        if (rv < 0)
+            return done > 0 ? done : rv;
+        done += rv;
+        if (rv < cs)
+            break;
+    }
+    return done;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendbw)(TCN_STDARGS, jlong sock,
+                                         jobject buf, jint offset,
+                                         jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    char *bytes;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    bytes = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    TCN_ASSERT(bytes != NULL);
+    return wbuf_append(s, bytes + offset, (apr_size_t)len);
+}
+
+/* Send the buffered data. If end is set this is the end of
+ * the response and TCP_CORK is cleared to push the last
+ * partial frame. Returns the number of bytes still buffered.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, flush)(TCN_STDARGS, jlong sock,
+                                        jboolean end)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t sent;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    if (!s->net || !s->wbuf)
+        return 0;
+    if (s->wbuf->len) {
+        wbuf_cork(s, 1);
+        ss = wbuf_write(s, NULL, 0, &sent);
+    }
+    if (end && s->wbuf->len == 0)
+        wbuf_cork(s, 0);
+    if (ss == APR_SUCCESS || APR_STATUS_IS_EAGAIN(ss) || ss == TCN_EAGAIN)
+        return (jint)s->wbuf->len;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+static apr_status_t pacer_cleanup(void *data)
+{
+    pacer_release((tcn_pacer_t *)data);
+    return APR_SUCCESS;
+}
+
+/* Create a pacer allowing rate bytes per second with bursts
+ * of up to burst bytes. Attach it to one socket for per-socket
+ * limits or to several sockets for a shared group limit.
+ */
+TCN_IMPLEMENT_CALL(jlong, Socket, pacerCreate)(TCN_STDARGS, jlong pool,
+                                               jlong rate, jlong burst)
+{
+    apr_pool_t *p = J2P(pool, apr_pool_t *);
+    apr_pool_t *c = NULL;
+    tcn_pacer_t *pc = NULL;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(pool != 0);
+    TCN_THROW_IF_ERR(apr_pool_create(&c, tcn_get_global_pool()), c);
+    pc = (tcn_pacer_t *)apr_pcalloc(c, sizeof(tcn_pacer_t));
+    TCN_CHECK_ALLOCATED(pc);
+    pc->pool = c;
+    pc->refs = 1;
+    TCN_THROW_IF_ERR(apr_thread_mutex_create(&pc->mutex,
+                                             APR_THREAD_MUTEX_DEFAULT,
+                                             c), pc);
+    apr_pool_cleanup_register(p, (const void *)pc,
+                              pacer_cleanup,
+                              apr_pool_cleanup_null);
+    pc->rate   = rate;
+    pc->burst  = burst > 0 ? burst : TCN_MAX(rate / 10, TCN_BUFFER_SZ);
+    pc->tokens = pc->burst;
+    pc->last   = apr_time_now();
+    return P2J(pc);
+cleanup:
+    if (c)
+        apr_pool_destroy(c);
+    return 0;
+}
+
+/* Change the pacer rate at runtime. A rate of zero disables
+ * the limit without detaching the pacer.
+ */
+TCN_IMPLEMENT_CALL(void, Socket, pacerRate)(TCN_STDARGS, jlong pacer,
+                                            jlong rate, jlong burst)
+{
+    tcn_pacer_t *p = J2P(pacer, tcn_pacer_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(pacer != 0);
+    apr_thread_mutex_lock(p->mutex);
+    pacer_refill(p, apr_time_now());
+    p->rate  = rate;
+    p->burst = burst > 0 ? burst : TCN_MAX(rate / 10, TCN_BUFFER_SZ);
+    if (p->tokens > p->burst)
+        p->tokens = p->burst;
+    apr_thread_mutex_unlock(p->mutex);
+}
+
+/* Attach a pacer to the socket, or detach it if pacer is zero */
+TCN_IMPLEMENT_CALL(void, Socket, pacerSet)(TCN_STDARGS, jlong sock,
+                                           jlong pacer)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_pacer_t  *p = J2P(pacer, tcn_pacer_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (p == s->pacer)
+        return;
+    if (p)
+        apr_atomic_inc32(&p->refs);
+    sp_pacer_detach(s);
+    s->pacer = p;
+}
+
+/* Microseconds until a send of len bytes on the socket
+ * would be allowed, for scheduling the next poll.
+ */
+TCN_IMPLEMENT_CALL(jlong, Socket, pacerDelay)(TCN_STDARGS, jlong sock,
+                                              jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    tcn_pacer_t *p = s->pacer;
+    apr_interval_time_t w = 0;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (p == NULL)
+        return 0;
+    apr_thread_mutex_lock(p->mutex);
+    if (p->rate > 0) {
+        pacer_refill(p, apr_time_now());
+        w = pacer_wait(p, len > 0 ? (apr_size_t)len : 1);
+    }
+    apr_thread_mutex_unlock(p->mutex);
+    return (jlong)w;
+}
+
+/* Fill out with the bytes granted, the number of
+ * throttled sends and the time spent throttled.
+ */
+TCN_IMPLEMENT_CALL(void, Socket, pacerStats)(TCN_STDARGS, jlong pacer,
+                                             jlongArray out)
+{
+    tcn_pacer_t *p = J2P(pacer, tcn_pacer_t *);
+    jlong v[3];
+
+    UNREFERENCED(o);
+    TCN_ASSERT(pacer != 0);
+    apr_thread_mutex_lock(p->mutex);
+    v[0] = (jlong)p->passed;
+    v[1] = (jlong)p->throttled;
+    v[2] = (jlong)p->throttled_time;
+    apr_thread_mutex_unlock(p->mutex);
+    (*e)->SetLongArrayRegion(e, out, 0, 3, v);
+}
+
+/* Let the kernel pace the socket at rate bytes per second,
+ * zero or negative removes the limit.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, maxPacingRate)(TCN_STDARGS, jlong sock,
+                                                jlong rate)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+#ifdef SO_MAX_PACING_RATE
+    apr_os_sock_t sd;
+    apr_uint32_t v = (rate > 0 && rate < 0xFFFFFFFF) ? (apr_uint32_t)rate
+                                                   : 0xFFFFFFFF;
+#endif
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!s->sock)
+        return APR_ENOTSOCK;
+#ifdef SO_MAX_PACING_RATE
+    apr_os_sock_get(&sd, s->sock);
+    if (setsockopt(sd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                   (const void *)&v, sizeof(v)) == -1)
+        return apr_get_netos_error();
+    return APR_SUCCESS;
+#else
+    UNREFERENCED(rate);
+    return APR_ENOTIMPL;
+#endif
+}
+
+/* Limit the amount of unsent data in the kernel write queue */
+TCN_IMPLEMENT_CALL(jint, Socket, notsentLowat)(TCN_STDARGS, jlong sock,
+                                               jint bytes)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+#ifdef TCP_NOTSENT_LOWAT
+    apr_os_sock_t sd;
+    int v = bytes;
+#endif
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!s->sock)
+        return APR_ENOTSOCK;
+#ifdef TCP_NOTSENT_LOWAT
+    apr_os_sock_get(&sd, s->sock);
+    if (setsockopt(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   (const void *)&v, sizeof(v)) == -1)
+        return apr_get_netos_error();
+    return APR_SUCCESS;
+#else
+    UNREFERENCED(bytes);
+    return APR_ENOTIMPL;
+#endif
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendto)(TCN_STDARGS, jlong sock,
+                                         jlong where, jint flag,
+                                         jbyteArray buf, jint offset, jint tosend)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_sockaddr_t *w = J2P(where, apr_sockaddr_t *);
+    apr_size_t nbytes = (apr_size_t)tosend;
+    jbyte *bytes;
+    apr_int32_t nb;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    if (s->sock == NULL)
+        return -(jint)APR_ENOTSOCK;
+
+    apr_socket_opt_get(s->sock, APR_SO_NONBLOCK, &nb);
+    if (nb)
+         bytes = (*e)->GetPrimitiveArrayCritical(e, buf, NULL);
+    else
+         bytes = (*e)->GetByteArrayElements(e, buf, NULL);
+    TCN_ASSERT(bytes != NULL);
+    ss = apr_socket_sendto(s->sock, w, flag, (char *)(bytes + offset), &nbytes);
+
+    if (nb)
+        (*e)->ReleasePrimitiveArrayCritical(e, buf, bytes, 0);
+    else
+        (*e)->ReleaseByteArrayElements(e, buf, bytes, JNI_ABORT);
+    sp_count_io(s, 1, ss, nbytes);
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recv)(TCN_STDARGS, jlong sock,
+                                       jbyteArray buf, jint offset, jint toread)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)toread;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+
+    if (toread <= TCN_BUFFER_SZ) {
+        char sb[TCN_BUFFER_SZ];
+
+        if ((ss = (*s->net->recv)(s->opaque, sb, &nbytes)) == APR_SUCCESS)
+            (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, (jbyte*)&sb[0]);
+    }
+    else {
+        char *sb = sp_bounce_get(&nbytes);
+
+        if (sb == NULL)
+            return -APR_ENOMEM;
+        if ((ss = (*s->net->recv)(s->opaque, sb, &nbytes)) == APR_SUCCESS)
+            (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, (jbyte *)sb);
+    }
+    sp_count_io(s, 0, ss, nbytes);
+#ifdef TCN_DO_STATISTICS
+    if (ss == APR_SUCCESS) {
+        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
+        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
+        sp_tot_recv += nbytes;
+        sp_num_recv++;
+    }
+    else {
+        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
+            APR_STATUS_IS_TIMEUP(ss))
+            sp_tmo_recv++;
+        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
+                 APR_STATUS_IS_ECONNRESET(ss) ||
+                 APR_STATUS_IS_EOF(ss))
+            sp_rst_recv++;
+        else {
+            sp_err_recv++;
+            sp_erl_recv = ss;
+        }
+    }
+#endif
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvt)(TCN_STDARGS, jlong sock,
+                                        jbyteArray buf, jint offset,
+                                        jint toread, jlong timeout)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)toread;
+    apr_status_t ss;
+    apr_interval_time_t pt;
+    apr_interval_time_t nt = J2T(timeout);
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(buf != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+
+    if ((ss = (*s->net->timeout_get)(s->opaque, &pt)) != APR_SUCCESS) {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+    if (pt != nt) {
+        if ((ss = (*s->net->timeout_set)(s->opaque, nt)) != APR_SUCCESS)
+            goto cleanup;
+    }
+    if (toread <= TCN_BUFFER_SZ) {
+        jbyte sb[TCN_BUFFER_SZ];
+        if ((ss = (*s->net->recv)(s->opaque, (char *)&sb[0], &nbytes)) == APR_SUCCESS)
+            (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, &sb[0]);
+    }
+    else {
+        char *sb = sp_bounce_get(&nbytes);
+        if (sb == NULL)
+            ss = APR_ENOMEM;
+        else if ((ss = (*s->net->recv)(s->opaque, sb, &nbytes)) == APR_SUCCESS)
+            (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, (jbyte *)sb);
+    }
+    if (pt != nt) {
+        if ((ss = (*s->net->timeout_set)(s->opaque, pt)) != APR_SUCCESS)
+            goto cleanup;
+    }
+
+    sp_count_io(s, 0, ss, nbytes);
+#ifdef TCN_DO_STATISTICS
+    if (ss == APR_SUCCESS) {
+        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
+        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
+        sp_tot_recv += nbytes;
+        sp_num_recv++;
+    }
+    else {
+        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
+            APR_STATUS_IS_TIMEUP(ss))
+            sp_tmo_recv++;
+        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
+                 APR_STATUS_IS_ECONNRESET(ss) ||
+                 APR_STATUS_IS_EOF(ss))
+            sp_rst_recv++;
+        else {
+            sp_err_recv++;
+            sp_erl_recv = ss;
+        }
+    }
+#endif
+cleanup:
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvb)(TCN_STDARGS, jlong sock,
+                                        jobject buf, jint offset, jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_status_t ss;
+    apr_size_t nbytes = (apr_size_t)len;
+    char *bytes;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(buf != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+
+    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    TCN_ASSERT(bytes != NULL);
+    ss = (*s->net->recv)(s->opaque, bytes + offset, &nbytes);
+    sp_count_io(s, 0, ss, nbytes);
+#ifdef TCN_DO_STATISTICS
+    if (ss == APR_SUCCESS) {
+        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
+        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
+        sp_tot_recv += nbytes;
+        sp_num_recv++;
+    }
+    else {
+        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
+            APR_STATUS_IS_TIMEUP(ss))
+            sp_tmo_recv++;
+        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
+                 APR_STATUS_IS_ECONNRESET(ss) ||
+                 APR_STATUS_IS_EOF(ss))
+            sp_rst_recv++;
+        else {
+            sp_err_recv++;
+            sp_erl_recv = ss;
+        }
+    }
+#endif
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvbb)(TCN_STDARGS, jlong sock,
+                                         jint offset, jint len)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_status_t ss;
+    apr_size_t nbytes = (apr_size_t)len;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(s->jrbbuff != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+
+    ss = (*s->net->recv)(s->opaque, s->jrbbuff + offset, &nbytes);
+    sp_count_io(s, 0, ss, nbytes);
+#ifdef TCN_DO_STATISTICS
+    if (ss == APR_SUCCESS) {
+        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
+        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
+        sp_tot_recv += nbytes;
+        sp_num_recv++;
+    }
+    else {
+        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
+            APR_STATUS_IS_TIMEUP(ss))
+            sp_tmo_recv++;
+        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
+                 APR_STATUS_IS_ECONNRESET(ss) ||
+                 APR_STATUS_IS_EOF(ss))
+            sp_rst_recv++;
+        else {
+            sp_err_recv++;
+            sp_erl_recv = ss;
+        }
+    }
+#endif
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else if (APR_STATUS_IS_EOF(ss))
+        return 0;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvbt)(TCN_STDARGS, jlong sock,
+                                         jobject buf, jint offset,
+                                         jint len, jlong timeout)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_status_t ss;
+    apr_size_t nbytes = (apr_size_t)len;
+    char *bytes;
+    apr_interval_time_t pt;
+    apr_interval_time_t nt = J2T(timeout);
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(buf != NULL);
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+
+    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    TCN_ASSERT(bytes != NULL);
+
+    if ((ss = (*s->net->timeout_get)(s->opaque, &pt)) != APR_SUCCESS) {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+    if (pt != nt) {
+        if ((ss = (*s->net->timeout_set)(s->opaque, nt)) != APR_SUCCESS) {
+            TCN_ERROR_WRAP(ss);
+            return -(jint)ss;
+        }
+    }
+    ss = (*s->net->recv)(s->opaque, bytes + offset, &nbytes);
+    if (pt != nt) {
+        if ((ss = (*s->net->timeout_set)(s->opaque, pt)) != APR_SUCCESS) {
+            TCN_ERROR_WRAP(ss);
+            return -(jint)ss;
+        }
+    }
+
+    sp_count_io(s, 0, ss, nbytes);
+#ifdef TCN_DO_STATISTICS
+    if (ss == APR_SUCCESS) {
+        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
+        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
+        sp_tot_recv += nbytes;
+        sp_num_recv++;
+    }
+    else {
+        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
+            APR_STATUS_IS_TIMEUP(ss))
+            sp_tmo_recv++;
+        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
+                 APR_STATUS_IS_ECONNRESET(ss) ||
+                 APR_STATUS_IS_EOF(ss))
+            sp_rst_recv++;
+        else {
+            sp_err_recv++;
+            sp_erl_recv = ss;
+        }
+    }
+#endif
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvbbt)(TCN_STDARGS, jlong sock,
+                                          jint offset,
+                                          jint len, jlong timeout)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_status_t ss;
+    apr_size_t nbytes = (apr_size_t)len;
+    apr_interval_time_t pt;
+    apr_interval_time_t nt = J2T(timeout);
+
+    UNREFERENCED_STDARGS;
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->jrbbuff != NULL);
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+
+    if ((ss = (*s->net->timeout_get)(s->opaque, &pt)) != APR_SUCCESS) {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+    if (pt != nt) {
+        if ((ss = (*s->net->timeout_set)(s->opaque, nt)) != APR_SUCCESS) {
+            TCN_ERROR_WRAP(ss);
+            return -(jint)ss;
+        }
+    }
+    ss = (*s->net->recv)(s->opaque, s->jrbbuff + offset, &nbytes);
+    if (pt != nt) {
+        if ((ss = (*s->net->timeout_set)(s->opaque, pt)) != APR_SUCCESS) {
+            TCN_ERROR_WRAP(ss);
+            return -(jint)ss;
+        }
+    }
+
+    sp_count_io(s, 0, ss, nbytes);
+#ifdef TCN_DO_STATISTICS
+    if (ss == APR_SUCCESS) {
+        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
+        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
+        sp_tot_recv += nbytes;
+        sp_num_recv++;
+    }
+    else {
+        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
+            APR_STATUS_IS_TIMEUP(ss))
+            sp_tmo_recv++;
+        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
+                 APR_STATUS_IS_ECONNRESET(ss) ||
+                 APR_STATUS_IS_EOF(ss))
+            sp_rst_recv++;
+        else {
+            sp_err_recv++;
+            sp_erl_recv = ss;
+        }
+    }
+#endif
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+/* Scatter read for the network layers that do not provide one.
+ * Only the first non empty vector can be filled because a second
+ * recv could block even if the peer has nothing more to send.
+ */
+static apr_status_t sp_socket_recvv(tcn_socket_t *s, const struct iovec *vec,
+                                    apr_int32_t nvec, apr_size_t *len)
+{
+    apr_int32_t i;
+
+    if (s->net->recvv)
+        return (*s->net->recvv)(s->opaque, vec, nvec, len);
+    *len = 0;
+    for (i = 0; i < nvec; i++) {
+        if (vec[i].iov_len > 0) {
+            *len = vec[i].iov_len;
+            return (*s->net->recv)(s->opaque, (char *)vec[i].iov_base, len);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static void sp_recv_stats(apr_status_t ss, apr_size_t nbytes)
+{
+#ifdef TCN_DO_STATISTICS
+    if (ss == APR_SUCCESS) {
+        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
+        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
+        sp_tot_recv += nbytes;
+        sp_num_recv++;
+    }
+    else {
+        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
+            APR_STATUS_IS_TIMEUP(ss))
+            sp_tmo_recv++;
+        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
+                 APR_STATUS_IS_ECONNRESET(ss) ||
+                 APR_STATUS_IS_EOF(ss))
+            sp_rst_recv++;
+        else {
+            sp_err_recv++;
+            sp_erl_recv = ss;
+        }
+    }
+#else
+    UNREFERENCED(ss);
+    UNREFERENCED(nbytes);
+#endif
+}
+
+static jint sp_recvv_result(apr_status_t ss, apr_size_t nbytes)
+{
+    sp_recv_stats(ss, nbytes);
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else if (APR_STATUS_IS_EOF(ss))
+        return 0;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+/* Deadline I/O.
+ * The deadline is an absolute apr_time_t as returned by Time.now,
+ * or negative for no limit. Plain APR sockets are read and written
+ * with MSG_DONTWAIT and polled only when the call would block, so
+ * the socket timeout and its O_NONBLOCK state are never touched.
+ * Other layers have their timeout set for the remaining time.
+ */
+static apr_status_t sp_deadline_io(tcn_socket_t *s, int out, char *buf,
+                                   apr_size_t *len, apr_time_t deadline)
+{
+    apr_interval_time_t pt, nt = -1;
+    apr_status_t ss, rs;
+
+#if !defined(WIN32) && defined(MSG_DONTWAIT)
+    if (TCN_SOCKET_IS_STREAM_IO(s, out ? TCN_NLAYER_OUT : TCN_NLAYER_IN)) {
+        apr_os_sock_t sd;
+        apr_pollfd_t pfd;
+        apr_int32_t  n;
+        ssize_t      rv;
+
+        apr_os_sock_get(&sd, s->sock);
+        for (;;) {
+            if (out)
+                rv = send(sd, buf, *len, MSG_DONTWAIT);
+            else
+                rv = recv(sd, buf, *len, MSG_DONTWAIT);
+            if (rv > 0 || (rv == 0 && out)) {
+                *len = (apr_size_t)rv;
+                return APR_SUCCESS;
+            }
+            if (rv == 0) {
+                *len = 0;
+                return APR_EOF;
+            }
+            ss = apr_get_netos_error();
+            if (APR_STATUS_IS_EINTR(ss))
+                continue;
+            if (!APR_STATUS_IS_EAGAIN(ss))
+                break;
+            if (deadline >= 0 && (nt = deadline - apr_time_now()) <= 0) {
+                ss = APR_TIMEUP;
+                break;
+            }
+            pfd.p         = NULL;
+            pfd.desc_type = APR_POLL_SOCKET;
+            pfd.desc.s    = s->sock;
+            pfd.reqevents = out ? APR_POLLOUT : APR_POLLIN;
+            ss = apr_poll(&pfd, 1, &n, nt);
+            if (ss != APR_SUCCESS && !APR_STATUS_IS_EINTR(ss))
+                break;
+        }
+        *len = 0;
+        return ss;
+    }
+#endif
+    if (deadline >= 0) {
+        nt = deadline - apr_time_now();
+        if (nt <= 0)
+            nt = 0;
+    }
+    if ((ss = (*s->net->timeout_get)(s->opaque, &pt)) != APR_SUCCESS)
+        return ss;
+    if (pt != nt) {
+        if ((ss = (*s->net->timeout_set)(s->opaque, nt)) != APR_SUCCESS)
+            return ss;
+    }
+    if (out)
+        ss = (*s->net->send)(s->opaque, buf, len);
+    else
+        ss = (*s->net->recv)(s->opaque, buf, len);
+    if (pt != nt) {
+        if ((rs = (*s->net->timeout_set)(s->opaque, pt)) != APR_SUCCESS)
+            ss = rs;
+    }
+    return ss;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvd)(TCN_STDARGS, jlong sock,
+                                        jbyteArray buf, jint offset,
+                                        jint toread, jlong deadline)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)toread;
+    jbyte sb[TCN_BUFFER_SZ];
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(buf != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    /* Larger reads are returned short instead of
+     * using a temporary buffer.
+     */
+    if (nbytes > TCN_BUFFER_SZ)
+        nbytes = TCN_BUFFER_SZ;
+    ss = sp_deadline_io(s, 0, (char *)&sb[0], &nbytes, J2T(deadline));
+    if (ss == APR_SUCCESS)
+        (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, &sb[0]);
+    sp_count_io(s, 0, ss, nbytes);
+    sp_recv_stats(ss, nbytes);
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvbd)(TCN_STDARGS, jlong sock,
+                                         jobject buf, jint offset,
+                                         jint len, jlong deadline)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)len;
+    char *bytes;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(buf != NULL);
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+
+    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    TCN_ASSERT(bytes != NULL);
+    ss = sp_deadline_io(s, 0, bytes + offset, &nbytes, J2T(deadline));
+    sp_count_io(s, 0, ss, nbytes);
+    sp_recv_stats(ss, nbytes);
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+/* Send the whole buffer unless the deadline expires.
+ * Returns the number of bytes sent if some data was
+ * written before the deadline.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, sendbd)(TCN_STDARGS, jlong sock,
+                                         jobject buf, jint offset,
+                                         jint len, jlong deadline)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)len;
+    apr_size_t sent = 0;
+    char *bytes;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(buf != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, nbytes);
+    sp_min_send = TCN_MIN(sp_min_send, nbytes);
+    sp_tot_send += nbytes;
+    sp_num_send++;
+#endif
+
+    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    while (sent < nbytes) {
+        apr_size_t wr = nbytes - sent;
+        ss = sp_deadline_io(s, 1, bytes + offset + sent, &wr, J2T(deadline));
+        if (ss != APR_SUCCESS)
+            break;
+        sent += wr;
+    }
+
+    sp_count_io(s, 1, ss, sent);
+    if (ss == APR_SUCCESS || sent > 0)
+        return (jint)sent;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendd)(TCN_STDARGS, jlong sock,
+                                        jbyteArray buf, jint offset,
+                                        jint tosend, jlong deadline)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_size_t nbytes = (apr_size_t)tosend;
+    apr_size_t sent = 0;
+    jbyte sb[TCN_BUFFER_SZ];
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(s->opaque != NULL);
+    TCN_ASSERT(buf != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+#ifdef TCN_DO_STATISTICS
+    sp_max_send = TCN_MAX(sp_max_send, nbytes);
+    sp_min_send = TCN_MIN(sp_min_send, nbytes);
+    sp_tot_send += nbytes;
+    sp_num_send++;
+#endif
+
+    while (sent < nbytes) {
+        apr_size_t chunk = TCN_MIN(nbytes - sent, TCN_BUFFER_SZ);
+        apr_size_t done  = 0;
+
+        (*e)->GetByteArrayRegion(e, buf, offset + (jint)sent,
+                                 (jsize)chunk, &sb[0]);
+        while (done < chunk) {
+            apr_size_t wr = chunk - done;
+            ss = sp_deadline_io(s, 1, (char *)&sb[done], &wr,
+                                J2T(deadline));
+            if (ss != APR_SUCCESS)
+                break;
+            done += wr;
+        }
+        sent += done;
+        if (ss != APR_SUCCESS)
+            break;
+    }
+
+    sp_count_io(s, 1, ss, sent);
+    if (ss == APR_SUCCESS || sent > 0)
+        return (jint)sent;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvv)(TCN_STDARGS, jlong sock,
+                                        jobjectArray bufs,
+                                        jintArray offsets,
+                                        jintArray lens)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    jsize nvec = 0;
+    struct iovec vec[APR_MAX_IOVEC_SIZE];
+    apr_size_t nbytes = 0;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
+    if(!s->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    if ((ss = bb_iovec_fill(e, bufs, offsets, lens, vec, &nvec)) != APR_SUCCESS)
+        return -(jint)ss;
+
+    ss = sp_socket_recvv(s, vec, nvec, &nbytes);
+    sp_count_io(s, 0, ss, nbytes);
+    return sp_recvv_result(ss, nbytes);
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvva)(TCN_STDARGS, jlong sock,
+                                         jlongArray iov, jint nvec)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    struct iovec vec[APR_MAX_IOVEC_SIZE];
+    apr_size_t nbytes = 0;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(s->opaque != NULL);
     if(!s->net) {
         tcn_ThrowAPRException(e, APR_EINVALSOCK);
         return -(jint)APR_EINVALSOCK;
     }
+    if ((ss = addr_iovec_fill(e, iov, nvec, vec)) != APR_SUCCESS)
+        return -(jint)ss;
+
+    ss = sp_socket_recvv(s, vec, nvec, &nbytes);
+    sp_count_io(s, 0, ss, nbytes);
+    return sp_recvv_result(ss, nbytes);
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvfrom)(TCN_STDARGS, jlong from,
+                                          jlong sock, jint flags,
+                                          jbyteArray buf, jint offset, jint toread)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_sockaddr_t *f = J2P(from, apr_sockaddr_t *);
+    apr_size_t nbytes = (apr_size_t)toread;
+    jbyte *bytes;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock || s->sock == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(buf != NULL);
+    bytes = (*e)->GetByteArrayElements(e, buf, NULL);
+    ss = apr_socket_recvfrom(f, s->sock, (apr_int32_t)flags, (char*)(bytes + offset), &nbytes);
 
-    if ((ss = (*s->net->timeout_get)(s->opaque, &pt)) != APR_SUCCESS) {
+    (*e)->ReleaseByteArrayElements(e, buf, bytes,
+                                   nbytes ? 0 : JNI_ABORT);
+    sp_count_io(s, 0, ss, nbytes);
+    if (ss == APR_SUCCESS)
+        return (jint)nbytes;
+    else {
         TCN_ERROR_WRAP(ss);
         return -(jint)ss;
     }
-    if (pt != nt) {
-        if ((ss = (*s->net->timeout_set)(s->opaque, nt)) != APR_SUCCESS)
-            goto cleanup;
+}
+
+/* Batched datagram I/O.
+ * The direct ByteBuffer arena is split into n slots of slot bytes,
+ * one datagram per slot. The long[] msgs holds two entries per slot:
+ * the datagram length and an apr_sockaddr_t handle. For receive the
+ * address, if not zero, is filled with the datagram source address.
+ * For send it is the datagram destination, zero for connected sockets.
+ */
+static char *mmsg_arena(JNIEnv *e, jobject buf, jint slot, jint n)
+{
+    char *base = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    jlong cap  = (*e)->GetDirectBufferCapacity(e, buf);
+
+    if (base == NULL || slot <= 0 || n <= 0 ||
+        cap < (jlong)slot * (jlong)n)
+        return NULL;
+    return base;
+}
+
+#if defined(TCN_HAVE_MMSG) || defined(TCN_HAVE_UDP_GSO)
+/* Equivalent of the APR private apr_sockaddr_vars_set
+ * for addresses filled in by recvmmsg.
+ */
+static void mmsg_sockaddr_set(apr_sockaddr_t *sa, socklen_t len)
+{
+    sa->family = sa->sa.sin.sin_family;
+    sa->port   = ntohs(sa->sa.sin.sin_port);
+    sa->salen  = len;
+    if (sa->family == APR_INET) {
+        sa->ipaddr_len   = sizeof(struct in_addr);
+        sa->addr_str_len = 16;
+        sa->ipaddr_ptr   = &(sa->sa.sin.sin_addr);
     }
-    if (toread <= TCN_BUFFER_SZ) {
-        jbyte sb[TCN_BUFFER_SZ];
-        if ((ss = (*s->net->recv)(s->opaque, (char *)&sb[0], &nbytes)) == APR_SUCCESS)
-            (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, &sb[0]);
+#if APR_HAVE_IPV6
+    else if (sa->family == APR_INET6) {
+        sa->ipaddr_len   = sizeof(struct in6_addr);
+        sa->addr_str_len = 46;
+        sa->ipaddr_ptr   = &(sa->sa.sin6.sin6_addr);
+    }
+#endif
+}
+#endif
+
+TCN_IMPLEMENT_CALL(jint, Socket, recvfromBatch)(TCN_STDARGS, jlong sock,
+                                                jobject buf, jint slot,
+                                                jlongArray msgs, jint n,
+                                                jint flags)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    jlong m[TCN_MMSG_MAX * 2];
+    char *base;
+    int i, nr = 0;
+    apr_status_t ss = APR_SUCCESS;
+#ifndef TCN_HAVE_MMSG
+    apr_interval_time_t t = 0;
+#endif
+
+    UNREFERENCED(o);
+    if (!sock || s->sock == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    if (n > TCN_MMSG_MAX)
+        n = TCN_MMSG_MAX;
+    if (n <= 0 || (*e)->GetArrayLength(e, msgs) < n * 2)
+        return -(jint)APR_EINVAL;
+    if ((base = mmsg_arena(e, buf, slot, n)) == NULL)
+        return -(jint)APR_EINVAL;
+    (*e)->GetLongArrayRegion(e, msgs, 0, n * 2, m);
+
+#ifdef TCN_HAVE_MMSG
+    {
+        struct mmsghdr hdr[TCN_MMSG_MAX];
+        struct iovec   vec[TCN_MMSG_MAX];
+        apr_os_sock_t  sd;
+
+        apr_os_sock_get(&sd, s->sock);
+        memset(hdr, 0, sizeof(struct mmsghdr) * n);
+        for (i = 0; i < n; i++) {
+            apr_sockaddr_t *sa = J2P(m[i * 2 + 1], apr_sockaddr_t *);
+            vec[i].iov_base = base + (apr_size_t)i * slot;
+            vec[i].iov_len  = slot;
+            hdr[i].msg_hdr.msg_iov    = &vec[i];
+            hdr[i].msg_hdr.msg_iovlen = 1;
+            if (sa) {
+                hdr[i].msg_hdr.msg_name    = &(sa->sa);
+                hdr[i].msg_hdr.msg_namelen = sizeof(sa->sa);
+            }
+        }
+        for (;;) {
+            /* Return as soon as at least one datagram arrived */
+            nr = recvmmsg(sd, hdr, n, flags | MSG_WAITFORONE, NULL);
+            if (nr >= 0)
+                break;
+            ss = apr_get_netos_error();
+            if (APR_STATUS_IS_EINTR(ss))
+                continue;
+            if (!APR_STATUS_IS_EAGAIN(ss) ||
+                (ss = sp_socket_wait(s->sock, APR_POLLIN)) != APR_SUCCESS)
+                break;
+        }
+        for (i = 0; i < nr; i++) {
+            apr_sockaddr_t *sa = J2P(m[i * 2 + 1], apr_sockaddr_t *);
+            m[i * 2] = (jlong)hdr[i].msg_len;
+            if (sa)
+                mmsg_sockaddr_set(sa, hdr[i].msg_hdr.msg_namelen);
+        }
+    }
+#else
+    /* Receive datagrams one by one until the first one
+     * that would block.
+     */
+    if (n > 1)
+        apr_socket_timeout_get(s->sock, &t);
+    for (i = 0; i < n; i++) {
+        apr_sockaddr_t *sa = J2P(m[i * 2 + 1], apr_sockaddr_t *);
+        apr_sockaddr_t tmp;
+        apr_size_t nbytes = (apr_size_t)slot;
+
+        if (i == 1)
+            apr_socket_timeout_set(s->sock, 0);
+        ss = apr_socket_recvfrom(sa ? sa : &tmp, s->sock, (apr_int32_t)flags,
+                                 base + (apr_size_t)i * slot, &nbytes);
+        if (ss != APR_SUCCESS)
+            break;
+        m[i * 2] = (jlong)nbytes;
+        nr++;
+    }
+    if (n > 1)
+        apr_socket_timeout_set(s->sock, t);
+    if (nr > 0)
+        ss = APR_SUCCESS;
+#endif
+    if (s->stat) {
+        apr_size_t nbytes = 0;
+        for (i = 0; i < nr; i++)
+            nbytes += (apr_size_t)m[i * 2];
+        sp_count_io(s, 0, ss, nbytes);
+    }
+    if (ss == APR_SUCCESS) {
+        (*e)->SetLongArrayRegion(e, msgs, 0, nr * 2, m);
+        return (jint)nr;
     }
     else {
-        jbyte *sb = (jbyte *)malloc(nbytes);
-        if (sb == NULL)
-            return -APR_ENOMEM;
-        if ((ss = (*s->net->recv)(s->opaque, (char *)sb, &nbytes)) == APR_SUCCESS)
-            (*e)->SetByteArrayRegion(e, buf, offset, (jsize)nbytes, &sb[0]);
-        free(sb);
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
     }
-    if (pt != nt) {
-        if ((ss = (*s->net->timeout_set)(s->opaque, pt)) != APR_SUCCESS)
-            goto cleanup;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendtoBatch)(TCN_STDARGS, jlong sock,
+                                              jobject buf, jint slot,
+                                              jlongArray msgs, jint n,
+                                              jint flags)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    jlong m[TCN_MMSG_MAX * 2];
+    char *base;
+    int i, ns = 0;
+    apr_status_t ss = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    if (!sock || s->sock == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    if (n > TCN_MMSG_MAX)
+        n = TCN_MMSG_MAX;
+    if (n <= 0 || (*e)->GetArrayLength(e, msgs) < n * 2)
+        return -(jint)APR_EINVAL;
+    if ((base = mmsg_arena(e, buf, slot, n)) == NULL)
+        return -(jint)APR_EINVAL;
+    (*e)->GetLongArrayRegion(e, msgs, 0, n * 2, m);
+    for (i = 0; i < n; i++) {
+        if (m[i * 2] < 0 || m[i * 2] > slot)
+            return -(jint)APR_EINVAL;
     }
 
-#ifdef TCN_DO_STATISTICS
-    if (ss == APR_SUCCESS) {
-        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
-        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
-        sp_tot_recv += nbytes;
-        sp_num_recv++;
+#ifdef TCN_HAVE_MMSG
+    {
+        struct mmsghdr hdr[TCN_MMSG_MAX];
+        struct iovec   vec[TCN_MMSG_MAX];
+        apr_os_sock_t  sd;
+
+        apr_os_sock_get(&sd, s->sock);
+        memset(hdr, 0, sizeof(struct mmsghdr) * n);
+        for (i = 0; i < n; i++) {
+            apr_sockaddr_t *sa = J2P(m[i * 2 + 1], apr_sockaddr_t *);
+            vec[i].iov_base = base + (apr_size_t)i * slot;
+            vec[i].iov_len  = (size_t)m[i * 2];
+            hdr[i].msg_hdr.msg_iov    = &vec[i];
+            hdr[i].msg_hdr.msg_iovlen = 1;
+            if (sa) {
+                hdr[i].msg_hdr.msg_name    = &(sa->sa);
+                hdr[i].msg_hdr.msg_namelen = sa->salen;
+            }
+        }
+        for (;;) {
+            ns = sendmmsg(sd, hdr, n, flags);
+            if (ns >= 0)
+                break;
+            ss = apr_get_netos_error();
+            if (APR_STATUS_IS_EINTR(ss))
+                continue;
+            if (!APR_STATUS_IS_EAGAIN(ss) ||
+                (ss = sp_socket_wait(s->sock, APR_POLLOUT)) != APR_SUCCESS)
+                break;
+        }
+    }
+#else
+    for (i = 0; i < n; i++) {
+        apr_sockaddr_t *sa = J2P(m[i * 2 + 1], apr_sockaddr_t *);
+        apr_size_t nbytes = (apr_size_t)m[i * 2];
+
+        if (sa)
+            ss = apr_socket_sendto(s->sock, sa, (apr_int32_t)flags,
+                                   base + (apr_size_t)i * slot, &nbytes);
+        else
+            ss = apr_socket_send(s->sock, base + (apr_size_t)i * slot,
+                                 &nbytes);
+        if (ss != APR_SUCCESS)
+            break;
+        ns++;
+    }
+    if (ns > 0)
+        ss = APR_SUCCESS;
+#endif
+    if (s->stat) {
+        apr_size_t nbytes = 0;
+        for (i = 0; i < ns; i++)
+            nbytes += (apr_size_t)m[i * 2];
+        sp_count_io(s, 1, ss, nbytes);
     }
+    if (ss == APR_SUCCESS)
+        return (jint)ns;
     else {
-        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
-            APR_STATUS_IS_TIMEUP(ss))
-            sp_tmo_recv++;
-        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
-                 APR_STATUS_IS_ECONNRESET(ss) ||
-                 APR_STATUS_IS_EOF(ss))
-            sp_rst_recv++;
-        else {
-            sp_err_recv++;
-            sp_erl_recv = ss;
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+/* Send len bytes as consecutive datagrams of segsize bytes
+ * without segmentation offload.
+ */
+static apr_status_t gso_sendto_each(tcn_socket_t *s, apr_sockaddr_t *w,
+                                    apr_int32_t flags, const char *buf,
+                                    apr_size_t len, apr_size_t segsize,
+                                    apr_size_t *sent)
+{
+    apr_status_t ss = APR_SUCCESS;
+
+    *sent = 0;
+    while (*sent < len) {
+        apr_size_t nbytes = len - *sent;
+
+        if (nbytes > segsize)
+            nbytes = segsize;
+        if (w)
+            ss = apr_socket_sendto(s->sock, w, flags, buf + *sent, &nbytes);
+        else
+            ss = apr_socket_send(s->sock, buf + *sent, &nbytes);
+        if (ss != APR_SUCCESS)
+            break;
+        *sent += nbytes;
+    }
+    return *sent > 0 ? APR_SUCCESS : ss;
+}
+
+#ifdef TCN_HAVE_UDP_GSO
+static apr_status_t gso_sendto(tcn_socket_t *s, apr_sockaddr_t *w,
+                               apr_int32_t flags, const char *buf,
+                               apr_size_t len, apr_size_t segsize,
+                               apr_size_t *sent)
+{
+    struct msghdr   msg;
+    struct iovec    vec;
+    struct cmsghdr *cm;
+    char            cbuf[CMSG_SPACE(sizeof(apr_uint16_t))];
+    apr_os_sock_t   sd;
+    apr_status_t    ss;
+    ssize_t         rv;
+
+    apr_os_sock_get(&sd, s->sock);
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    vec.iov_base       = (void *)buf;
+    vec.iov_len        = len;
+    msg.msg_iov        = &vec;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (w) {
+        msg.msg_name    = &(w->sa);
+        msg.msg_namelen = w->salen;
+    }
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type  = UDP_SEGMENT;
+    cm->cmsg_len   = CMSG_LEN(sizeof(apr_uint16_t));
+    *((apr_uint16_t *)CMSG_DATA(cm)) = (apr_uint16_t)segsize;
+
+    for (;;) {
+        rv = sendmsg(sd, &msg, flags);
+        if (rv >= 0) {
+            *sent = (apr_size_t)rv;
+            return APR_SUCCESS;
         }
+        ss = apr_get_netos_error();
+        if (APR_STATUS_IS_EINTR(ss))
+            continue;
+        if (!APR_STATUS_IS_EAGAIN(ss) ||
+            (ss = sp_socket_wait(s->sock, APR_POLLOUT)) != APR_SUCCESS)
+            break;
     }
+    /* EIO means the device has no checksum offload,
+     * and EINVAL an unsupported segment layout.
+     */
+    if (ss == APR_FROM_OS_ERROR(EIO) || ss == APR_FROM_OS_ERROR(EINVAL))
+        return gso_sendto_each(s, w, flags, buf, len, segsize, sent);
+    return ss;
+}
 #endif
-cleanup:
+
+TCN_IMPLEMENT_CALL(jint, Socket, sendtoGso)(TCN_STDARGS, jlong sock,
+                                            jlong where, jint flag,
+                                            jobject buf, jint offset,
+                                            jint len, jint segsize)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_sockaddr_t *w = J2P(where, apr_sockaddr_t *);
+    apr_size_t sent = 0;
+    char *bytes;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock || s->sock == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(buf != NULL);
+    bytes = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    if (bytes == NULL || len < 0 || segsize <= 0 ||
+        segsize > 65535 || len > segsize * TCN_UDP_MAX_SEGMENTS)
+        return -(jint)APR_EINVAL;
+
+#ifdef TCN_HAVE_UDP_GSO
+    if (len > segsize)
+        ss = gso_sendto(s, w, (apr_int32_t)flag, bytes + offset,
+                        (apr_size_t)len, (apr_size_t)segsize, &sent);
+    else
+#endif
+    ss = gso_sendto_each(s, w, (apr_int32_t)flag, bytes + offset,
+                         (apr_size_t)len, (apr_size_t)segsize, &sent);
+    sp_count_io(s, 1, ss, sent);
     if (ss == APR_SUCCESS)
+        return (jint)sent;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jint)ss;
+    }
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, udpGro)(TCN_STDARGS, jlong sock,
+                                         jboolean on)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+#ifdef TCN_HAVE_UDP_GSO
+    apr_os_sock_t sd;
+    int v = on ? 1 : 0;
+#endif
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!s->sock)
+        return APR_ENOTSOCK;
+#ifdef TCN_HAVE_UDP_GSO
+    apr_os_sock_get(&sd, s->sock);
+    if (setsockopt(sd, IPPROTO_UDP, UDP_GRO, &v, sizeof(v)) == -1)
+        return apr_get_netos_error();
+    return APR_SUCCESS;
+#else
+    UNREFERENCED(on);
+    return APR_ENOTIMPL;
+#endif
+}
+
+/* Receive a datagram that may hold several coalesced segments.
+ * The segment size is stored in seg[0], or the datagram size
+ * if the kernel did not coalesce it.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, recvfromGro)(TCN_STDARGS, jlong from,
+                                              jlong sock, jint flags,
+                                              jobject buf, jint offset,
+                                              jint len, jintArray seg)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_sockaddr_t *f = J2P(from, apr_sockaddr_t *);
+    apr_size_t nbytes = (apr_size_t)len;
+    jint segsize = 0;
+    char *bytes;
+    apr_status_t ss;
+
+    UNREFERENCED(o);
+    if (!sock || s->sock == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jint)APR_ENOTSOCK;
+    }
+    TCN_ASSERT(buf != NULL);
+    bytes = (char *)(*e)->GetDirectBufferAddress(e, buf);
+    if (bytes == NULL || len < 0)
+        return -(jint)APR_EINVAL;
+
+#ifdef TCN_HAVE_UDP_GSO
+    {
+        struct msghdr   msg;
+        struct iovec    vec;
+        struct cmsghdr *cm;
+        char            cbuf[CMSG_SPACE(sizeof(int))];
+        apr_os_sock_t   sd;
+        ssize_t         rv;
+
+        apr_os_sock_get(&sd, s->sock);
+        memset(&msg, 0, sizeof(msg));
+        vec.iov_base    = bytes + offset;
+        vec.iov_len     = nbytes;
+        msg.msg_iov     = &vec;
+        msg.msg_iovlen  = 1;
+        if (f) {
+            msg.msg_name    = &(f->sa);
+            msg.msg_namelen = sizeof(f->sa);
+        }
+        for (;;) {
+            msg.msg_control    = cbuf;
+            msg.msg_controllen = sizeof(cbuf);
+            rv = recvmsg(sd, &msg, flags);
+            if (rv >= 0) {
+                ss = APR_SUCCESS;
+                break;
+            }
+            ss = apr_get_netos_error();
+            if (APR_STATUS_IS_EINTR(ss))
+                continue;
+            if (!APR_STATUS_IS_EAGAIN(ss) ||
+                (ss = sp_socket_wait(s->sock, APR_POLLIN)) != APR_SUCCESS)
+                break;
+        }
+        if (ss == APR_SUCCESS) {
+            nbytes  = (apr_size_t)rv;
+            segsize = (jint)rv;
+            for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                if (cm->cmsg_level == IPPROTO_UDP &&
+                    cm->cmsg_type  == UDP_GRO) {
+                    segsize = *((int *)CMSG_DATA(cm));
+                    break;
+                }
+            }
+            if (f)
+                mmsg_sockaddr_set(f, msg.msg_namelen);
+        }
+    }
+#else
+    if (f)
+        ss = apr_socket_recvfrom(f, s->sock, (apr_int32_t)flags,
+                                 bytes + offset, &nbytes);
+    else
+        ss = apr_socket_recv(s->sock, bytes + offset, &nbytes);
+    segsize = (jint)nbytes;
+#endif
+    sp_count_io(s, 0, ss, ss == APR_SUCCESS ? nbytes : 0);
+    if (ss == APR_SUCCESS) {
+        if (seg)
+            (*e)->SetIntArrayRegion(e, seg, 0, 1, &segsize);
         return (jint)nbytes;
+    }
     else {
         TCN_ERROR_WRAP(ss);
         return -(jint)ss;
     }
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, recvb)(TCN_STDARGS, jlong sock,
-                                        jobject buf, jint offset, jint len)
+TCN_IMPLEMENT_CALL(jint, Socket, optSet)(TCN_STDARGS, jlong sock,
+                                         jint opt, jint on)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED(o);
+    if (!s->sock) {
+        return APR_ENOTSOCK;
+    }
+    else
+        return (jint)(*s->net->opt_set)(s->opaque, (apr_int32_t)opt, (apr_int32_t)on);
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, optGet)(TCN_STDARGS, jlong sock,
+                                         jint opt)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_int32_t on = 0;
+
+    UNREFERENCED(o);
+    if (!s->sock)
+        tcn_ThrowAPRException(e, APR_ENOTSOCK);
+    else {
+        TCN_THROW_IF_ERR((*s->net->opt_get)(s->opaque, (apr_int32_t)opt,
+                                            &on), on);
+    }
+cleanup:
+    return (jint)on;
+}
+
+/* Let several listening sockets, usually in different processes,
+ * bind to the same address with the kernel spreading the
+ * connections among them. Must be set before the bind.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, reusePort)(TCN_STDARGS, jlong sock,
+                                            jboolean on)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!s->sock)
+        return APR_ENOTSOCK;
+    if (!TCN_SOCKET_IS_APR(s))
+        return APR_ENOTIMPL;
+#ifdef SO_REUSEPORT
+    {
+        apr_os_sock_t sd;
+        int one = on ? 1 : 0;
+
+        apr_os_sock_get(&sd, s->sock);
+        if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT,
+                       (void *)&one, sizeof(int)) == -1)
+            return apr_get_netos_error();
+        return APR_SUCCESS;
+    }
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+/* Control whether the socket is inherited by the child processes
+ * created by Proc.create. By default the sockets are not inherited.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, inherit)(TCN_STDARGS, jlong sock,
+                                          jboolean on)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!s->sock)
+        return APR_ENOTSOCK;
+    if (on)
+        return apr_socket_inherit_set(s->sock);
+    else
+        return apr_socket_inherit_unset(s->sock);
+}
+
+/* Return the os descriptor of the socket or -1 */
+TCN_IMPLEMENT_CALL(jlong, Socket, descriptor)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_os_sock_t sd;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!s->sock || apr_os_sock_get(&sd, s->sock) != APR_SUCCESS)
+        return -1;
+    return (jlong)sd;
+}
+
+/* Create the socket from the descriptor inherited from
+ * the parent process.
+ */
+TCN_IMPLEMENT_CALL(jlong, Socket, fromDescriptor)(TCN_STDARGS, jlong sd,
+                                                  jlong pool)
+{
+    apr_pool_t   *p = J2P(pool, apr_pool_t *);
+    tcn_socket_t *a = NULL;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(pool != 0);
+    TCN_THROW_IF_ERR(tcn_socket_import(&a, (apr_os_sock_t)sd, p), a);
+cleanup:
+    return P2J(a);
+}
+
+/* Enable or disable the per-socket I/O counters.
+ * Enabling resets them. Sockets accepted from a listening
+ * socket with enabled counters have their counters enabled.
+ */
+TCN_IMPLEMENT_CALL(void, Socket, counters)(TCN_STDARGS, jlong sock,
+                                           jboolean on)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (!on) {
+        if (s->stat)
+            s->stat->enabled = 0;
+        return;
+    }
+    if (s->stat == NULL)
+        s->stat = (tcn_sockstat_t *)apr_pcalloc(s->pool,
+                                                sizeof(tcn_sockstat_t));
+    else
+        memset(s->stat, 0, sizeof(tcn_sockstat_t));
+    s->stat->enabled = 1;
+}
+
+/* Fill out with the per-socket counters:
+ * bytes in, bytes out, reads, writes, read EAGAINs,
+ * write EAGAINs, first and last I/O time.
+ * Returns the number of entries written, 0 if disabled.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, countersGet)(TCN_STDARGS, jlong sock,
+                                              jlongArray out)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_status_t ss;
-    apr_size_t nbytes = (apr_size_t)len;
-    char *bytes;
+    tcn_sockstat_t *st;
+    jlong v[8];
+    jint n;
 
     UNREFERENCED(o);
-    if (!sock) {
+    TCN_ASSERT(sock != 0);
+    if ((st = s->stat) == NULL || !st->enabled)
+        return 0;
+    v[0] = (jlong)st->bytes_in;
+    v[1] = (jlong)st->bytes_out;
+    v[2] = (jlong)st->reads;
+    v[3] = (jlong)st->writes;
+    v[4] = (jlong)st->read_again;
+    v[5] = (jlong)st->write_again;
+    v[6] = (jlong)st->first;
+    v[7] = (jlong)st->last;
+    n = TCN_MIN((*e)->GetArrayLength(e, out), 8);
+    (*e)->SetLongArrayRegion(e, out, 0, n, v);
+    return n;
+}
+
+#ifdef TCN_HAVE_TCP_INFO
+/* Leading part of the Linux struct tcp_info.
+ * The glibc definition stops before the rate fields,
+ * so the kernel layout is declared here and the returned
+ * length tells which fields the running kernel filled.
+ */
+typedef struct {
+    apr_byte_t   state;
+    apr_byte_t   ca_state;
+    apr_byte_t   retransmits;
+    apr_byte_t   probes;
+    apr_byte_t   backoff;
+    apr_byte_t   options;
+    apr_byte_t   wscale;
+    apr_byte_t   flags;
+    apr_uint32_t rto;
+    apr_uint32_t ato;
+    apr_uint32_t snd_mss;
+    apr_uint32_t rcv_mss;
+    apr_uint32_t unacked;
+    apr_uint32_t sacked;
+    apr_uint32_t lost;
+    apr_uint32_t retrans;
+    apr_uint32_t fackets;
+    apr_uint32_t last_data_sent;
+    apr_uint32_t last_ack_sent;
+    apr_uint32_t last_data_recv;
+    apr_uint32_t last_ack_recv;
+    apr_uint32_t pmtu;
+    apr_uint32_t rcv_ssthresh;
+    apr_uint32_t rtt;
+    apr_uint32_t rttvar;
+    apr_uint32_t snd_ssthresh;
+    apr_uint32_t snd_cwnd;
+    apr_uint32_t advmss;
+    apr_uint32_t reordering;
+    apr_uint32_t rcv_rtt;
+    apr_uint32_t rcv_space;
+    apr_uint32_t total_retrans;
+    apr_uint64_t pacing_rate;
+    apr_uint64_t max_pacing_rate;
+    apr_uint64_t bytes_acked;
+    apr_uint64_t bytes_received;
+    apr_uint32_t segs_out;
+    apr_uint32_t segs_in;
+    apr_uint32_t notsent_bytes;
+    apr_uint32_t min_rtt;
+    apr_uint32_t data_segs_in;
+    apr_uint32_t data_segs_out;
+    apr_uint64_t delivery_rate;
+} sp_tcp_info_t;
+
+#define TI_HAS(ti, len, f) \
+    ((len) >= APR_OFFSETOF(sp_tcp_info_t, f) + sizeof((ti).f))
+#endif
+
+/* Fill out with a TCP_INFO snapshot:
+ * [0]  RTT (usec)           [1]  RTT variance (usec)
+ * [2]  congestion window    [3]  retransmits of the current segment
+ * [4]  unacked segments     [5]  delivery rate (bytes/sec)
+ * [6]  pacing rate          [7]  total retransmits
+ * [8]  lost segments        [9]  send MSS
+ * [10] minimum RTT (usec)   [11] unsent bytes in the write queue
+ * [12] bytes acked          [13] bytes received
+ * [14] TCP state
+ * Fields the kernel does not provide are set to -1.
+ * Returns the number of entries written or a negative error.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, tcpInfo)(TCN_STDARGS, jlong sock,
+                                          jlongArray out)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+#ifdef TCN_HAVE_TCP_INFO
+    sp_tcp_info_t ti;
+    socklen_t len = sizeof(ti);
+    apr_os_sock_t sd;
+    jlong v[15];
+    jint n;
+
+    UNREFERENCED(o);
+    if (!sock || !s->sock) {
         tcn_ThrowAPRException(e, APR_ENOTSOCK);
         return -(jint)APR_ENOTSOCK;
     }
-    TCN_ASSERT(s->opaque != NULL);
-    TCN_ASSERT(buf != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
-
-    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
-    TCN_ASSERT(bytes != NULL);
-    ss = (*s->net->recv)(s->opaque, bytes + offset, &nbytes);
-#ifdef TCN_DO_STATISTICS
-    if (ss == APR_SUCCESS) {
-        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
-        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
-        sp_tot_recv += nbytes;
-        sp_num_recv++;
-    }
-    else {
-        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
-            APR_STATUS_IS_TIMEUP(ss))
-            sp_tmo_recv++;
-        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
-                 APR_STATUS_IS_ECONNRESET(ss) ||
-                 APR_STATUS_IS_EOF(ss))
-            sp_rst_recv++;
-        else {
-            sp_err_recv++;
-            sp_erl_recv = ss;
-        }
-    }
-#endif
-    if (ss == APR_SUCCESS)
-        return (jint)nbytes;
-    else {
+    apr_os_sock_get(&sd, s->sock);
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(sd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1) {
+        apr_status_t ss = apr_get_netos_error();
         TCN_ERROR_WRAP(ss);
         return -(jint)ss;
     }
+    v[0]  = ti.rtt;
+    v[1]  = ti.rttvar;
+    v[2]  = ti.snd_cwnd;
+    v[3]  = ti.retransmits;
+    v[4]  = ti.unacked;
+    v[5]  = TI_HAS(ti, len, delivery_rate)  ? (jlong)ti.delivery_rate  : -1;
+    v[6]  = TI_HAS(ti, len, pacing_rate)    ? (jlong)ti.pacing_rate    : -1;
+    v[7]  = ti.total_retrans;
+    v[8]  = ti.lost;
+    v[9]  = ti.snd_mss;
+    v[10] = TI_HAS(ti, len, min_rtt)        ? (jlong)ti.min_rtt        : -1;
+    v[11] = TI_HAS(ti, len, notsent_bytes)  ? (jlong)ti.notsent_bytes  : -1;
+    v[12] = TI_HAS(ti, len, bytes_acked)    ? (jlong)ti.bytes_acked    : -1;
+    v[13] = TI_HAS(ti, len, bytes_received) ? (jlong)ti.bytes_received : -1;
+    v[14] = ti.state;
+
+    n = TCN_MIN((*e)->GetArrayLength(e, out), 15);
+    (*e)->SetLongArrayRegion(e, out, 0, n, v);
+    return n;
+#else
+    UNREFERENCED_STDARGS;
+    UNREFERENCED(s);
+    UNREFERENCED(out);
+    return -(jint)APR_ENOTIMPL;
+#endif
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, recvbb)(TCN_STDARGS, jlong sock,
-                                         jint offset, jint len)
+TCN_IMPLEMENT_CALL(jint, Socket, timeoutSet)(TCN_STDARGS, jlong sock,
+                                             jlong timeout)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_status_t ss;
-    apr_size_t nbytes = (apr_size_t)len;
 
     UNREFERENCED(o);
+    TCN_ASSERT(s->opaque != NULL);
     if (!sock) {
         tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
-    }
-    TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->opaque != NULL);
-    TCN_ASSERT(s->jrbbuff != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
-
-    ss = (*s->net->recv)(s->opaque, s->jrbbuff + offset, &nbytes);
-#ifdef TCN_DO_STATISTICS
-    if (ss == APR_SUCCESS) {
-        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
-        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
-        sp_tot_recv += nbytes;
-        sp_num_recv++;
-    }
-    else {
-        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
-            APR_STATUS_IS_TIMEUP(ss))
-            sp_tmo_recv++;
-        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
-                 APR_STATUS_IS_ECONNRESET(ss) ||
-                 APR_STATUS_IS_EOF(ss))
-            sp_rst_recv++;
-        else {
-            sp_err_recv++;
-            sp_erl_recv = ss;
-        }
-    }
-#endif
-    if (ss == APR_SUCCESS)
-        return (jint)nbytes;
-    else if (APR_STATUS_IS_EOF(ss))
-        return 0;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
+        return APR_ENOTSOCK;
     }
+    return (jint)(*s->net->timeout_set)(s->opaque, J2T(timeout));
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, recvbt)(TCN_STDARGS, jlong sock,
-                                         jobject buf, jint offset,
-                                         jint len, jlong timeout)
+TCN_IMPLEMENT_CALL(jlong, Socket, timeoutGet)(TCN_STDARGS, jlong sock)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_status_t ss;
-    apr_size_t nbytes = (apr_size_t)len;
-    char *bytes;
-    apr_interval_time_t pt;
-    apr_interval_time_t nt = J2T(timeout);
+    apr_interval_time_t timeout;
 
     UNREFERENCED(o);
     if (!sock) {
         tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
+        return 0;
     }
-    TCN_ASSERT(buf != NULL);
     TCN_ASSERT(s->opaque != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
 
-    bytes  = (char *)(*e)->GetDirectBufferAddress(e, buf);
-    TCN_ASSERT(bytes != NULL);
+    TCN_THROW_IF_ERR((*s->net->timeout_get)(s->opaque, &timeout), timeout);
+cleanup:
+    return (jlong)timeout;
+}
 
-    if ((ss = (*s->net->timeout_get)(s->opaque, &pt)) != APR_SUCCESS) {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
-    }
-    if (pt != nt) {
-        if ((ss = (*s->net->timeout_set)(s->opaque, nt)) != APR_SUCCESS) {
-            TCN_ERROR_WRAP(ss);
-            return -(jint)ss;
-        }
-    }
-    ss = (*s->net->recv)(s->opaque, bytes + offset, &nbytes);
-    if (pt != nt) {
-        if ((ss = (*s->net->timeout_set)(s->opaque, pt)) != APR_SUCCESS) {
-            TCN_ERROR_WRAP(ss);
-            return -(jint)ss;
-        }
-    }
+TCN_IMPLEMENT_CALL(jboolean, Socket, atmark)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    apr_int32_t mark;
 
-#ifdef TCN_DO_STATISTICS
-    if (ss == APR_SUCCESS) {
-        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
-        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
-        sp_tot_recv += nbytes;
-        sp_num_recv++;
-    }
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (s->sock == NULL)
+        return JNI_FALSE;
+
+    if (apr_socket_atmark(s->sock, &mark) != APR_SUCCESS)
+        return JNI_FALSE;
+    return mark ? JNI_TRUE : JNI_FALSE;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, zerocopy)(TCN_STDARGS, jlong sock,
+                                           jint threshold)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+#ifdef TCN_HAVE_ZEROCOPY
+    if (!s->sock)
+        return APR_ENOTSOCK;
+    if (!TCN_SOCKET_IS_APR(s))
+        return APR_ENOTIMPL;
+    if (threshold < 0)
+        s->zc_min = 0;
     else {
-        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
-            APR_STATUS_IS_TIMEUP(ss))
-            sp_tmo_recv++;
-        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
-                 APR_STATUS_IS_ECONNRESET(ss) ||
-                 APR_STATUS_IS_EOF(ss))
-            sp_rst_recv++;
-        else {
-            sp_err_recv++;
-            sp_erl_recv = ss;
-        }
+        apr_os_sock_t sd;
+        int on = 1;
+
+        apr_os_sock_get(&sd, s->sock);
+        if (setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1)
+            return apr_get_netos_error();
+        s->zc_min = threshold ? (apr_size_t)threshold : TCN_ZEROCOPY_THRESHOLD;
     }
+    return APR_SUCCESS;
+#else
+    UNREFERENCED(s);
+    UNREFERENCED(threshold);
+    return APR_ENOTIMPL;
 #endif
-    if (ss == APR_SUCCESS)
-        return (jint)nbytes;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
-    }
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, recvbbt)(TCN_STDARGS, jlong sock,
-                                          jint offset,
-                                          jint len, jlong timeout)
+TCN_IMPLEMENT_CALL(jlong, Socket, zerocopySent)(TCN_STDARGS, jlong sock)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_status_t ss;
-    apr_size_t nbytes = (apr_size_t)len;
-    apr_interval_time_t pt;
-    apr_interval_time_t nt = J2T(timeout);
 
     UNREFERENCED_STDARGS;
-    UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return -(jint)APR_ENOTSOCK;
-    }
-    TCN_ASSERT(s->jrbbuff != NULL);
-    TCN_ASSERT(s->opaque != NULL);
-    if(!s->net) {
-        tcn_ThrowAPRException(e, APR_EINVALSOCK);
-        return -(jint)APR_EINVALSOCK;
-    }
+    TCN_ASSERT(sock != 0);
+    return (jlong)apr_atomic_read32(&s->zc_sent);
+}
 
-    if ((ss = (*s->net->timeout_get)(s->opaque, &pt)) != APR_SUCCESS) {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
-    }
-    if (pt != nt) {
-        if ((ss = (*s->net->timeout_set)(s->opaque, nt)) != APR_SUCCESS) {
-            TCN_ERROR_WRAP(ss);
-            return -(jint)ss;
-        }
-    }
-    ss = (*s->net->recv)(s->opaque, s->jrbbuff + offset, &nbytes);
-    if (pt != nt) {
-        if ((ss = (*s->net->timeout_set)(s->opaque, pt)) != APR_SUCCESS) {
-            TCN_ERROR_WRAP(ss);
-            return -(jint)ss;
-        }
+/* Number of the completed zero-copy sends, or negative error
+ * if the error queue held a socket error since the last call.
+ */
+TCN_IMPLEMENT_CALL(jlong, Socket, zerocopyDone)(TCN_STDARGS, jlong sock)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (apr_atomic_read32(&s->zc_done) != apr_atomic_read32(&s->zc_sent))
+        tcn_zerocopy_drain(s);
+    if (s->zc_error) {
+        /* Report the socket error found in the error queue once */
+        apr_status_t err = s->zc_error;
+        s->zc_error = 0;
+        return -(jlong)err;
     }
+    return (jlong)apr_atomic_read32(&s->zc_done);
+}
+
+#ifdef TCN_HAVE_SPLICE
+
+static apr_status_t sp_splice_cleanup(void *data)
+{
+    tcn_splice_t *sp = (tcn_splice_t *)data;
+
+    close(sp->fd[0]);
+    close(sp->fd[1]);
+    return APR_SUCCESS;
+}
+
+/* Move up to len bytes from socket f to socket t through the
+ * pipe owned by f. Data that could not be written to t stays in
+ * the pipe and is written first on the next call.
+ * With TCN_SPLICE_NONBLOCK EAGAIN is returned instead of waiting
+ * for the socket timeout. An error hit after some data was moved
+ * is returned by the next call.
+ */
+static apr_status_t sp_splice(tcn_socket_t *f, tcn_socket_t *t,
+                              apr_size_t len, int flags,
+                              apr_size_t *moved)
+{
+    tcn_splice_t *sp = f->splice;
+    apr_os_sock_t fd, td;
+    apr_status_t ss;
+    ssize_t n;
+    int wait = !(flags & TCN_SPLICE_NONBLOCK);
+    unsigned int of = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
 
-#ifdef TCN_DO_STATISTICS
-    if (ss == APR_SUCCESS) {
-        sp_max_recv = TCN_MAX(sp_max_recv, nbytes);
-        sp_min_recv = TCN_MIN(sp_min_recv, nbytes);
-        sp_tot_recv += nbytes;
-        sp_num_recv++;
+#ifdef SPLICE_F_MORE
+    if (flags & TCN_SPLICE_MORE)
+        of |= SPLICE_F_MORE;
+#endif
+
+    *moved = 0;
+    if (!f->sock || !t->sock)
+        return APR_ENOTSOCK;
+    if (!TCN_SOCKET_IS_STREAM_IO(f, TCN_NLAYER_IN) ||
+        !TCN_SOCKET_IS_STREAM_IO(t, TCN_NLAYER_OUT))
+        return APR_ENOTIMPL;
+    if (sp == NULL) {
+        sp = (tcn_splice_t *)apr_pcalloc(f->pool, sizeof(tcn_splice_t));
+#ifdef O_CLOEXEC
+        if (pipe2(sp->fd, O_NONBLOCK | O_CLOEXEC) == -1)
+            return apr_get_os_error();
+#else
+        if (pipe(sp->fd) == -1)
+            return apr_get_os_error();
+        fcntl(sp->fd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(sp->fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+        apr_pool_cleanup_register(f->pool, (const void *)sp,
+                                  sp_splice_cleanup,
+                                  apr_pool_cleanup_null);
+        f->splice = sp;
     }
-    else {
-        if (APR_STATUS_IS_ETIMEDOUT(ss) ||
-            APR_STATUS_IS_TIMEUP(ss))
-            sp_tmo_recv++;
-        else if (APR_STATUS_IS_ECONNABORTED(ss) ||
-                 APR_STATUS_IS_ECONNRESET(ss) ||
-                 APR_STATUS_IS_EOF(ss))
-            sp_rst_recv++;
-        else {
-            sp_err_recv++;
-            sp_erl_recv = ss;
-        }
+    if (sp->error != APR_SUCCESS) {
+        ss = sp->error;
+        sp->error = APR_SUCCESS;
+        return ss;
     }
-#endif
-    if (ss == APR_SUCCESS)
-        return (jint)nbytes;
-    else {
-        TCN_ERROR_WRAP(ss);
-        return -(jint)ss;
+    apr_os_sock_get(&fd, f->sock);
+    apr_os_sock_get(&td, t->sock);
+    for (;;) {
+        while (sp->pending > 0) {
+            n = splice(sp->fd[0], NULL, td, NULL, sp->pending, of);
+            if (n > 0) {
+                sp->pending -= n;
+                *moved      += n;
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+            ss = apr_get_netos_error();
+            if (*moved > 0) {
+                if (!APR_STATUS_IS_EAGAIN(ss))
+                    sp->error = ss;
+                return APR_SUCCESS;
+            }
+            if (!APR_STATUS_IS_EAGAIN(ss))
+                return ss;
+            if (!wait || (ss = sp_socket_wait(t->sock, APR_POLLOUT)) != APR_SUCCESS)
+                return ss;
+        }
+        if (*moved >= len)
+            break;
+        n = splice(fd, NULL, sp->fd[1], NULL, len - *moved,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            sp->pending = n;
+            continue;
+        }
+        if (n == 0)
+            return *moved > 0 ? APR_SUCCESS : APR_EOF;
+        if (errno == EINTR)
+            continue;
+        ss = apr_get_netos_error();
+        if (*moved > 0) {
+            if (!APR_STATUS_IS_EAGAIN(ss))
+                sp->error = ss;
+            return APR_SUCCESS;
+        }
+        if (!APR_STATUS_IS_EAGAIN(ss))
+            return ss;
+        if (!wait || (ss = sp_socket_wait(f->sock, APR_POLLIN)) != APR_SUCCESS)
+            return ss;
     }
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, recvfrom)(TCN_STDARGS, jlong from,
-                                          jlong sock, jint flags,
-                                          jbyteArray buf, jint offset, jint toread)
+TCN_IMPLEMENT_CALL(jint, Socket, splice)(TCN_STDARGS, jlong from,
+                                         jlong to, jint len,
+                                         jint flags)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_sockaddr_t *f = J2P(from, apr_sockaddr_t *);
-    apr_size_t nbytes = (apr_size_t)toread;
-    jbyte *bytes = (*e)->GetByteArrayElements(e, buf, NULL);
+    tcn_socket_t *f = J2P(from, tcn_socket_t *);
+    tcn_socket_t *t = J2P(to, tcn_socket_t *);
+    apr_size_t moved = 0;
     apr_status_t ss;
 
     UNREFERENCED(o);
-    if (!sock) {
+    if (!from || !to) {
         tcn_ThrowAPRException(e, APR_ENOTSOCK);
         return -(jint)APR_ENOTSOCK;
     }
-    TCN_ASSERT(s->sock != NULL);
-    TCN_ASSERT(buf != NULL);
-    ss = apr_socket_recvfrom(f, s->sock, (apr_int32_t)flags, (char*)(bytes + offset), &nbytes);
+    if (!f->net || !t->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jint)APR_EINVALSOCK;
+    }
+    if (len <= 0)
+        return -(jint)APR_EINVAL;
 
-    (*e)->ReleaseByteArrayElements(e, buf, bytes,
-                                   nbytes ? 0 : JNI_ABORT);
+    ss = sp_splice(f, t, (apr_size_t)len, (int)flags, &moved);
+    sp_count_io(f, 0, ss, moved);
+    sp_count_io(t, 1, ss, moved);
     if (ss == APR_SUCCESS)
-        return (jint)nbytes;
+        return (jint)moved;
+    else if (APR_STATUS_IS_EOF(ss))
+        return 0;
     else {
         TCN_ERROR_WRAP(ss);
         return -(jint)ss;
     }
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, optSet)(TCN_STDARGS, jlong sock,
-                                         jint opt, jint on)
+TCN_IMPLEMENT_CALL(jint, Socket, splicePending)(TCN_STDARGS, jlong sock)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
 
-    UNREFERENCED(o);
-    if (!s->sock) {
-        return APR_ENOTSOCK;
-    }
-    else
-        return (jint)(*s->net->opt_set)(s->opaque, (apr_int32_t)opt, (apr_int32_t)on);
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    return s->splice ? (jint)s->splice->pending : 0;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, optGet)(TCN_STDARGS, jlong sock,
-                                         jint opt)
+TCN_IMPLEMENT_CALL(jlong, Socket, relay)(TCN_STDARGS, jlong sock1,
+                                         jlong sock2, jlong timeout)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_int32_t on = 0;
+    tcn_socket_t *s[2];
+    int done[2] = { 0, 0 };
+    apr_interval_time_t idle = J2T(timeout);
+    apr_uint64_t total = 0;
+    apr_status_t ss = APR_SUCCESS;
 
     UNREFERENCED(o);
-    if (!s->sock)
+    s[0] = J2P(sock1, tcn_socket_t *);
+    s[1] = J2P(sock2, tcn_socket_t *);
+    if (!sock1 || !sock2) {
         tcn_ThrowAPRException(e, APR_ENOTSOCK);
+        return -(jlong)APR_ENOTSOCK;
+    }
+    if (!s[0]->net || !s[1]->net) {
+        tcn_ThrowAPRException(e, APR_EINVALSOCK);
+        return -(jlong)APR_EINVALSOCK;
+    }
+    if (!TCN_SOCKET_IS_STREAM_IO(s[0], TCN_NLAYER_IN | TCN_NLAYER_OUT) ||
+        !TCN_SOCKET_IS_STREAM_IO(s[1], TCN_NLAYER_IN | TCN_NLAYER_OUT))
+        return -(jlong)APR_ENOTIMPL;
+
+    /* Pump both directions until each one hit EOF.
+     * The EOF is propagated by shutting down the write
+     * side of the opposite socket.
+     */
+    while (!done[0] || !done[1]) {
+        apr_pollfd_t pfd[2];
+        int          dir[2];
+        apr_int32_t  i, n = 0, num = 0;
+
+        for (i = 0; i < 2; i++) {
+            tcn_socket_t *f = s[i];
+            tcn_socket_t *t = s[1 - i];
+            if (done[i])
+                continue;
+            pfd[n].p         = NULL;
+            pfd[n].desc_type = APR_POLL_SOCKET;
+            if (f->splice && f->splice->pending) {
+                pfd[n].desc.s    = t->sock;
+                pfd[n].reqevents = APR_POLLOUT;
+            }
+            else {
+                pfd[n].desc.s    = f->sock;
+                pfd[n].reqevents = APR_POLLIN;
+            }
+            pfd[n].rtnevents = 0;
+            dir[n++] = i;
+        }
+        ss = apr_poll(pfd, n, &num, idle);
+        if (APR_STATUS_IS_EINTR(ss))
+            continue;
+        if (ss != APR_SUCCESS)
+            break;
+        for (i = 0; i < n; i++) {
+            apr_size_t moved = 0;
+            int d = dir[i];
+
+            if (!pfd[i].rtnevents)
+                continue;
+            ss = sp_splice(s[d], s[1 - d], TCN_SPLICE_CHUNK,
+                           TCN_SPLICE_NONBLOCK, &moved);
+            sp_count_io(s[d], 0, ss, moved);
+            sp_count_io(s[1 - d], 1, ss, moved);
+            total += moved;
+            if (APR_STATUS_IS_EOF(ss)) {
+                done[d] = 1;
+                apr_socket_shutdown(s[1 - d]->sock, APR_SHUTDOWN_WRITE);
+                ss = APR_SUCCESS;
+            }
+            else if (APR_STATUS_IS_EAGAIN(ss))
+                ss = APR_SUCCESS;
+            else if (ss != APR_SUCCESS)
+                break;
+        }
+        if (ss != APR_SUCCESS)
+            break;
+    }
+    if (ss == APR_SUCCESS)
+        return (jlong)total;
     else {
-        TCN_THROW_IF_ERR((*s->net->opt_get)(s->opaque, (apr_int32_t)opt,
-                                            &on), on);
+        TCN_ERROR_WRAP(ss);
+        return -(jlong)ss;
     }
-cleanup:
-    return (jint)on;
 }
 
-TCN_IMPLEMENT_CALL(jint, Socket, timeoutSet)(TCN_STDARGS, jlong sock,
-                                             jlong timeout)
+#else /* TCN_HAVE_SPLICE */
+
+TCN_IMPLEMENT_CALL(jint, Socket, splice)(TCN_STDARGS, jlong from,
+                                         jlong to, jint len,
+                                         jint flags)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    UNREFERENCED_STDARGS;
+    UNREFERENCED(from);
+    UNREFERENCED(to);
+    UNREFERENCED(len);
+    UNREFERENCED(flags);
+    return -(jint)APR_ENOTIMPL;
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, splicePending)(TCN_STDARGS, jlong sock)
+{
+    UNREFERENCED_STDARGS;
+    UNREFERENCED(sock);
+    return 0;
+}
+
+TCN_IMPLEMENT_CALL(jlong, Socket, relay)(TCN_STDARGS, jlong sock1,
+                                         jlong sock2, jlong timeout)
+{
+    UNREFERENCED_STDARGS;
+    UNREFERENCED(sock1);
+    UNREFERENCED(sock2);
+    UNREFERENCED(timeout);
+    return -(jlong)APR_ENOTIMPL;
+}
+
+#endif /* TCN_HAVE_SPLICE */
+
+/* Sendfile job.
+ * A list of segments, each one an optional header followed by an
+ * optional file range, sent by one or more Socket.sendfileRun calls.
+ * The job remembers how far it got, so a non-blocking socket can
+ * continue the transfer when the poller reports it writable.
+ * The files must stay open until the job is finished.
+ */
+typedef struct sf_segment_t sf_segment_t;
+struct sf_segment_t {
+    char         *head;         /* Bytes sent before the range */
+    apr_size_t    hlen;
+    apr_file_t   *file;         /* NULL for the header only segment */
+    apr_off_t     offset;
+    apr_size_t    len;
+    sf_segment_t *next;
+};
+
+typedef struct {
+    apr_pool_t   *pool;
+    sf_segment_t *head;
+    sf_segment_t *tail;
+    sf_segment_t *cur;          /* Segment being sent */
+    apr_size_t    done;         /* Bytes of the cur already sent */
+    apr_uint64_t  remaining;    /* Bytes left in the whole job */
+} sf_job_t;
+
+TCN_IMPLEMENT_CALL(jlong, Socket, sendfileJob)(TCN_STDARGS, jlong pool)
+{
+    apr_pool_t *p = J2P(pool, apr_pool_t *);
+    apr_pool_t *c = NULL;
+    sf_job_t   *j = NULL;
 
     UNREFERENCED(o);
-    TCN_ASSERT(s->opaque != NULL);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return APR_ENOTSOCK;
-    }
-    return (jint)(*s->net->timeout_set)(s->opaque, J2T(timeout));
+    TCN_ASSERT(pool != 0);
+    TCN_THROW_IF_ERR(apr_pool_create(&c, p), c);
+    j = (sf_job_t *)apr_pcalloc(c, sizeof(sf_job_t));
+    j->pool = c;
+cleanup:
+    return P2J(j);
 }
 
-TCN_IMPLEMENT_CALL(jlong, Socket, timeoutGet)(TCN_STDARGS, jlong sock)
+/* Append the header and the len bytes of the file at the offset.
+ * Either the header or the file can be omitted.
+ */
+TCN_IMPLEMENT_CALL(jint, Socket, sendfileAdd)(TCN_STDARGS, jlong job,
+                                              jbyteArray head, jlong file,
+                                              jlong offset, jlong len)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_interval_time_t timeout;
+    sf_job_t     *j = J2P(job, sf_job_t *);
+    sf_segment_t *g;
 
     UNREFERENCED(o);
-    if (!sock) {
-        tcn_ThrowAPRException(e, APR_ENOTSOCK);
-        return 0;
+    TCN_ASSERT(job != 0);
+    if (offset < 0 || len < 0 || (file == 0 && len > 0))
+        return APR_EINVAL;
+    g = (sf_segment_t *)apr_pcalloc(j->pool, sizeof(sf_segment_t));
+    if (head) {
+        g->hlen = (apr_size_t)(*e)->GetArrayLength(e, head);
+        g->head = apr_palloc(j->pool, g->hlen);
+        (*e)->GetByteArrayRegion(e, head, 0, (jsize)g->hlen,
+                                 (jbyte *)g->head);
     }
-    TCN_ASSERT(s->opaque != NULL);
-
-    TCN_THROW_IF_ERR((*s->net->timeout_get)(s->opaque, &timeout), timeout);
-cleanup:
-    return (jlong)timeout;
+    g->file   = J2P(file, apr_file_t *);
+    g->offset = (apr_off_t)offset;
+    g->len    = (apr_size_t)len;
+    if (j->tail)
+        j->tail->next = g;
+    else
+        j->head = g;
+    j->tail = g;
+    if (j->cur == NULL)
+        j->cur = g;
+    j->remaining += g->hlen + g->len;
+    return APR_SUCCESS;
 }
 
-TCN_IMPLEMENT_CALL(jboolean, Socket, atmark)(TCN_STDARGS, jlong sock)
+/* Bytes of the job not sent yet */
+TCN_IMPLEMENT_CALL(jlong, Socket, sendfileRemaining)(TCN_STDARGS,
+                                                     jlong job)
 {
-    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
-    apr_int32_t mark;
+    sf_job_t *j = J2P(job, sf_job_t *);
 
     UNREFERENCED_STDARGS;
-    TCN_ASSERT(sock != 0);
-    TCN_ASSERT(s->sock != NULL);
+    TCN_ASSERT(job != 0);
+    return (jlong)j->remaining;
+}
 
-    if (apr_socket_atmark(s->sock, &mark) != APR_SUCCESS)
-        return JNI_FALSE;
-    return mark ? JNI_TRUE : JNI_FALSE;
+TCN_IMPLEMENT_CALL(void, Socket, sendfileJobDestroy)(TCN_STDARGS,
+                                                     jlong job)
+{
+    sf_job_t *j = J2P(job, sf_job_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(job != 0);
+    apr_pool_destroy(j->pool);
 }
 
 #if APR_HAS_SENDFILE
 
+/* Clip the vector to at most max bytes.
+ * Returns the number of bytes left in the vector.
+ */
+static apr_size_t sf_iov_clip(struct iovec *vec, int *nvec, apr_size_t max)
+{
+    apr_size_t n = 0;
+    int i;
+
+    for (i = 0; i < *nvec && n < max; i++) {
+        if (vec[i].iov_len > max - n)
+            vec[i].iov_len = max - n;
+        n += vec[i].iov_len;
+    }
+    *nvec = i;
+    return n;
+}
+
 TCN_IMPLEMENT_CALL(jlong, Socket, sendfile)(TCN_STDARGS, jlong sock,
                                             jlong file,
                                             jobjectArray headers,
@@ -1242,6 +5054,7 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfile)(TCN_STDARGS, jlong sock,
     jobject tba[APR_MAX_IOVEC_SIZE];
     apr_off_t off = (apr_off_t)offset;
     apr_size_t written = (apr_size_t)len;
+    apr_size_t total, granted;
     apr_hdtr_t hdrs;
     apr_status_t ss;
 
@@ -1249,7 +5062,7 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfile)(TCN_STDARGS, jlong sock,
     TCN_ASSERT(sock != 0);
     TCN_ASSERT(file != 0);
 
-    if (s->net->type != TCN_SOCKET_APR)
+    if (!TCN_SOCKET_IS_STREAM(s))
         return (jint)(-APR_ENOTIMPL);
     if (headers)
         nh = (*e)->GetArrayLength(e, headers);
@@ -1259,15 +5072,18 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfile)(TCN_STDARGS, jlong sock,
     if (nh >= APR_MAX_IOVEC_SIZE || nt >= APR_MAX_IOVEC_SIZE)
         return (jint)(-APR_ENOMEM);
 
+    total = written;
     for (i = 0; i < nh; i++) {
         hba[i] = (*e)->GetObjectArrayElement(e, headers, i);
         hvec[i].iov_len  = (*e)->GetArrayLength(e, hba[i]);
         hvec[i].iov_base = (void *)((*e)->GetByteArrayElements(e, hba[i], NULL));
+        total += hvec[i].iov_len;
     }
     for (i = 0; i < nt; i++) {
         tba[i] = (*e)->GetObjectArrayElement(e, trailers, i);
         tvec[i].iov_len  = (*e)->GetArrayLength(e, tba[i]);
         tvec[i].iov_base = (void *)((*e)->GetByteArrayElements(e, tba[i], NULL));
+        total += tvec[i].iov_len;
     }
     hdrs.headers = &hvec[0];
     hdrs.numheaders = nh;
@@ -1275,8 +5091,27 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfile)(TCN_STDARGS, jlong sock,
     hdrs.numtrailers = nt;
 
 
-    ss = apr_socket_sendfile(s->sock, f, &hdrs, &off, &written, (apr_int32_t)flags);
+    ss = APR_SUCCESS;
+    /* The pacer is charged for the headers, file and trailers */
+    granted = total;
+    if (s->pacer && (ss = sp_pace(s, &granted)) != APR_SUCCESS)
+        written = 0;
+    else if (granted < total) {
+        /* Send only the part allowed by the pacer */
+        apr_size_t n = granted - sf_iov_clip(hvec, &hdrs.numheaders, granted);
+        written = TCN_MIN(n, written);
+        sf_iov_clip(tvec, &hdrs.numtrailers, n - written);
+    }
+    if (ss == APR_SUCCESS) {
+        if (written == 0 && granted < total)
+            ss = apr_socket_sendv(s->sock, hvec, hdrs.numheaders, &written);
+        else
+            ss = apr_socket_sendfile(s->sock, f, &hdrs, &off, &written, (apr_int32_t)flags);
+    }
+    if (s->pacer && written < granted)
+        sp_pace_refund(s, granted - written);
 
+    sp_count_io(s, 1, ss, written);
 #ifdef TCN_DO_STATISTICS
     sf_max_send = TCN_MAX(sf_max_send, written);
     sf_min_send = TCN_MIN(sf_min_send, written);
@@ -1311,6 +5146,7 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfilen)(TCN_STDARGS, jlong sock,
     apr_file_t *f = J2P(file, apr_file_t *);
     apr_off_t off = (apr_off_t)offset;
     apr_size_t written = (apr_size_t)len;
+    apr_size_t granted;
     apr_hdtr_t hdrs;
     apr_status_t ss;
 
@@ -1318,7 +5154,7 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfilen)(TCN_STDARGS, jlong sock,
     TCN_ASSERT(sock != 0);
     TCN_ASSERT(file != 0);
 
-    if (s->net->type != TCN_SOCKET_APR)
+    if (!TCN_SOCKET_IS_STREAM(s))
         return (jint)(-APR_ENOTIMPL);
 
     hdrs.headers = NULL;
@@ -1327,8 +5163,16 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfilen)(TCN_STDARGS, jlong sock,
     hdrs.numtrailers = 0;
 
 
-    ss = apr_socket_sendfile(s->sock, f, &hdrs, &off, &written, (apr_int32_t)flags);
+    ss = APR_SUCCESS;
+    if (s->pacer)
+        ss = sp_pace(s, &written);
+    granted = written;
+    if (ss == APR_SUCCESS)
+        ss = apr_socket_sendfile(s->sock, f, &hdrs, &off, &written, (apr_int32_t)flags);
+    if (s->pacer && written < granted)
+        sp_pace_refund(s, granted - written);
 
+    sp_count_io(s, 1, ss, written);
 #ifdef TCN_DO_STATISTICS
     sf_max_send = TCN_MAX(sf_max_send, written);
     sf_min_send = TCN_MIN(sf_min_send, written);
@@ -1347,6 +5191,88 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfilen)(TCN_STDARGS, jlong sock,
     }
 }
 
+/* Continue the job from where the last call stopped.
+ * Returns the bytes sent by this call, or negative error
+ * if nothing could be sent. The job is complete when
+ * Socket.sendfileRemaining returns zero.
+ */
+TCN_IMPLEMENT_CALL(jlong, Socket, sendfileRun)(TCN_STDARGS, jlong sock,
+                                               jlong job, jint flags)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    sf_job_t     *j = J2P(job, sf_job_t *);
+    apr_size_t    sent = 0;
+    apr_status_t  ss = APR_SUCCESS;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    TCN_ASSERT(job != 0);
+
+    if (!TCN_SOCKET_IS_STREAM(s))
+        return -(jlong)APR_ENOTIMPL;
+    while (j->cur) {
+        sf_segment_t *g = j->cur;
+        apr_size_t hleft = j->done < g->hlen ? g->hlen - j->done : 0;
+        apr_size_t fdone = j->done - (g->hlen - hleft);
+        apr_size_t fleft = g->len - fdone;
+        apr_size_t written, granted;
+
+        if (hleft + fleft == 0) {
+            j->cur  = g->next;
+            j->done = 0;
+            continue;
+        }
+        written = hleft + fleft;
+        if (s->pacer)
+            ss = sp_pace(s, &written);
+        granted = written;
+        if (ss == APR_SUCCESS) {
+            if (fleft == 0 || granted <= hleft) {
+                /* Only the header is left or allowed by the pacer */
+                ss = apr_socket_send(s->sock, g->head + j->done, &written);
+            }
+            else {
+                struct iovec hvec;
+                apr_hdtr_t   hdrs;
+                apr_off_t    off = g->offset + (apr_off_t)fdone;
+
+                hvec.iov_base    = g->head + j->done;
+                hvec.iov_len     = hleft;
+                hdrs.headers     = &hvec;
+                hdrs.numheaders  = hleft ? 1 : 0;
+                hdrs.trailers    = NULL;
+                hdrs.numtrailers = 0;
+                /* File bytes in, total bytes including the header out */
+                written = granted - hleft;
+                ss = apr_socket_sendfile(s->sock, g->file, &hdrs, &off,
+                                         &written, (apr_int32_t)flags);
+            }
+        }
+        if (s->pacer && written < granted)
+            sp_pace_refund(s, granted - written);
+        j->done      += written;
+        j->remaining -= written;
+        sent         += written;
+        if (ss != APR_SUCCESS)
+            break;
+    }
+
+    sp_count_io(s, 1, ss, sent);
+#ifdef TCN_DO_STATISTICS
+    sf_max_send = TCN_MAX(sf_max_send, sent);
+    sf_min_send = TCN_MIN(sf_min_send, sent);
+    sf_tot_send += sent;
+    sf_num_send++;
+#endif
+    if (ss == APR_SUCCESS || ((APR_STATUS_IS_EAGAIN(ss) ||
+                               APR_STATUS_IS_TIMEUP(ss)) && sent > 0))
+        return (jlong)sent;
+    else {
+        TCN_ERROR_WRAP(ss);
+        return -(jlong)ss;
+    }
+}
+
 #else /* APR_HAS_SENDIFLE */
 
 TCN_IMPLEMENT_CALL(jlong, Socket, sendfile)(TCN_STDARGS, jlong sock,
@@ -1382,6 +5308,16 @@ TCN_IMPLEMENT_CALL(jlong, Socket, sendfilen)(TCN_STDARGS, jlong sock,
     return -(jlong)APR_ENOTIMPL;
 }
 
+TCN_IMPLEMENT_CALL(jlong, Socket, sendfileRun)(TCN_STDARGS, jlong sock,
+                                               jlong job, jint flags)
+{
+    UNREFERENCED_STDARGS;
+    UNREFERENCED(sock);
+    UNREFERENCED(job);
+    UNREFERENCED(flags);
+    return -(jlong)APR_ENOTIMPL;
+}
+
 #endif  /* APR_HAS_SENDIFLE */
 
 
@@ -1398,8 +5334,48 @@ TCN_IMPLEMENT_CALL(jint, Socket, acceptfilter)(TCN_STDARGS,
 
 
     UNREFERENCED(o);
-    rv = apr_socket_accept_filter(s->sock, J2S(name),
-                                  J2S(args) ? J2S(args) : "");
+    if (!s->sock)
+        rv = APR_ENOTSOCK;
+    else
+        rv = apr_socket_accept_filter(s->sock, J2S(name),
+                                      J2S(args) ? J2S(args) : "");
+    TCN_FREE_CSTRING(name);
+    TCN_FREE_CSTRING(args);
+    return (jint)rv;
+#elif defined(APR_TCP_DEFER_ACCEPT)
+    /* Linux has no accept filters, but TCP_DEFER_ACCEPT gives the
+     * same "dataready" semantics: the listener is woken up only
+     * once the first data segment arrived. There is no way to wait
+     * for the complete request so "httpready" maps to the same
+     * option. The optional args is the defer timeout in seconds.
+     */
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+    TCN_ALLOC_CSTRING(name);
+    TCN_ALLOC_CSTRING(args);
+    apr_int32_t secs = TCN_DEFER_ACCEPT_TIMEOUT;
+    apr_status_t rv;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    if (!s->sock) {
+        rv = APR_ENOTSOCK;
+        goto cleanup;
+    }
+    if (J2S(args) && *J2S(args))
+        secs = (apr_int32_t)atoi(J2S(args));
+    if (!J2S(name) || !*J2S(name) || !strcmp(J2S(name), "none"))
+        secs = 0;
+    else if (strcmp(J2S(name), "dataready") &&
+             strcmp(J2S(name), "httpready") &&
+             strcmp(J2S(name), "data") &&
+             strcmp(J2S(name), "http")) {
+        rv = APR_EINVAL;
+        goto cleanup;
+    }
+    else if (secs <= 0)
+        secs = TCN_DEFER_ACCEPT_TIMEOUT;
+    rv = apr_socket_opt_set(s->sock, APR_TCP_DEFER_ACCEPT, secs);
+cleanup:
     TCN_FREE_CSTRING(name);
     TCN_FREE_CSTRING(args);
     return (jint)rv;
@@ -1412,21 +5388,124 @@ TCN_IMPLEMENT_CALL(jint, Socket, acceptfilter)(TCN_STDARGS,
 #endif
 }
 
+static apr_status_t sp_data_cleanup(void *data)
+{
+    JNIEnv *e;
+
+    if (data && tcn_get_java_env(&e) == JNI_OK)
+        (*e)->DeleteGlobalRef(e, (jobject)data);
+    return APR_SUCCESS;
+}
+
 TCN_IMPLEMENT_CALL(jint, Socket, dataSet)(TCN_STDARGS, jlong sock,
                                           jstring key, jobject data)
 {
     tcn_socket_t *s = J2P(sock, tcn_socket_t *);
     apr_status_t rv = APR_SUCCESS;
+    jobject ref = NULL;
     TCN_ALLOC_CSTRING(key);
 
     UNREFERENCED(o);
     TCN_ASSERT(sock != 0);
 
-    rv = apr_socket_data_set(s->sock, data, J2S(key), NULL);
+    /* Keep a global reference so the object stays valid
+     * after this call returns. It is released with the
+     * socket pool.
+     */
+    if (!s->sock)
+        rv = APR_ENOTSOCK;
+    else {
+        if (data)
+            ref = (*e)->NewGlobalRef(e, data);
+        rv = apr_socket_data_set(s->sock, ref, J2S(key), sp_data_cleanup);
+    }
     TCN_FREE_CSTRING(key);
     return rv;
 }
 
+/* Fixed attachment slots.
+ * Each socket has TCN_SOCKET_SLOTS jlong slots and the same number
+ * of object slots holding global references. Unlike dataSet and
+ * dataGet they are indexed and need no key lookup.
+ */
+static apr_status_t sp_slots_cleanup(void *data)
+{
+    tcn_socket_t *s = (tcn_socket_t *)data;
+    JNIEnv *e;
+    int i;
+
+    if (s->refs && tcn_get_java_env(&e) == JNI_OK) {
+        for (i = 0; i < TCN_SOCKET_SLOTS; i++) {
+            if (s->refs[i])
+                (*e)->DeleteGlobalRef(e, s->refs[i]);
+            s->refs[i] = NULL;
+        }
+    }
+    s->refs = NULL;
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(void, Socket, slotSet)(TCN_STDARGS, jlong sock,
+                                          jint idx, jlong val)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (idx < 0 || idx >= TCN_SOCKET_SLOTS)
+        return;
+    s->slot[idx] = val;
+}
+
+TCN_IMPLEMENT_CALL(jlong, Socket, slotGet)(TCN_STDARGS, jlong sock,
+                                           jint idx)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(sock != 0);
+    if (idx < 0 || idx >= TCN_SOCKET_SLOTS)
+        return 0;
+    return s->slot[idx];
+}
+
+TCN_IMPLEMENT_CALL(jint, Socket, attach)(TCN_STDARGS, jlong sock,
+                                         jint idx, jobject data)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    if (idx < 0 || idx >= TCN_SOCKET_SLOTS)
+        return APR_EINVAL;
+    if (s->refs == NULL) {
+        if (data == NULL)
+            return APR_SUCCESS;
+        s->refs = (jobject *)apr_pcalloc(s->pool,
+                                         sizeof(jobject) * TCN_SOCKET_SLOTS);
+        apr_pool_cleanup_register(s->pool, (const void *)s,
+                                  sp_slots_cleanup,
+                                  apr_pool_cleanup_null);
+    }
+    if (s->refs[idx])
+        (*e)->DeleteGlobalRef(e, s->refs[idx]);
+    s->refs[idx] = data ? (*e)->NewGlobalRef(e, data) : NULL;
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(jobject, Socket, attachment)(TCN_STDARGS, jlong sock,
+                                                jint idx)
+{
+    tcn_socket_t *s = J2P(sock, tcn_socket_t *);
+
+    UNREFERENCED(o);
+    TCN_ASSERT(sock != 0);
+    if (s->refs == NULL || idx < 0 || idx >= TCN_SOCKET_SLOTS ||
+        s->refs[idx] == NULL)
+        return NULL;
+    return (*e)->NewLocalRef(e, s->refs[idx]);
+}
+
 TCN_IMPLEMENT_CALL(jobject, Socket, dataGet)(TCN_STDARGS, jlong socket,
                                              jstring key)
 {
@@ -1437,7 +5516,8 @@ TCN_IMPLEMENT_CALL(jobject, Socket, dataGet)(TCN_STDARGS, jlong socket,
     UNREFERENCED(o);
     TCN_ASSERT(socket != 0);
 
-    if (apr_socket_data_get(&rv, J2S(key), s->sock) != APR_SUCCESS) {
+    if (!s->sock ||
+        apr_socket_data_get(&rv, J2S(key), s->sock) != APR_SUCCESS) {
         rv = NULL;
     }
     TCN_FREE_CSTRING(key);
@@ -21,6 +21,7 @@
  */
 
 #include "tcn.h"
+#include "apr_atomic.h"
 
 #ifdef TCN_DO_STATISTICS
 static int sp_created       = 0;
@@ -172,6 +173,9 @@ static apr_status_t do_add(tcn_pollset_t *p, tcn_socket_t *s,
     apr_interval_time_t timeout = socket_timeout;
     tcn_pfde_t *elem = NULL;
 
+    /* Memory sockets have no descriptor to poll */
+    if (s->sock == NULL)
+        return APR_ENOTSOCK;
     if (p->nelts == p->nalloc) {
 #ifdef TCN_DO_STATISTICS
         p->sp_overflow++;
@@ -358,7 +362,16 @@ TCN_IMPLEMENT_CALL(jint, Poll, poll)(TCN_STDARGS, jlong pollset,
             now = apr_time_now();
         for (i = 0; i < num; i++) {
             tcn_socket_t *s = (tcn_socket_t *)fd->client_data;
-            p->set[i*2+0] = (jlong)(fd->rtnevents);
+            apr_int16_t  ev = fd->rtnevents;
+            if ((ev & APR_POLLERR) &&
+                apr_atomic_read32(&s->zc_sent) != apr_atomic_read32(&s->zc_done)) {
+                /* Zero-copy completions are delivered through
+                 * the socket error queue.
+                 */
+                if (tcn_zerocopy_drain(s) > 0)
+                    ev = (ev & ~APR_POLLERR) | TCN_POLLZCOPY;
+            }
+            p->set[i*2+0] = (jlong)ev;
             p->set[i*2+1] = P2J(s);
             /* If a socket is registered for multiple events and the poller has
                multiple events to return it may do as a single pair in this
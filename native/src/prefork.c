@@ -0,0 +1,294 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** Prefork process group load board
+ *
+ * The parent process creates the listening sockets and a Shm
+ * segment, and spawns the worker processes that inherit the
+ * listeners (Socket.inherit and Socket.fromDescriptor) or bind
+ * their own with Socket.reusePort. Each worker owns one slot of
+ * the board and publishes its load and a heartbeat in it.
+ * A worker that stops updating its heartbeat, for example while
+ * in a GC pause, is treated as unhealthy, and the other workers
+ * take over its share of the accepts.
+ *
+ * @version $Id$
+ */
+
+#include "tcn.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#ifndef WIN32
+#include <time.h>
+#endif
+
+#define PF_MAGIC            0x54434e50  /* TCNP */
+
+typedef struct {
+    volatile apr_uint32_t pid;          /* Owner, zero if the slot is free */
+    volatile apr_uint32_t state;        /* TCN_PREFORK_* */
+    volatile apr_uint32_t load;         /* Active connections */
+    volatile apr_uint32_t beat;         /* Last heartbeat in msec, wraps */
+    volatile apr_uint32_t accepted;     /* Total accepted connections */
+    apr_uint32_t          reserved[3];
+} pf_slot_t;
+
+typedef struct {
+    apr_uint32_t          magic;
+    apr_uint32_t          slots;
+    volatile apr_uint32_t generation;   /* Changed on every join and leave */
+    apr_uint32_t          reserved[5];
+    pf_slot_t             slot[1];
+} pf_board_t;
+
+#define PF_SIZE(N)  (APR_OFFSETOF(pf_board_t, slot) + (N) * sizeof(pf_slot_t))
+
+/* Monotonic msec shared by all the processes, so the heartbeat
+ * age is not disturbed by the wall clock adjustments.
+ */
+static apr_uint32_t pf_now(void)
+{
+#ifdef WIN32
+    return (apr_uint32_t)GetTickCount64();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_uint32_t)((apr_uint64_t)ts.tv_sec * 1000 +
+                          ts.tv_nsec / 1000000);
+#endif
+}
+
+static apr_uint32_t pf_getpid(void)
+{
+#ifdef WIN32
+    return (apr_uint32_t)GetCurrentProcessId();
+#else
+    return (apr_uint32_t)getpid();
+#endif
+}
+
+static pf_board_t *pf_board(jlong shm)
+{
+    apr_shm_t  *s = J2P(shm, apr_shm_t *);
+    pf_board_t *b = (pf_board_t *)apr_shm_baseaddr_get(s);
+
+    if (b == NULL || b->magic != PF_MAGIC ||
+        apr_shm_size_get(s) < PF_SIZE(b->slots))
+        return NULL;
+    return b;
+}
+
+static pf_slot_t *pf_slot(jlong shm, jint slot)
+{
+    pf_board_t *b = pf_board(shm);
+
+    if (b == NULL || slot < 0 || (apr_uint32_t)slot >= b->slots)
+        return NULL;
+    return &b->slot[slot];
+}
+
+/* Running and the heartbeat is not older than stale msec */
+static int pf_healthy(pf_slot_t *x, apr_uint32_t now, apr_uint32_t stale)
+{
+    return x->pid && x->state == TCN_PREFORK_RUNNING &&
+           (now - x->beat) <= stale;
+}
+
+/* Size of the Shm segment needed for the slots */
+TCN_IMPLEMENT_CALL(jlong, Prefork, size)(TCN_STDARGS, jint slots)
+{
+    UNREFERENCED_STDARGS;
+    return (jlong)PF_SIZE(slots > 0 ? slots : 1);
+}
+
+/* Format the board. Called once by the parent process. */
+TCN_IMPLEMENT_CALL(jint, Prefork, init)(TCN_STDARGS, jlong shm,
+                                        jint slots)
+{
+    apr_shm_t  *s = J2P(shm, apr_shm_t *);
+    pf_board_t *b;
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(shm != 0);
+    b = (pf_board_t *)apr_shm_baseaddr_get(s);
+    if (b == NULL || slots < 1 || apr_shm_size_get(s) < PF_SIZE(slots))
+        return APR_EINVAL;
+    memset(b, 0, PF_SIZE(slots));
+    b->slots = (apr_uint32_t)slots;
+    b->magic = PF_MAGIC;
+    return APR_SUCCESS;
+}
+
+/* Claim a free slot for the calling process.
+ * Returns the slot number or negative error.
+ */
+TCN_IMPLEMENT_CALL(jint, Prefork, join)(TCN_STDARGS, jlong shm)
+{
+    pf_board_t  *b = pf_board(shm);
+    apr_uint32_t i, pid = pf_getpid();
+
+    UNREFERENCED_STDARGS;
+    if (b == NULL)
+        return -(jint)APR_EINVAL;
+    for (i = 0; i < b->slots; i++) {
+        pf_slot_t *x = &b->slot[i];
+        if (apr_atomic_cas32(&x->pid, pid, 0) == 0) {
+            x->load     = 0;
+            x->accepted = 0;
+            x->beat     = pf_now();
+            apr_atomic_set32(&x->state, TCN_PREFORK_RUNNING);
+            apr_atomic_inc32(&b->generation);
+            return (jint)i;
+        }
+    }
+    return -(jint)APR_ENOSPC;
+}
+
+/* Release the slot of the calling process */
+TCN_IMPLEMENT_CALL(jint, Prefork, leave)(TCN_STDARGS, jlong shm,
+                                         jint slot)
+{
+    pf_board_t *b = pf_board(shm);
+    pf_slot_t  *x = pf_slot(shm, slot);
+
+    UNREFERENCED_STDARGS;
+    if (x == NULL || x->pid != pf_getpid())
+        return APR_EINVAL;
+    apr_atomic_set32(&x->state, TCN_PREFORK_FREE);
+    apr_atomic_set32(&x->pid, 0);
+    apr_atomic_inc32(&b->generation);
+    return APR_SUCCESS;
+}
+
+/* Release the slot left by the exited worker.
+ * Called by the parent process after Proc.wait.
+ * Returns the slot number or -1 if the pid had none.
+ */
+TCN_IMPLEMENT_CALL(jint, Prefork, reap)(TCN_STDARGS, jlong shm,
+                                        jint pid)
+{
+    pf_board_t  *b = pf_board(shm);
+    apr_uint32_t i;
+
+    UNREFERENCED_STDARGS;
+    if (b == NULL || pid == 0)
+        return -1;
+    for (i = 0; i < b->slots; i++) {
+        pf_slot_t *x = &b->slot[i];
+        if (x->pid != (apr_uint32_t)pid)
+            continue;
+        /* Free the state while the pid still holds the slot,
+         * so that it cannot overwrite the state of a new owner.
+         */
+        apr_atomic_set32(&x->state, TCN_PREFORK_FREE);
+        if (apr_atomic_cas32(&x->pid, 0,
+                             (apr_uint32_t)pid) == (apr_uint32_t)pid) {
+            apr_atomic_inc32(&b->generation);
+            return (jint)i;
+        }
+    }
+    return -1;
+}
+
+/* Publish the current load and refresh the heartbeat.
+ * Should be called periodically from an ordinary Java thread,
+ * so that a stopped JVM stops the heartbeat too.
+ */
+TCN_IMPLEMENT_CALL(jint, Prefork, publish)(TCN_STDARGS, jlong shm,
+                                           jint slot, jint load,
+                                           jint accepted)
+{
+    pf_slot_t *x = pf_slot(shm, slot);
+
+    UNREFERENCED_STDARGS;
+    if (x == NULL || x->pid != pf_getpid())
+        return APR_EINVAL;
+    apr_atomic_set32(&x->load, load > 0 ? (apr_uint32_t)load : 0);
+    if (accepted > 0)
+        apr_atomic_add32(&x->accepted, (apr_uint32_t)accepted);
+    apr_atomic_set32(&x->beat, pf_now());
+    return APR_SUCCESS;
+}
+
+/* Change the state, TCN_PREFORK_DRAINING stops the new accepts */
+TCN_IMPLEMENT_CALL(jint, Prefork, state)(TCN_STDARGS, jlong shm,
+                                         jint slot, jint state)
+{
+    pf_slot_t *x = pf_slot(shm, slot);
+
+    UNREFERENCED_STDARGS;
+    if (x == NULL || x->pid == 0 || (state != TCN_PREFORK_RUNNING &&
+                                     state != TCN_PREFORK_DRAINING))
+        return APR_EINVAL;
+    apr_atomic_set32(&x->state, (apr_uint32_t)state);
+    return APR_SUCCESS;
+}
+
+/* Tell if the worker should take the next connection from the
+ * shared listener. It should, unless it is draining or its load
+ * exceeds the least loaded healthy worker by more than slack.
+ * The workers whose heartbeat is older than stale msec are ignored,
+ * so their share goes to the others.
+ */
+TCN_IMPLEMENT_CALL(jboolean, Prefork, shouldAccept)(TCN_STDARGS, jlong shm,
+                                                    jint slot, jint stale,
+                                                    jint slack)
+{
+    pf_board_t  *b = pf_board(shm);
+    pf_slot_t   *x = pf_slot(shm, slot);
+    apr_uint32_t i, now, load, low;
+
+    UNREFERENCED_STDARGS;
+    if (x == NULL)
+        return JNI_TRUE;
+    if (x->state != TCN_PREFORK_RUNNING)
+        return JNI_FALSE;
+    now  = pf_now();
+    load = x->load;
+    low  = load;
+    for (i = 0; i < b->slots; i++) {
+        pf_slot_t *y = &b->slot[i];
+        if (y != x && pf_healthy(y, now, (apr_uint32_t)stale) &&
+            y->load < low)
+            low = y->load;
+    }
+    return load <= low + (apr_uint32_t)(slack > 0 ? slack : 0) ?
+           JNI_TRUE : JNI_FALSE;
+}
+
+/* Fill the info with {pid, state, load, heartbeat age in msec,
+ * accepted} of the slot. Returns the board generation
+ * or negative error.
+ */
+TCN_IMPLEMENT_CALL(jint, Prefork, info)(TCN_STDARGS, jlong shm,
+                                        jint slot, jintArray info)
+{
+    pf_board_t *b = pf_board(shm);
+    pf_slot_t  *x = pf_slot(shm, slot);
+    jint i[5];
+
+    UNREFERENCED(o);
+    if (x == NULL || (*e)->GetArrayLength(e, info) < 5)
+        return -(jint)APR_EINVAL;
+    i[0] = (jint)x->pid;
+    i[1] = (jint)x->state;
+    i[2] = (jint)x->load;
+    i[3] = x->pid ? (jint)(pf_now() - x->beat) : 0;
+    i[4] = (jint)x->accepted;
+    (*e)->SetIntArrayRegion(e, info, 0, 5, i);
+    return (jint)(b->generation & 0x7fffffff);
+}
@@ -211,7 +211,7 @@ TCN_IMPLEMENT_CALL(jobject, SSLSocket, getInfoB)(TCN_STDARGS, jlong sock,
     UNREFERENCED(o);
     TCN_ASSERT(sock != 0);
 
-    s = (tcn_ssl_conn_t *)(a->opaque);
+    s = (tcn_ssl_conn_t *)tcn_nlayer_base(a);
     switch (what) {
         case SSL_INFO_SESSION_ID:
         {
@@ -292,7 +292,7 @@ TCN_IMPLEMENT_CALL(jstring, SSLSocket, getInfoS)(TCN_STDARGS, jlong sock,
     UNREFERENCED(o);
     TCN_ASSERT(sock != 0);
 
-    s = (tcn_ssl_conn_t *)(a->opaque);
+    s = (tcn_ssl_conn_t *)tcn_nlayer_base(a);
     switch (what) {
         case SSL_INFO_SESSION_ID:
         {
@@ -506,7 +506,7 @@ TCN_IMPLEMENT_CALL(jint, SSLSocket, getInfoI)(TCN_STDARGS, jlong sock,
     UNREFERENCED(o);
     TCN_ASSERT(sock != 0);
 
-    s = (tcn_ssl_conn_t *)(a->opaque);
+    s = (tcn_ssl_conn_t *)tcn_nlayer_base(a);
 
     switch (what) {
         case SSL_INFO_CIPHER_USEKEYSIZE:
@@ -111,6 +111,8 @@ static apr_status_t ssl_cleanup(void *data)
             X509_free(con->peer);
             con->peer = NULL;
         }
+        if (con->net && con->net->cleanup)
+            (*con->net->cleanup)(con->opaque);
     }
 
 #ifdef TCN_DO_STATISTICS
@@ -179,12 +181,18 @@ static apr_status_t wait_for_io_or_timeout(tcn_ssl_conn_t *con,
 
     if (!con->pollset)
         return APR_ENOPOLL;
-    if (!con->sock)
-        return APR_ENOTSOCK;
     if (con->reneg_state == RENEG_ABORT) {
         con->shutdown_type = SSL_SHUTDOWN_TYPE_UNCLEAN;
         return APR_ECONNABORTED;
     }
+    if (con->net) {
+        /* The transport layer does its own waiting, so the
+         * operation is retried only after its timeout expired.
+         */
+        return timeout > 0 ? APR_TIMEUP : APR_EAGAIN;
+    }
+    if (!con->sock)
+        return APR_ENOTSOCK;
 
     /* Check if the socket was already closed
      */
@@ -240,6 +248,8 @@ static apr_status_t APR_THREAD_FUNC
 ssl_socket_timeout_set(apr_socket_t *sock, apr_interval_time_t t)
 {
     tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)sock;
+    if (con->net)
+        return (*con->net->timeout_set)(con->opaque, t);
     return apr_socket_timeout_set(con->sock, t);
 }
 
@@ -247,6 +257,8 @@ static apr_status_t APR_THREAD_FUNC
 ssl_socket_timeout_get(apr_socket_t *sock, apr_interval_time_t *t)
 {
     tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)sock;
+    if (con->net)
+        return (*con->net->timeout_get)(con->opaque, t);
     return apr_socket_timeout_get(con->sock, t);
 }
 
@@ -254,6 +266,8 @@ static APR_INLINE apr_status_t APR_THREAD_FUNC
 ssl_socket_opt_set(apr_socket_t *sock, apr_int32_t opt, apr_int32_t on)
 {
     tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)sock;
+    if (con->net)
+        return (*con->net->opt_set)(con->opaque, opt, on);
     return apr_socket_opt_set(con->sock, opt, on);
 }
 
@@ -261,6 +275,8 @@ static APR_INLINE apr_status_t APR_THREAD_FUNC
 ssl_socket_opt_get(apr_socket_t *sock, apr_int32_t opt, apr_int32_t *on)
 {
     tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)sock;
+    if (con->net)
+        return (*con->net->opt_get)(con->opaque, opt, on);
     return apr_socket_opt_get(con->sock, opt, on);
 }
 
@@ -301,6 +317,8 @@ ssl_socket_close(apr_socket_t *sock)
         X509_free(con->peer);
         con->peer = NULL;
     }
+    if (con->net && con->net->close)
+        (*con->net->close)(con->opaque);
     return rv;
 }
 
@@ -318,9 +336,9 @@ TCN_IMPLEMENT_CALL(jint, SSLSocket, handshake)(TCN_STDARGS, jlong sock)
     TCN_ASSERT(sock != 0);
     if (ss->net->type != TCN_SOCKET_SSL)
         return APR_EINVAL;
-    con = (tcn_ssl_conn_t *)ss->opaque;
+    con = (tcn_ssl_conn_t *)tcn_nlayer_base(ss);
 
-    apr_socket_timeout_get(con->sock, &timeout);
+    ssl_socket_timeout_get((apr_socket_t *)con, &timeout);
     while (!SSL_is_init_finished(con->ssl)) {
         ERR_clear_error();
         if ((s = SSL_do_handshake(con->ssl)) <= 0) {
@@ -401,7 +419,7 @@ ssl_socket_recv(apr_socket_t *sock, char *buf, apr_size_t *len)
         con->shutdown_type = SSL_SHUTDOWN_TYPE_UNCLEAN;
         return APR_ECONNABORTED;
     }
-    apr_socket_timeout_get(con->sock, &timeout);
+    ssl_socket_timeout_get((apr_socket_t *)con, &timeout);
     for (;;) {
         ERR_clear_error();
         if ((s = SSL_read(con->ssl, buf, rd)) <= 0) {
@@ -480,7 +498,7 @@ ssl_socket_send(apr_socket_t *sock, const char *buf,
          */
         return APR_EINVAL;
     }
-    apr_socket_timeout_get(con->sock, &timeout);
+    ssl_socket_timeout_get((apr_socket_t *)con, &timeout);
     for (;;) {
         ERR_clear_error();
         if ((s = SSL_write(con->ssl, buf, wr)) <= 0) {
@@ -541,22 +559,89 @@ ssl_socket_sendv(apr_socket_t *sock,
                  const struct iovec *vec,
                  apr_int32_t nvec, apr_size_t *len)
 {
-    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)sock;
-    apr_status_t rv;
+    apr_status_t rv = APR_SUCCESS;
     apr_size_t written = 0;
+    apr_size_t pending = 0;
     apr_int32_t i;
+    char rb[SSL_MAX_RECORD_SZ];
 
+    /* Coalesce the vectors into full size records instead of
+     * writing (and encrypting) a separate record for each buffer.
+     * Buffers that are larger then the record size are written
+     * directly without copying.
+     */
     for (i = 0; i < nvec; i++) {
-        apr_size_t rd = vec[i].iov_len;
-        if ((rv = ssl_socket_send((apr_socket_t *)con,
-                                  vec[i].iov_base, &rd)) != APR_SUCCESS) {
-            *len = written;
-            return rv;
+        const char *b = (const char *)vec[i].iov_base;
+        apr_size_t  n = vec[i].iov_len;
+
+        while (n > 0) {
+            apr_size_t wr;
+            if (pending == 0 && n >= sizeof(rb)) {
+                wr = n - (n % sizeof(rb));
+                rv = ssl_socket_send(sock, b, &wr);
+                written += wr;
+                if (rv != APR_SUCCESS)
+                    goto cleanup;
+            }
+            else {
+                wr = TCN_MIN(n, sizeof(rb) - pending);
+                memcpy(rb + pending, b, wr);
+                pending += wr;
+                if (pending == sizeof(rb)) {
+                    apr_size_t rd = pending;
+                    pending = 0;
+                    rv = ssl_socket_send(sock, rb, &rd);
+                    written += rd;
+                    if (rv != APR_SUCCESS)
+                        goto cleanup;
+                }
+            }
+            b += wr;
+            n -= wr;
         }
+    }
+    if (pending) {
+        apr_size_t rd = pending;
+        rv = ssl_socket_send(sock, rb, &rd);
         written += rd;
     }
+cleanup:
     *len = written;
-    return APR_SUCCESS;
+    return rv;
+}
+
+static apr_status_t APR_THREAD_FUNC
+ssl_socket_recvv(apr_socket_t *sock,
+                 const struct iovec *vec,
+                 apr_int32_t nvec, apr_size_t *len)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)sock;
+    apr_status_t rv = APR_SUCCESS;
+    apr_size_t nread = 0;
+    apr_int32_t i;
+
+    /* The first read may wait for the data. The following ones
+     * are done only while OpenSSL has already decrypted data
+     * pending, so they never touch the network.
+     */
+    for (i = 0; i < nvec; i++) {
+        apr_size_t rd = vec[i].iov_len;
+        if (rd == 0)
+            continue;
+        if (nread > 0 && (!con->ssl || SSL_pending(con->ssl) <= 0))
+            break;
+        if ((rv = ssl_socket_recv(sock, (char *)vec[i].iov_base,
+                                  &rd)) != APR_SUCCESS) {
+            if (nread > 0)
+                rv = APR_SUCCESS;
+            break;
+        }
+        nread += rd;
+        if (rd < vec[i].iov_len)
+            break;
+    }
+    *len = nread;
+    return rv;
 }
 
 static tcn_nlayer_t ssl_socket_layer = {
@@ -570,10 +655,94 @@ static tcn_nlayer_t ssl_socket_layer = {
     ssl_socket_timeout_set,
     ssl_socket_send,
     ssl_socket_sendv,
-    ssl_socket_recv
+    ssl_socket_recv,
+    ssl_socket_recvv
 };
 
 
+/* BIO doing the SSL I/O through the transport layer
+ * for the sockets that have no kernel socket.
+ */
+static int nl_bio_create(BIO *b)
+{
+    b->init  = 0;
+    b->num   = -1;
+    b->ptr   = NULL;
+    b->flags = 0;
+    return 1;
+}
+
+static int nl_bio_destroy(BIO *b)
+{
+    if (b == NULL)
+        return 0;
+    b->ptr  = NULL;
+    b->init = 0;
+    return 1;
+}
+
+static int nl_bio_write(BIO *b, const char *in, int inl)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)b->ptr;
+    apr_size_t n = (apr_size_t)inl;
+    apr_status_t rv;
+
+    BIO_clear_retry_flags(b);
+    if (!b->init || in == NULL || inl <= 0)
+        return 0;
+    rv = (*con->net->send)(con->opaque, in, &n);
+    if (n > 0)
+        return (int)n;
+    if (APR_STATUS_IS_EAGAIN(rv) || APR_STATUS_IS_TIMEUP(rv))
+        BIO_set_retry_write(b);
+    return -1;
+}
+
+static int nl_bio_read(BIO *b, char *out, int outl)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)b->ptr;
+    apr_size_t n = (apr_size_t)outl;
+    apr_status_t rv;
+
+    BIO_clear_retry_flags(b);
+    if (!b->init || out == NULL || outl <= 0)
+        return 0;
+    rv = (*con->net->recv)(con->opaque, out, &n);
+    if (n > 0)
+        return (int)n;
+    if (APR_STATUS_IS_EOF(rv))
+        return 0;
+    if (APR_STATUS_IS_EAGAIN(rv) || APR_STATUS_IS_TIMEUP(rv))
+        BIO_set_retry_read(b);
+    return -1;
+}
+
+static int nl_bio_puts(BIO *b, const char *in)
+{
+    return nl_bio_write(b, in, (int)strlen(in));
+}
+
+static long nl_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    /* Nothing is buffered in the BIO itself */
+    if (cmd == BIO_CTRL_FLUSH)
+        return 1;
+    return 0;
+}
+
+static BIO_METHOD nl_bio_methods = {
+    BIO_TYPE_SOURCE_SINK,
+    "Network Layer",
+    nl_bio_write,
+    nl_bio_read,
+    nl_bio_puts,
+    NULL,
+    nl_bio_ctrl,
+    nl_bio_create,
+    nl_bio_destroy,
+    NULL
+};
+
 TCN_IMPLEMENT_CALL(jint, SSLSocket, attach)(TCN_STDARGS, jlong ctx,
                                             jlong sock)
 {
@@ -587,19 +756,37 @@ TCN_IMPLEMENT_CALL(jint, SSLSocket, attach)(TCN_STDARGS, jlong ctx,
     TCN_ASSERT(ctx != 0);
     TCN_ASSERT(sock != 0);
 
-    if (!s->sock)
-        return APR_ENOTSOCK;
-
-    if ((rv = apr_os_sock_get(&oss, s->sock)) != APR_SUCCESS)
-        return rv;
-    if (oss == APR_INVALID_SOCKET)
+    /* SSL must be the first layer above the socket */
+    if (s->link)
+        return APR_EINVAL;
+    if (s->sock) {
+        if ((rv = apr_os_sock_get(&oss, s->sock)) != APR_SUCCESS)
+            return rv;
+        if (oss == APR_INVALID_SOCKET)
+            return APR_ENOTSOCK;
+    }
+    else if (!s->net || s->net->type != TCN_SOCKET_MEMORY)
         return APR_ENOTSOCK;
 
     if ((con = ssl_create(e, c, s->pool)) == NULL)
         return APR_EGENERAL;
-    con->sock = s->sock;
-
-    SSL_set_fd(con->ssl, (int)oss);
+    if (s->sock) {
+        con->sock = s->sock;
+        SSL_set_fd(con->ssl, (int)oss);
+    }
+    else {
+        BIO *bio;
+        if ((bio = BIO_new(&nl_bio_methods)) == NULL) {
+            SSL_free(con->ssl);
+            con->ssl = NULL;
+            return APR_ENOMEM;
+        }
+        bio->ptr  = con;
+        bio->init = 1;
+        SSL_set_bio(con->ssl, bio, bio);
+        con->net    = s->net;
+        con->opaque = s->opaque;
+    }
     if (c->mode)
         SSL_set_accept_state(con->ssl);
     else
@@ -623,7 +810,7 @@ TCN_IMPLEMENT_CALL(jint, SSLSocket, renegotiate)(TCN_STDARGS,
 
     UNREFERENCED_STDARGS;
     TCN_ASSERT(sock != 0);
-    con = (tcn_ssl_conn_t *)s->opaque;
+    con = (tcn_ssl_conn_t *)tcn_nlayer_base(s);
 
     /* Sequence to renegotiate is
      *  SSL_renegotiate()
@@ -649,7 +836,7 @@ TCN_IMPLEMENT_CALL(jint, SSLSocket, renegotiate)(TCN_STDARGS,
     }
     SSL_set_state(con->ssl, SSL_ST_ACCEPT);
 
-    apr_socket_timeout_get(con->sock, &timeout);
+    ssl_socket_timeout_get((apr_socket_t *)con, &timeout);
     ecode = SSL_ERROR_WANT_READ;
     while (ecode == SSL_ERROR_WANT_READ) {
         retVal = SSL_do_handshake(con->ssl);
@@ -685,7 +872,7 @@ TCN_IMPLEMENT_CALL(void, SSLSocket, setVerify)(TCN_STDARGS,
 
     UNREFERENCED_STDARGS;
     TCN_ASSERT(sock != 0);
-    con = (tcn_ssl_conn_t *)s->opaque;
+    con = (tcn_ssl_conn_t *)tcn_nlayer_base(s);
 
     if (cverify == SSL_CVERIFY_UNSET)
         cverify = SSL_CVERIFY_NONE;